@@ -2,14 +2,18 @@
  * Sometimes I need something better that grafana or a %top like program,
  * and to test short spikes in CPU much faster, so this code will do it
  * at 100HZ, plus get a list of the 5 most CPU intensive processes.
- * I use gcc -std=c2x -O3 -Wall -Wextra cpu100.c -o cpu100 to compile it,
+ * I use gcc -std=c2x -O3 -Wall -Wextra -pthread cpu100.c -o cpu100 to compile it,
  * and to run it ./cpu100 &> some_log_file.
 */
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,7 +22,30 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/bpf.h>
+#include <linux/io_uring.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
 
 // Global flag for clean shutdown on Ctrl+C
 static volatile sig_atomic_t keep_running = 1;
@@ -26,453 +53,8308 @@ static void on_sigint(int sig) { (void)sig; keep_running = 0; }
 
 // Structs for storing CPU and process statistics
 typedef struct { unsigned long long idle, total; } cpu_sample;
-typedef struct { int pid; unsigned long long ticks; char comm[64]; } proc_sample;
-typedef struct { int pid; char comm[64]; double pct; } proc_usage;
+
+// Per-CPU /proc/stat counters by column, for --breakdown
+// Stored column-major, times[field * n + cpu], so one tick's deltas for all
+// fields and CPUs are a single array subtraction the compiler vectorizes
+enum { CPU_USER, CPU_NICE, CPU_SYSTEM, CPU_IDLE, CPU_IOWAIT, CPU_IRQ,
+       CPU_SOFTIRQ, CPU_STEAL, CPU_GUEST, CPU_GUEST_NICE, CPU_FIELDS };
+typedef struct {
+    int pid;
+    int tgid;
+    char comm[64];
+    const char *cmdline;        // Cached command line with --cmdline, else NULL
+    double pct;
+    unsigned long long ticks;
+    unsigned long long start;   // Start time, with the PID the process identity
+    int cpu;                    // Processor it last ran on, -1 if unknown
+    int prev_cpu;               // Processor at the previous sample, -1 if unknown
+    unsigned long long minflt;  // Minor faults since the previous sample
+    unsigned long long majflt;  // Major faults since the previous sample
+    // Scheduler counters over the last tick with --counters, -1 until known
+    long long vcsw, ivcsw;      // Voluntary and involuntary context switches
+    long long run_ns, wait_ns;  // Time on a CPU and waiting on a run queue
+} proc_usage;
+typedef struct comm_pool comm_pool;
 
 // Process cache to avoid constant memory reallocation
+// Stored as structure-of-arrays: the per-tick selection scans only deltas[],
+// so idle processes cost one 8-byte compare instead of a whole sample
+typedef struct {
+    int *pids;                  // Process (or thread) IDs
+    int *tgids;                 // Owning processes
+    int *fds;                   // Cached stat descriptors, -1 if none
+    uint32_t *comms;            // Name handles into pool
+    unsigned long long *ticks;  // utime + stime
+    unsigned long long *starts; // Start time, with the PID the process identity
+    unsigned long long *deltas; // ticks since the previous sample, 0 if new
+    unsigned long long *minflts;  // Minor faults, cumulative
+    unsigned long long *majflts;  // Major faults, cumulative
+    int *cpus;                  // Processor last run on, -1 if unknown
+    comm_pool *pool;            // Names, shared by a cache pair
+    int capacity;               // Current allocated capacity
+    int count;                  // Number of active processes
+} proc_cache;
+
+// Budget for persistent /proc/[pid]/stat descriptors, set from RLIMIT_NOFILE
+static int fd_budget = 0;
+static atomic_int fd_cached = 0;
+
+// Process tree the samplers read, a synthetic fixture with --proc-root
+#define PROC_ROOT_MAX 192      // Leaves room for "/[pid]/task/[tid]/stat"
+static const char *proc_root = "/proc";
+
+static int *cpu_ids;           // CPU number of each /proc/stat column, ascending
+
+/**
+ * Counts the per-CPU lines of the stat file under proc_root and records
+ * their CPU numbers in cpu_ids
+ * Only online CPUs have a line, so these are the columns; a fixture
+ * describes its own machine, which need not be this one
+ * Returns: Number of cpuN lines
+ */
+static int stat_cpus(void) {
+    char path[256];
+    snprintf(path, sizeof path, "%s/stat", proc_root);
+    FILE *f = fopen(path, "re");
+    if (!f) { perror(path); exit(1); }
+    char line[512];
+    int n = 0, cap = 0;
+    free(cpu_ids);
+    cpu_ids = NULL;
+    while (fgets(line, sizeof line, f)) {
+        if (strncmp(line, "cpu", 3) == 0 && isdigit((unsigned char)line[3])) {
+            if (n == cap) cpu_ids = realloc(cpu_ids, (cap = cap ? cap * 2 : 64) * sizeof *cpu_ids);
+            cpu_ids[n++] = atoi(line + 3);
+        }
+        // Skip the rest of overlong lines
+        while (!strchr(line, '\n') && fgets(line, sizeof line, f))
+            ;
+    }
+    fclose(f);
+    if (n < 1) { fprintf(stderr, "%s: no cpu lines\n", path); exit(1); }
+    return n;
+}
+
+/**
+ * Pins the calling thread to one CPU core
+ * This reduces interference with other processes being monitored
+ * @param cpu: Core to run on
+ */
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set; CPU_ZERO(&set); CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity"); exit(1);
+    }
+}
+
+/**
+ * Parses a CPU list such as "62,63" or "60-63"
+ * @param list: Comma separated CPU numbers and ranges
+ * @param cpus: Output array, to free()
+ * Returns: Number of CPUs, or -1 on a malformed list
+ */
+static int parse_cpu_list(const char *list, int **cpus) {
+    int count = 0, capacity = 8;
+    *cpus = malloc(capacity * sizeof **cpus);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0) goto bad;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) goto bad;
+        }
+        if (hi >= CPU_SETSIZE) goto bad;
+        for (long c = lo; c <= hi; c++) {
+            if (count == capacity) *cpus = realloc(*cpus, (capacity *= 2) * sizeof **cpus);
+            (*cpus)[count++] = (int)c;
+        }
+        if (*end == ',') end++;
+        else if (*end) goto bad;
+        p = end;
+    }
+    if (count > 0) return count;
+bad:
+    free(*cpus);
+    *cpus = NULL;
+    return -1;
+}
+
+/*
+ * CPU topology
+ * sysfs maps each /proc/stat column to its NUMA node, its package and its
+ * core, the SMT siblings that share one set of execution units, and names
+ * the CPUs kept clear of housekeeping work with isolcpus= or nohz_full=.
+ * A fixture under --proc-root is treated as one node and package without
+ * SMT, since this machine's sysfs does not describe it.
+ */
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+// Columns grouped by node, package or core for --topology
+typedef struct {
+    const char *name;          // Heading of the --topology line
+    int ngroups;
+    int *of;                   // Group of each column
+    int *key;                  // Node, package or first CPU of each group
+    char (*label)[32];         // Group names
+    unsigned long long *busy, *total;  // Per-tick sums, per group
+} cpu_grouping;
+
+static cpu_grouping topo_nodes = { .name = "nodes" };
+static cpu_grouping topo_packages = { .name = "packages" };
+static cpu_grouping topo_cores = { .name = "cores" };
+static int show_topology;      // Print per-node, per-package and per-core usage
+
+/**
+ * Reads a short sysfs file into a NUL terminated string, without the newline
+ * Returns: Length, or -1 if it cannot be read
+ */
+static int read_sysfs(const char *path, char *buf, size_t sz) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t len = read(fd, buf, sz - 1);
+    close(fd);
+    if (len < 0) return -1;
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' ')) len--;
+    buf[len] = '\0';
+    return (int)len;
+}
+
+/**
+ * Reads a sysfs CPU list such as /sys/devices/system/cpu/online
+ * @param path: File to read
+ * @param cpus: Output array, to free(), NULL when the list is empty
+ * Returns: Number of CPUs, 0 if the file is missing or empty
+ */
+static int read_sysfs_cpus(const char *path, int **cpus) {
+    char buf[4096];
+    *cpus = NULL;
+    if (read_sysfs(path, buf, sizeof buf) <= 0) return 0;
+    int n = parse_cpu_list(buf, cpus);
+    return n > 0 ? n : 0;
+}
+
+/**
+ * Finds or adds the group of a key and assigns a column to it
+ */
+static void group_assign(cpu_grouping *g, int col, int key, const char *label) {
+    int k = 0;
+    while (k < g->ngroups && g->key[k] != key) k++;
+    if (k == g->ngroups) {
+        g->key[k] = key;
+        snprintf(g->label[k], sizeof g->label[k], "%s", label);
+        g->ngroups++;
+    }
+    g->of[col] = k;
+}
+
+/**
+ * Maps each column to its node, package and core
+ * @param n: Number of columns, with cpu_ids filled by stat_cpus()
+ */
+static void topology_init(int n) {
+    cpu_grouping *groups[] = { &topo_nodes, &topo_packages, &topo_cores };
+    for (int i = 0; i < 3; i++) {
+        cpu_grouping *g = groups[i];
+        g->ngroups = 0;
+        g->of = calloc(n, sizeof *g->of);
+        g->key = calloc(n, sizeof *g->key);
+        g->label = calloc(n, sizeof *g->label);
+        g->busy = calloc(n, sizeof *g->busy);
+        g->total = calloc(n, sizeof *g->total);
+    }
+    int flat = strcmp(proc_root, "/proc") != 0;
+    
+    // Node of every CPU number, from the nodes' CPU lists
+    int max_id = cpu_ids[n - 1];
+    int *node_by_cpu = malloc((max_id + 1) * sizeof *node_by_cpu);
+    for (int c = 0; c <= max_id; c++) node_by_cpu[c] = 0;
+    DIR *dir = flat ? NULL : opendir(SYSFS_NODE);
+    struct dirent *de;
+    while (dir && (de = readdir(dir))) {
+        if (strncmp(de->d_name, "node", 4) != 0 || !isdigit((unsigned char)de->d_name[4])) continue;
+        char path[512];
+        snprintf(path, sizeof path, SYSFS_NODE "/%s/cpulist", de->d_name);
+        int *cpus, count = read_sysfs_cpus(path, &cpus);
+        for (int k = 0; k < count; k++) {
+            if (cpus[k] <= max_id) node_by_cpu[cpus[k]] = atoi(de->d_name + 4);
+        }
+        free(cpus);
+    }
+    if (dir) closedir(dir);
+    
+    for (int i = 0; i < n; i++) {
+        int id = cpu_ids[i];
+        char path[512], buf[256], label[32];
+        snprintf(label, sizeof label, "%d", node_by_cpu[id]);
+        group_assign(&topo_nodes, i, node_by_cpu[id], label);
+        
+        int package = 0;
+        snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/physical_package_id", id);
+        if (!flat && read_sysfs(path, buf, sizeof buf) > 0) package = atoi(buf);
+        snprintf(label, sizeof label, "%d", package);
+        group_assign(&topo_packages, i, package, label);
+        
+        // A core is named by its siblings, e.g. 0+64
+        int *siblings = NULL, nsib = 0;
+        if (!flat) {
+            snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/core_cpus_list", id);
+            nsib = read_sysfs_cpus(path, &siblings);
+            if (!nsib) {
+                snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/thread_siblings_list", id);
+                nsib = read_sysfs_cpus(path, &siblings);
+            }
+        }
+        size_t len = 0;
+        for (int k = 0; k < nsib && len < sizeof label; k++) {
+            len += (size_t)snprintf(label + len, sizeof label - len, "%s%d", k ? "+" : "", siblings[k]);
+        }
+        if (!nsib) snprintf(label, sizeof label, "%d", id);
+        group_assign(&topo_cores, i, nsib ? siblings[0] : id, label);
+        free(siblings);
+    }
+    free(node_by_cpu);
+}
+
+/**
+ * Picks a CPU for a monitor thread
+ * Prefers the highest-numbered CPU of the node that this process may run
+ * on and that is neither isolated nor nohz_full, so the monitor stays off
+ * the CPUs set aside for latency-sensitive work
+ * @param node: NUMA node to pick from, or -1 for any online CPU
+ * Returns: CPU number; -1 if the node has no CPU this process may use,
+ *          which cannot happen for node -1
+ */
+static int housekeeping_cpu(int node) {
+    char path[256];
+    int *cpus, n = 0;
+    if (node >= 0) {
+        snprintf(path, sizeof path, SYSFS_NODE "/node%d/cpulist", node);
+        n = read_sysfs_cpus(path, &cpus);
+    }
+    if (!n) n = read_sysfs_cpus(SYSFS_CPU "/online", &cpus);
+    if (!n) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 ? (int)online : 1;
+        cpus = malloc(n * sizeof *cpus);
+        for (int i = 0; i < n; i++) cpus[i] = i;
+    }
+    int *isolated, nisolated = read_sysfs_cpus(SYSFS_CPU "/isolated", &isolated);
+    int *nohz, nnohz = read_sysfs_cpus(SYSFS_CPU "/nohz_full", &nohz);
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) CPU_SET(c, &allowed);
+    }
+    
+    int best = -1, fallback = -1;
+    for (int i = 0; i < n; i++) {
+        int c = cpus[i];
+        if (c >= CPU_SETSIZE || !CPU_ISSET(c, &allowed)) continue;
+        if (c > fallback) fallback = c;
+        int reserved = 0;
+        for (int k = 0; k < nisolated; k++) reserved |= isolated[k] == c;
+        for (int k = 0; k < nnohz; k++) reserved |= nohz[k] == c;
+        if (!reserved && c > best) best = c;
+    }
+    for (int c = 0; c < CPU_SETSIZE && node < 0; c++) {
+        if (fallback < 0 && CPU_ISSET(c, &allowed)) fallback = c;
+    }
+    free(cpus);
+    free(isolated);
+    free(nohz);
+    return best >= 0 ? best : fallback;
+}
+
+/**
+ * Picks one housekeeping CPU on each NUMA node that has CPUs
+ * @param cpus: Output array, to free()
+ * Returns: Number of CPUs, at least 1
+ */
+static int housekeeping_per_node(int **cpus) {
+    int *nodes, nnodes = read_sysfs_cpus(SYSFS_NODE "/has_cpu", &nodes);
+    *cpus = malloc((nnodes ? nnodes : 1) * sizeof **cpus);
+    int n = 0;
+    for (int i = 0; i < nnodes; i++) {
+        int c = housekeeping_cpu(nodes[i]);
+        if (c >= 0) (*cpus)[n++] = c;
+    }
+    if (!n) (*cpus)[n++] = housekeeping_cpu(-1);
+    free(nodes);
+    return n;
+}
+
+/**
+ * Raises the open file limit so per-PID stat descriptors can stay open
+ * A few descriptors are kept in reserve for /proc/stat, stdio and the like
+ */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) { perror("getrlimit"); exit(1); }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    rlim_t budget = rl.rlim_cur > 64 ? rl.rlim_cur - 64 : 0;
+    fd_budget = budget > 1 << 20 ? 1 << 20 : (int)budget;
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static long long mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Self-profiling (--profile)
+ * Each phase of a tick is timed with CLOCK_MONOTONIC_RAW, which the vDSO
+ * serves without a syscall, into a log-linear histogram: values below 32ns
+ * are exact and above that each power of two is split into 16 buckets, so
+ * percentiles are within about 3% of the true latency.
+ */
+#define PROF_SUB_BITS 4
+#define PROF_BUCKETS ((48 - PROF_SUB_BITS + 1) << PROF_SUB_BITS)   // Up to 2^48 ns
+
+enum { PH_STAT, PH_WALK, PH_PIDS, PH_SELECT, PH_MERGE, PH_COUNTERS, PH_THREADS,
+       PH_CGROUPS, PH_PSI, PH_FORMAT, PH_FLUSH, PH_TICK, PH_COUNT };
+
+static const char *const phase_names[PH_COUNT] = {
+    "stat", "walk", "pids", "select", "merge", "counters", "threads", "cgroups",
+    "psi", "format", "flush", "tick",
+};
+
+typedef struct {
+    uint64_t count, sum, max;       // Samples, total and largest ns
+    uint32_t buckets[PROF_BUCKETS];
+} phase_hist;
+
+static int profiling = 0;                    // --profile given
+static phase_hist prof[PH_COUNT];            // Phases timed on the main thread
+static volatile sig_atomic_t profile_dump = 0;  // SIGUSR1 asked for a report
+static void on_sigusr1(int sig) { (void)sig; profile_dump = 1; }
+
+/**
+ * Raw monotonic clock in nanoseconds, free of NTP slewing
+ */
+static inline long long prof_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Maps a latency to its histogram bucket
+ */
+static inline int prof_bucket(uint64_t v) {
+    if (v >= 1ULL << 48) v = (1ULL << 48) - 1;
+    if (v < 2u << PROF_SUB_BITS) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - PROF_SUB_BITS + 1) << PROF_SUB_BITS) |
+           (int)((v >> (e - PROF_SUB_BITS)) & ((1u << PROF_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the midpoint of a histogram bucket
+ */
+static uint64_t prof_bucket_value(int i) {
+    if (i < 2 << PROF_SUB_BITS) return (uint64_t)i;
+    int e = (i >> PROF_SUB_BITS) + PROF_SUB_BITS - 1;
+    uint64_t width = 1ULL << (e - PROF_SUB_BITS);
+    return ((uint64_t)((1 << PROF_SUB_BITS) | (i & ((1 << PROF_SUB_BITS) - 1))) << (e - PROF_SUB_BITS)) +
+           width / 2;
+}
+
+/**
+ * Starts timing a phase
+ * Returns: Start time, 0 when not profiling
+ */
+static inline long long prof_start(void) {
+    return profiling ? prof_ns() : 0;
+}
+
+/**
+ * Ends a phase and records its duration
+ * @param hists: Histograms indexed by phase, unused when not profiling
+ * @param phase: Phase that ended
+ * @param start: From prof_start() or the previous prof_lap()
+ * Returns: End time, which starts the next phase
+ */
+static inline long long prof_lap(phase_hist *hists, int phase, long long start) {
+    if (!profiling) return 0;
+    phase_hist *h = &hists[phase];
+    long long now = prof_ns();
+    uint64_t v = now > start ? (uint64_t)(now - start) : 0;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->buckets[prof_bucket(v)]++;
+    return now;
+}
+
+/**
+ * Finds a percentile of a histogram
+ * @param h: Histogram
+ * @param p: Fraction, e.g. 0.99
+ * Returns: Latency in ns, never above the recorded maximum
+ */
+static uint64_t prof_percentile(const phase_hist *h, double p) {
+    uint64_t want = (uint64_t)(p * (double)h->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < PROF_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            uint64_t v = prof_bucket_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Hand-written /proc parsers
+ * /proc only ever prints plain unsigned decimals separated by single spaces,
+ * so there is no need for sscanf's locale handling and format interpretation
+ * on the hot path. Both /proc/stat and /proc/[pid]/stat go through these.
+ */
+
+/**
+ * Parses an unsigned decimal and advances past it
+ * @param pp: In/out parse position, left on the first non-digit
+ * Returns: Parsed value (0 if no digits)
+ */
+static inline unsigned long long parse_ull(const char **pp) {
+    const char *p = *pp;
+    unsigned long long v = 0;
+    unsigned int d;
+    while ((d = (unsigned char)*p - '0') < 10) {
+        v = v * 10 + d;
+        p++;
+    }
+    *pp = p;
+    return v;
+}
+
+/**
+ * Skips space separated fields
+ * @param p: Start of the first field to skip
+ * @param n: Number of fields to skip
+ * Returns: Start of the following field, or NULL if the line ends first
+ */
+static inline const char *skip_fields(const char *p, int n) {
+    for (; n > 0; n--) {
+        while (*p != ' ') {
+            if (*p == '\0' || *p == '\n') return NULL;
+            p++;
+        }
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Skips space separated fields eight bytes at a time
+ * For the long runs of numeric fields in /proc/[pid]/stat: each word's
+ * spaces are flagged and counted at once, and only the word holding the
+ * last one is searched. The tail, and big-endian machines, go through
+ * skip_fields()
+ * @param p: Start of the first field to skip
+ * @param end: End of the line
+ * @param n: Number of fields to skip
+ * Returns: Start of the following field, or NULL if the line ends first
+ */
+static inline const char *skip_fields_wide(const char *p, const char *end, int n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL, spaces = 0x2020202020202020ULL;
+    while (n > 0 && end - p >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        uint64_t t = x ^ spaces;
+        uint64_t m = ~(((t & low7) + low7) | t | low7);   // High bit of each ' ' byte
+        int c = __builtin_popcountll(m);
+        if (c >= n) {
+            while (--n) m &= m - 1;
+            return p + (__builtin_ctzll(m) >> 3) + 1;
+        }
+        n -= c;
+        p += 8;
+    }
+#else
+    (void)end;
+#endif
+    return skip_fields(p, n);
+}
+
+/**
+ * Parses one "cpuN ..." line of /proc/stat
+ * @param line: Start of the line
+ * @param v: Output for up to 10 time fields
+ * Returns: Number of fields parsed, or -1 if the line is not a cpuN line
+ */
+static int parse_cpu_line(const char *line, unsigned long long v[10]) {
+    if (line[0] != 'c' || line[1] != 'p' || line[2] != 'u') return -1;
+    const char *p = line + 3;
+    const char *q = p;
+    parse_ull(&q);
+    if (q == p) return -1;  // Aggregate "cpu" line has no number
+    
+    int m = 0;
+    p = q;
+    while (m < 10 && *p == ' ') {
+        while (*p == ' ') p++;
+        q = p;
+        v[m] = parse_ull(&q);
+        if (q == p) break;
+        p = q;
+        m++;
+    }
+    return m;
+}
+
+// Fields of /proc/[pid]/stat that the monitor uses
+typedef struct {
+    const char *comm;          // Process name, not NUL terminated
+    int comm_len;              // Length of comm
+    unsigned long long minflt; // Field 10
+    unsigned long long majflt; // Field 12
+    unsigned long long utime;  // Field 14
+    unsigned long long stime;  // Field 15
+    unsigned long long starttime;  // Field 22, ticks after boot
+    int processor;             // Field 39, -1 if the line ends before it
+} pid_stat;
+
+/**
+ * Parses a /proc/[pid]/stat line
+ * comm may contain spaces and parentheses, so it ends at the last ')'
+ * @param buf: Stat line
+ * @param len: Length of the line
+ * @param out: Parsed fields
+ * Returns: 0 on success, -1 on malformed input
+ */
+static int parse_pid_stat(const char *buf, size_t len, pid_stat *out) {
+    const char *comm_start = memchr(buf, '(', len);
+    const char *comm_end = memrchr(buf, ')', len);
+    if (!comm_start || !comm_end || comm_end <= comm_start) return -1;
+    
+    // Skip ") " and state plus 6 more fields to reach minflt (field 10); the
+    // children's counts in fields 11 and 13 are skipped on the way to utime
+    const char *p = skip_fields(comm_end + 2, 7);
+    if (!p) return -1;
+    
+    const char *q = p;
+    out->minflt = parse_ull(&q);
+    if (q == p || *q != ' ') return -1;
+    p = q = skip_fields(q + 1, 1);
+    if (!p) return -1;
+    out->majflt = parse_ull(&q);
+    if (q == p || *q != ' ') return -1;
+    p = q = skip_fields(q + 1, 1);
+    if (!p) return -1;
+    out->utime = parse_ull(&q);
+    if (q == p || *q != ' ') return -1;
+    p = q = q + 1;
+    out->stime = parse_ull(&q);
+    if (q == p || *q != ' ') return -1;
+    
+    // Fields 16 to 21 sit between stime and starttime
+    const char *end = buf + len;
+    p = skip_fields_wide(q + 1, end, 6);
+    if (!p) return -1;
+    q = p;
+    out->starttime = parse_ull(&q);
+    if (q == p) return -1;
+    
+    // Fields 23 to 38 sit between starttime and processor
+    out->processor = -1;
+    if (*q == ' ' && (p = skip_fields_wide(q + 1, end, 16))) {
+        q = p;
+        unsigned long long cpu = parse_ull(&q);
+        if (q != p) out->processor = (int)cpu;
+    }
+    
+    out->comm = comm_start + 1;
+    out->comm_len = (int)(comm_end - comm_start - 1);
+    return 0;
+}
+
+static cpu_sample *held_cpus;            // Last counters of each column
+static unsigned long long *held_times;   // and their columns for --breakdown
+
+/**
+ * Repeats a column's last counters, for a CPU that has gone offline
+ */
+static void hold_cpu(cpu_sample *out, unsigned long long *times, int n, int i) {
+    out[i] = held_cpus[i];
+    if (times) {
+        for (int k = 0; k < CPU_FIELDS; k++) times[k * n + i] = held_times[k * n + i];
+    }
+}
+
+/**
+ * Reads CPU statistics from /proc/stat efficiently
+ * Uses persistent file descriptor and buffer to minimize syscall overhead
+ * Only the cpu block at the top of the file is copied: the read size is
+ * learned from the previous tick, the buffer grows as needed and keeps its
+ * size, and reading stops as soon as the cpuN lines are in, which skips
+ * the very long "intr" line that follows them
+ * @param out: Array to store CPU samples (one per CPU core)
+ * @param n: Number of CPUs to read
+ * @param times: CPU_FIELDS * n column-major counters to fill, or NULL
+ */
+static void read_proc_stat_optimized(cpu_sample *out, int n, unsigned long long *times) {
+    static int fd = -1;           // Persistent file descriptor
+    static char *buf = NULL;      // Reusable buffer
+    static size_t bufsize = 8192; // Buffer size for /proc/stat content
+    static size_t want = 8191;    // Bytes to request, from the last cpu block
+    
+    // Initialize on first call
+    if (fd == -1) {
+        char path[256];
+        snprintf(path, sizeof path, "%s/stat", proc_root);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) { perror(path); exit(1); }
+        buf = malloc(bufsize);
+        if (!buf) { perror("malloc"); exit(1); }
+        held_cpus = calloc(n, sizeof *held_cpus);
+        held_times = calloc((size_t)CPU_FIELDS * n, sizeof *held_times);
+    }
+    
+    // Read until the cpu block is complete, or EOF; it ends at the first
+    // line not starting with "cpu", which also holds when CPUs went
+    // offline or came online since start
+    size_t total = 0, scanned = 0;
+    int done = 0;
+    for (;;) {
+        if (total + 1 >= bufsize) {
+            bufsize *= 2;
+            buf = realloc(buf, bufsize);
+            if (!buf) { perror("realloc"); exit(1); }
+        }
+        size_t room = bufsize - 1 - total;
+        size_t ask = total < want ? want - total : room;
+        ssize_t bytes = pread(fd, buf + total, ask < room ? ask : room, (off_t)total);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) { perror("read /proc/stat"); exit(1); }
+        if (bytes == 0) break;
+        total += (size_t)bytes;
+        
+        while (total - scanned >= 3) {
+            if (scanned && memcmp(buf + scanned, "cpu", 3) != 0) { done = 1; break; }
+            char *nl = memchr(buf + scanned, '\n', total - scanned);
+            if (!nl) break;
+            scanned = (size_t)(nl - buf) + 1;
+        }
+        if (done) break;
+    }
+    if (total == 0) { fprintf(stderr, "read /proc/stat: empty\n"); exit(1); }
+    buf[total] = '\0';
+    
+    // Next tick asks for the cpu block plus some slack in a single read
+    if (done) want = scanned + scanned / 8 + 64;
+    
+    // Parse CPU statistics line by line
+    char *line = buf;
+    char *next = strchr(line, '\n');
+    if (next) { line = next + 1; } // Skip aggregate "cpu" line
+    
+    // Process each CPU core's statistics; a line is matched to its column
+    // by CPU number, and a CPU taken offline since start keeps its last
+    // counters so it reads as idle
+    int i = 0;
+    while (i < n && strncmp(line, "cpu", 3) == 0 && isdigit((unsigned char)line[3])) {
+        next = strchr(line, '\n');
+        if (!next) { fprintf(stderr, "Unexpected EOF in /proc/stat\n"); exit(1); }
+        int id = atoi(line + 3);
+        while (i < n && cpu_ids[i] < id) hold_cpu(out, times, n, i++);
+        if (i == n || cpu_ids[i] != id) { line = next + 1; continue; }  // Came online later
+        
+        // Parse the 10 CPU time fields:
+        // user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice
+        unsigned long long v[10] = {0};
+        int m = parse_cpu_line(line, v);
+        
+        if (m < 4) { fprintf(stderr, "Parse error in /proc/stat\n"); exit(1); }
+        
+        // Calculate idle time (idle + iowait) and total time
+        unsigned long long idle = v[3] + v[4];
+        unsigned long long sum = 0;
+        for (int k = 0; k < m; k++) sum += v[k];
+        out[i] = (cpu_sample){idle, sum};
+        held_cpus[i] = out[i];
+        if (times) {
+            for (int k = 0; k < CPU_FIELDS; k++) times[k * n + i] = held_times[k * n + i] = v[k];
+        }
+        
+        line = next + 1;
+        i++;
+    }
+    while (i < n) hold_cpu(out, times, n, i++);
+}
+
+// Open-addressing table for O(1) process ID lookups
+// Slots are reused across ticks: a slot is live only if its generation
+// matches the table's, so clearing is a counter bump instead of free()
+typedef struct {
+    int pid;               // Process ID
+    int index;             // Index in the process array
+    unsigned int gen;      // Generation the slot was written in
+} pid_slot;
+
+typedef struct {
+    pid_slot *slots;       // Power of two sized slot array
+    unsigned int bits;     // log2 of the slot count
+    unsigned int gen;      // Current generation
+    int used;              // Live slots in the current generation
+} pid_table;
+
+/**
+ * Allocates an empty PID table
+ * @param t: Table to initialize
+ * @param bits: log2 of the initial slot count
+ */
+static void pid_table_init(pid_table *t, unsigned int bits) {
+    t->slots = calloc((size_t)1 << bits, sizeof(pid_slot));
+    if (!t->slots) { perror("calloc"); exit(1); }
+    t->bits = bits;
+    t->gen = 1;
+    t->used = 0;
+}
+
+/**
+ * Empties the table in O(1) by starting a new generation
+ * @param t: Table to clear
+ */
+static void pid_table_clear(pid_table *t) {
+    if (++t->gen == 0) {  // Wrapped: old generations could match again
+        memset(t->slots, 0, ((size_t)1 << t->bits) * sizeof(pid_slot));
+        t->gen = 1;
+    }
+    t->used = 0;
+}
+
+/**
+ * Fibonacci hash of a process ID
+ * Sequential PIDs land far apart, which keeps linear probe runs short
+ * @param pid: Process ID to hash
+ * @param bits: log2 of the slot count
+ * Returns: Home slot index
+ */
+static unsigned int pid_hash(int pid, unsigned int bits) {
+    return ((unsigned int)pid * 2654435769u) >> (32 - bits);
+}
+
+/**
+ * Finds a process in the PID table
+ * @param t: Table to search
+ * @param pid: Process ID to look up
+ * Returns: Index in the process array, or -1 if not present
+ */
+static int pid_lookup(const pid_table *t, int pid) {
+    unsigned int mask = (1u << t->bits) - 1;
+    for (unsigned int h = pid_hash(pid, t->bits);; h = (h + 1) & mask) {
+        const pid_slot *slot = &t->slots[h];
+        if (slot->gen != t->gen) return -1;
+        if (slot->pid == pid) return slot->index;
+    }
+}
+
+static void pid_table_insert(pid_table *t, int pid, int index);
+
+/**
+ * Doubles the slot count and re-inserts the live slots
+ * @param t: Table to grow
+ */
+static void pid_table_grow(pid_table *t) {
+    pid_slot *old = t->slots;
+    size_t old_size = (size_t)1 << t->bits;
+    unsigned int gen = t->gen;
+    
+    pid_table_init(t, t->bits + 1);
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].gen == gen) pid_table_insert(t, old[i].pid, old[i].index);
+    }
+    free(old);
+}
+
+/**
+ * Adds a process to the PID table, growing it past half full
+ * @param t: Table to insert into
+ * @param pid: Process ID, must not already be present
+ * @param index: Index in the process array
+ */
+static void pid_table_insert(pid_table *t, int pid, int index) {
+    if ((size_t)(t->used + 1) * 2 > (size_t)1 << t->bits) pid_table_grow(t);
+    
+    unsigned int mask = (1u << t->bits) - 1;
+    unsigned int h = pid_hash(pid, t->bits);
+    while (t->slots[h].gen == t->gen) h = (h + 1) & mask;
+    t->slots[h] = (pid_slot){pid, index, t->gen};
+    t->used++;
+}
+
+/**
+ * Sets the index stored for a process, inserting it if absent
+ * @param t: Table to update
+ * @param pid: Process ID
+ * @param index: New index
+ */
+static void pid_table_update(pid_table *t, int pid, int index) {
+    unsigned int mask = (1u << t->bits) - 1;
+    for (unsigned int h = pid_hash(pid, t->bits); t->slots[h].gen == t->gen;
+         h = (h + 1) & mask) {
+        if (t->slots[h].pid == pid) { t->slots[h].index = index; return; }
+    }
+    pid_table_insert(t, pid, index);
+}
+
+/**
+ * Closes a cached per-PID stat descriptor
+ * @param fd: Descriptor to close, ignored if -1
+ */
+static void close_stat_fd(int fd) {
+    if (fd == -1) return;
+    close(fd);
+    fd_cached--;
+}
+
+// Process names, stored once per process lifetime
+// Caches refer to names by handle; a handle moves from the previous cache
+// to the current one with its process and is released when the process
+// disappears, so a steady-state tick copies no names at all. Command lines
+// are read the first time a process makes the top list with --cmdline and
+// kept until it execs or renames itself
+#define COMM_NONE UINT32_MAX   // Handle of an unnamed sample
+#define CMDLINE_MAX 256        // Command line bytes kept per process
+static int show_cmdline = 0;   // --cmdline: print command lines for the top N
+
+struct comm_pool {
+    char (*names)[64];     // Name slots
+    char **cmdlines;       // Cached command lines, NULL until first needed
+    uint32_t *free_list;   // Released slots, reused first
+    uint32_t nfree;
+    uint32_t count;        // Slots handed out at least once
+    uint32_t capacity;
+};
+
+/**
+ * Stores a name in the pool
+ * @param pool: Pool
+ * @param comm: Name, not NUL terminated
+ * @param len: Name length
+ * Returns: Handle for the name
+ */
+static uint32_t comm_alloc(comm_pool *pool, const char *comm, int len) {
+    uint32_t h;
+    if (pool->nfree) {
+        h = pool->free_list[--pool->nfree];
+    } else {
+        if (pool->count == pool->capacity) {
+            pool->capacity = pool->capacity ? pool->capacity * 2 : 1024;
+            pool->names = realloc(pool->names, pool->capacity * sizeof *pool->names);
+            pool->cmdlines = realloc(pool->cmdlines, pool->capacity * sizeof *pool->cmdlines);
+            pool->free_list = realloc(pool->free_list,
+                                      pool->capacity * sizeof *pool->free_list);
+        }
+        h = pool->count++;
+    }
+    pool->cmdlines[h] = NULL;
+    if (len > 63) len = 63;
+    memcpy(pool->names[h], comm, len);
+    pool->names[h][len] = '\0';
+    return h;
+}
+
+/**
+ * Returns a handle to the pool
+ * @param pool: Pool
+ * @param h: Handle, ignored if COMM_NONE
+ */
+static void comm_release(comm_pool *pool, uint32_t h) {
+    if (h == COMM_NONE) return;
+    free(pool->cmdlines[h]);
+    pool->cmdlines[h] = NULL;
+    pool->free_list[pool->nfree++] = h;
+}
+
+/**
+ * Updates a stored name if the process renamed itself
+ * A changed name usually means an exec, so the command line is dropped too
+ * @param pool: Pool
+ * @param h: Handle of the stored name
+ * @param comm: Name just parsed, not NUL terminated
+ * @param len: Name length
+ */
+static void comm_refresh(comm_pool *pool, uint32_t h, const char *comm, int len) {
+    if (len > 63) len = 63;
+    char *name = pool->names[h];
+    if (name[len] == '\0' && memcmp(name, comm, len) == 0) return;
+    memcpy(name, comm, len);
+    name[len] = '\0';
+    free(pool->cmdlines[h]);
+    pool->cmdlines[h] = NULL;
+}
+
+/**
+ * Releases a pool and every command line it still holds
+ */
+static void comm_pool_free(comm_pool *pool) {
+    for (uint32_t h = 0; h < pool->count; h++) free(pool->cmdlines[h]);
+    free(pool->names);
+    free(pool->cmdlines);
+    free(pool->free_list);
+}
+
+/**
+ * Returns the command line of a named process, reading it on first use
+ * Arguments are joined with spaces; processes without one (kernel threads)
+ * get their name in brackets, as ps shows them
+ * @param pool: Pool
+ * @param h: Handle of the process name
+ * @param pid: Process to read /proc/[pid]/cmdline of
+ * Returns: Command line, owned by the pool
+ */
+static const char *comm_cmdline(comm_pool *pool, uint32_t h, int pid) {
+    if (pool->cmdlines[h]) return pool->cmdlines[h];
+    
+    char path[256], buf[CMDLINE_MAX];
+    ssize_t n = -1;
+    snprintf(path, sizeof path, "%s/%d/cmdline", proc_root, pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        n = read(fd, buf, sizeof buf - 1);
+        close(fd);
+    }
+    while (n > 0 && buf[n - 1] == '\0') n--;
+    if (n > 0) {
+        for (ssize_t i = 0; i < n; i++) if (buf[i] == '\0') buf[i] = ' ';
+        buf[n] = '\0';
+    } else {
+        snprintf(buf, sizeof buf, "[%s]", pool->names[h]);
+    }
+    return pool->cmdlines[h] = strdup(buf);
+}
+
+/**
+ * Returns the name for a handle, "" for COMM_NONE
+ */
+static const char *comm_name(const comm_pool *pool, uint32_t h) {
+    return h == COMM_NONE ? "" : pool->names[h];
+}
+
+/**
+ * Grows the columns of a process cache to hold at least n samples
+ */
+static void proc_cache_reserve(proc_cache *cache, int n) {
+    if (n <= cache->capacity) return;
+    int cap = cache->capacity ? cache->capacity : n;
+    while (cap < n) cap *= 2;
+    cache->pids = realloc(cache->pids, cap * sizeof *cache->pids);
+    cache->tgids = realloc(cache->tgids, cap * sizeof *cache->tgids);
+    cache->fds = realloc(cache->fds, cap * sizeof *cache->fds);
+    cache->comms = realloc(cache->comms, cap * sizeof *cache->comms);
+    cache->ticks = realloc(cache->ticks, cap * sizeof *cache->ticks);
+    cache->starts = realloc(cache->starts, cap * sizeof *cache->starts);
+    cache->deltas = realloc(cache->deltas, cap * sizeof *cache->deltas);
+    cache->minflts = realloc(cache->minflts, cap * sizeof *cache->minflts);
+    cache->majflts = realloc(cache->majflts, cap * sizeof *cache->majflts);
+    cache->cpus = realloc(cache->cpus, cap * sizeof *cache->cpus);
+    cache->capacity = cap;
+}
+
+/**
+ * Allocates the columns of a process cache
+ * @param cache: Cache to initialize
+ * @param capacity: Initial number of samples
+ * @param pool: Name pool shared with the other cache of the pair
+ */
+static void proc_cache_init(proc_cache *cache, int capacity, comm_pool *pool) {
+    memset(cache, 0, sizeof *cache);
+    cache->pool = pool;
+    proc_cache_reserve(cache, capacity);
+}
+
+/**
+ * Releases the columns of a process cache
+ */
+static void proc_cache_free(proc_cache *cache) {
+    free(cache->pids);
+    free(cache->tgids);
+    free(cache->fds);
+    free(cache->comms);
+    free(cache->ticks);
+    free(cache->starts);
+    free(cache->deltas);
+    free(cache->minflts);
+    free(cache->majflts);
+    free(cache->cpus);
+}
+
+/**
+ * Releases what the current tick did not take over from a previous cache
+ * Descriptors and names still set belong to processes that have exited
+ * @param prev: Previous cache, after the current one was filled
+ */
+static void proc_cache_retire(proc_cache *prev) {
+    for (int i = 0; i < prev->count; i++) {
+        close_stat_fd(prev->fds[i]);
+        prev->fds[i] = -1;
+        comm_release(prev->pool, prev->comms[i]);
+        prev->comms[i] = COMM_NONE;
+    }
+}
+
+#define PID_STAT_BUF 1024      // Bytes read from one stat file, with its NUL
+
+/**
+ * Reads /proc/[pid]/stat, reusing a descriptor from the previous tick
+ * A cached descriptor that fails with ESRCH belongs to a process that has
+ * exited, so it is dropped and the path is reopened once in case the PID
+ * was reused. New descriptors are kept only while under fd_budget.
+ * @param tgid: Process owning thread pid, read via /proc/[tgid]/task; 0 for
+ *              a process-level read
+ * @param pid: Process (or thread) ID to read
+ * @param fd: In/out cached descriptor, -1 if none
+ * @param buf: Buffer for the stat line
+ * @param sz: Size of buffer
+ * Returns: Bytes read, or -1 if the process is gone or unreadable
+ */
+static ssize_t read_pid_stat(int tgid, int pid, int *fd, char *buf, size_t sz) {
+    if (*fd != -1) {
+        ssize_t bytes = pread(*fd, buf, sz, 0);
+        if (bytes > 0) return bytes;
+        close_stat_fd(*fd);
+        *fd = -1;
+        if (bytes == 0 || errno != ESRCH) return -1;
+    }
+    
+    char path[256];
+    if (tgid) snprintf(path, sizeof(path), "%s/%d/task/%d/stat", proc_root, tgid, pid);
+    else snprintf(path, sizeof(path), "%s/%d/stat", proc_root, pid);
+    int nfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (nfd == -1) return -1;
+    
+    ssize_t bytes = pread(nfd, buf, sz, 0);
+    if (bytes > 0 && fd_cached < fd_budget) {
+        *fd = nfd;
+        fd_cached++;
+    } else {
+        close(nfd);
+    }
+    return bytes;
+}
+
+// Proc connector state for --proc-events mode
+typedef struct { int pid; int seq; int alive; int renamed; } pid_event;
+
+static int proc_events_fd = -1;        // NETLINK_CONNECTOR socket
+static pid_event *pid_events = NULL;   // Lifecycle events since last tick
+static int pid_events_count = 0;
+static int pid_events_capacity = 0;
+static int proc_events_lost = 0;       // Set when the socket overflowed
+static int comm_events = 0;            // Renames this tick are all in pid_events
+static struct timespec last_rescan;    // Time of the last full /proc walk
+
+static int pid_renamed(int pid);
+
+// A PID between taking over last tick's state and storing this tick's sample
+typedef struct {
+    int tgid, pid;
+    int fd;                    // Stat descriptor carried over, -1 if none
+    int prev_idx;              // Index in the previous cache, -1 if new
+    uint32_t comm;             // Name handle carried over, COMM_NONE if none
+} pid_sample;
+
+/**
+ * Takes over the descriptor and name of a PID from last tick
+ * @param ps: Sample to start
+ * @param prev: Previous process cache, or NULL
+ * @param prev_hash: Hash table for the previous cache
+ * @param tgid: Owning process when reading a thread, 0 for a process
+ * @param pid: Process (or thread) ID to read
+ */
+static void sample_begin(pid_sample *ps, proc_cache *prev, pid_table *prev_hash,
+                         int tgid, int pid) {
+    *ps = (pid_sample){ .tgid = tgid, .pid = pid, .fd = -1, .prev_idx = -1, .comm = COMM_NONE };
+    if (prev) {
+        ps->prev_idx = pid_lookup(prev_hash, pid);
+        if (ps->prev_idx >= 0) {
+            ps->fd = prev->fds[ps->prev_idx];
+            prev->fds[ps->prev_idx] = -1;
+            ps->comm = prev->comms[ps->prev_idx];
+            prev->comms[ps->prev_idx] = COMM_NONE;
+        }
+    }
+}
+
+/**
+ * Parses a PID's stat contents into the process cache, or drops the PID
+ * A process is the PID plus its start time: if the start time changed the
+ * PID was reused, and the sample starts over with a fresh name and no delta
+ * @param sp: Sample started by sample_begin()
+ * @param cache: Process cache to store results
+ * @param hash_table: Hash table for O(1) PID lookups
+ * @param prev: Previous process cache, or NULL
+ * @param buf: Stat contents, with room for a NUL after them
+ * @param bytes: Length of the contents, <= 0 if the PID is gone
+ */
+static void sample_finish(pid_sample *sp, proc_cache *cache, pid_table *hash_table,
+                          proc_cache *prev, char *buf, ssize_t bytes) {
+    int tgid = sp->tgid, pid = sp->pid, fd = sp->fd, prev_idx = sp->prev_idx;
+    uint32_t comm = sp->comm;
+    if (bytes <= 0) goto gone;
+    buf[bytes] = '\0';
+    
+    // Parse process name (comm), faults, CPU times, start time and processor
+    pid_stat ps;
+    if (parse_pid_stat(buf, (size_t)bytes, &ps) != 0) goto gone;
+    
+    // A different start time means a new process behind a recycled PID
+    if (prev_idx >= 0 && prev->starts[prev_idx] != ps.starttime) {
+        comm_release(cache->pool, comm);
+        comm = COMM_NONE;
+        prev_idx = -1;
+    }
+    
+    // Expand cache if needed
+    proc_cache_reserve(cache, cache->count + 1);
+    
+    // Store process information; the name is only copied for new processes
+    // and renames, which the proc connector reports when it is running
+    int idx = cache->count;
+    unsigned long long ticks = ps.utime + ps.stime;  // Total CPU ticks used
+    if (comm == COMM_NONE) comm = comm_alloc(cache->pool, ps.comm, ps.comm_len);
+    else if (tgid || !comm_events || pid_renamed(pid))
+        comm_refresh(cache->pool, comm, ps.comm, ps.comm_len);
+    cache->pids[idx] = pid;
+    cache->tgids[idx] = tgid ? tgid : pid;
+    cache->fds[idx] = fd;
+    cache->comms[idx] = comm;
+    cache->ticks[idx] = ticks;
+    cache->starts[idx] = ps.starttime;
+    cache->deltas[idx] = prev_idx >= 0 ? ticks - prev->ticks[prev_idx] : 0;
+    cache->minflts[idx] = ps.minflt;
+    cache->majflts[idx] = ps.majflt;
+    cache->cpus[idx] = ps.processor;
+    
+    // Add to hash table for fast lookup
+    pid_table_insert(hash_table, pid, idx);
+    
+    cache->count++;
+    return;
+    
+gone:
+    close_stat_fd(fd);
+    comm_release(cache->pool, comm);
+}
+
+/**
+ * Reads one /proc/[pid]/stat file into the process cache
+ * The stat descriptor and name handle are carried over from the previous
+ * sample, so a process that stays alive costs one pread() per tick instead
+ * of open/read/close, and its delta is computed here from the same lookup
+ * @param cache: Process cache to store results
+ * @param hash_table: Hash table for O(1) PID lookups
+ * @param prev: Previous process cache to take descriptors from, or NULL
+ * @param prev_hash: Hash table for the previous cache
+ * @param tgid: Owning process when reading a thread, 0 for a process
+ * @param pid: Process (or thread) ID to read
+ */
+static void sample_pid(proc_cache *cache, pid_table *hash_table,
+                       proc_cache *prev, pid_table *prev_hash, int tgid, int pid) {
+    char buf[PID_STAT_BUF];     // Buffer for reading stat files
+    pid_sample ps;
+    sample_begin(&ps, prev, prev_hash, tgid, pid);
+    ssize_t bytes = read_pid_stat(tgid, pid, &ps.fd, buf, sizeof(buf) - 1);
+    sample_finish(&ps, cache, hash_table, prev, buf, bytes);
+}
+
+// PID set for this tick, shared read-only by all shards once prepared
+static int walk_rescan = 1;            // Sample walk_pids, not prev +/- events
+static int *walk_pids = NULL;          // PIDs listed by the /proc walk
+static int walk_count = 0;
+static int walk_capacity = 0;
+static int shard_count = 1;            // Number of process sampling shards
+static int top_n = 5;                  // Processes and threads reported per tick
+static double hot_threshold = -1.0;    // Process CPU % collected for --threads, < 0 off
+
+/**
+ * Subscribes to process lifecycle events from the kernel proc connector
+ * Needs CAP_NET_ADMIN; the caller falls back to /proc walks on failure
+ * Returns: 0 on success, -1 on failure
+ */
+static int proc_events_open(void) {
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_CONNECTOR);
+    if (fd == -1) return -1;
+    
+    // A large receive buffer rides out fork storms between ticks
+    int rcvbuf = 8 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) != 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC,
+                              .nl_pid = 0 };
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) != 0) { close(fd); return -1; }
+    
+    // Ask the connector to start multicasting events to us
+    struct {
+        struct nlmsghdr nl;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) req = {0};
+    req.nl.nlmsg_len = sizeof req;
+    req.nl.nlmsg_type = NLMSG_DONE;
+    req.cn.id.idx = CN_IDX_PROC;
+    req.cn.id.val = CN_VAL_PROC;
+    req.cn.len = sizeof req.op;
+    req.op = PROC_CN_MCAST_LISTEN;
+    if (send(fd, &req, sizeof req, 0) != (ssize_t)sizeof req) { close(fd); return -1; }
+    
+    proc_events_fd = fd;
+    return 0;
+}
+
+/**
+ * Records a process appearing, disappearing or changing its name
+ * @param pid: Thread group ID of the process
+ * @param alive: 1 for fork/exec/comm, 0 for exit
+ * @param renamed: 1 for exec/comm, after which its name is re-read
+ */
+static void push_pid_event(int pid, int alive, int renamed) {
+    if (pid_events_count >= pid_events_capacity) {
+        pid_events_capacity = pid_events_capacity ? pid_events_capacity * 2 : 256;
+        pid_events = realloc(pid_events, pid_events_capacity * sizeof(pid_event));
+    }
+    pid_events[pid_events_count] = (pid_event){pid, pid_events_count, alive, renamed};
+    pid_events_count++;
+}
+
+/**
+ * Drains all pending proc connector messages without blocking
+ * Only thread group leaders are kept, since /proc lists processes only
+ */
+static void proc_events_drain(void) {
+    static char buf[64 * 1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+    
+    for (;;) {
+        ssize_t len = recv(proc_events_fd, buf, sizeof buf, 0);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) { proc_events_lost = 1; continue; }
+            break;  // EAGAIN: nothing left to read
+        }
+        
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (size_t)len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type != NLMSG_DONE) continue;
+            struct cn_msg *cn = NLMSG_DATA(nh);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) continue;
+            struct proc_event *ev = (struct proc_event *)cn->data;
+            
+            switch (ev->what) {
+            case PROC_EVENT_FORK:
+                if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid)
+                    push_pid_event(ev->event_data.fork.child_tgid, 1, 0);
+                break;
+            case PROC_EVENT_EXEC:
+                push_pid_event(ev->event_data.exec.process_tgid, 1, 1);
+                break;
+            case PROC_EVENT_COMM:
+                // Only the leader's name is the process name
+                if (ev->event_data.comm.process_pid == ev->event_data.comm.process_tgid)
+                    push_pid_event(ev->event_data.comm.process_tgid, 1, 1);
+                break;
+            case PROC_EVENT_EXIT:
+                if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid)
+                    push_pid_event(ev->event_data.exit.process_tgid, 0, 0);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Orders events by PID, keeping arrival order within the same PID
+ */
+static int pid_event_cmp(const void *a, const void *b) {
+    const pid_event *x = a, *y = b;
+    if (x->pid != y->pid) return x->pid < y->pid ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Finds the latest event for a PID in the sorted event list
+ * Returns: Pointer to the event, or NULL if the PID had no events
+ */
+static pid_event *last_pid_event(int pid) {
+    int lo = 0, hi = pid_events_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pid_events[mid].pid <= pid) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 && pid_events[lo - 1].pid == pid ? &pid_events[lo - 1] : NULL;
+}
+
+/**
+ * Tells whether a process exec'd or renamed itself since last tick
+ * @param pid: Thread group ID
+ * Returns: Nonzero if the sorted event list has a rename for it
+ */
+static int pid_renamed(int pid) {
+    pid_event *ev = last_pid_event(pid);
+    if (!ev) return 0;
+    for (; ev >= pid_events && ev->pid == pid; ev--) if (ev->renamed) return 1;
+    return 0;
+}
+
+/**
+ * Works out which PIDs to sample this tick, before the shards start
+ * With --proc-events the PID set is the previous sample plus/minus what the
+ * proc connector reported, and /proc is only walked once per second (or
+ * right away after the socket overflowed) to recover from lost events
+ * @param initial: First sample, which always needs a full walk
+ */
+static void prepare_process_walk(int initial) {
+    static DIR *d = NULL;      // Persistent directory handle
+    
+    // Decide between an incremental update and a full directory walk
+    walk_rescan = 1;
+    if (proc_events_fd != -1) {
+        pid_events_count = 0;
+        proc_events_drain();
+        qsort(pid_events, pid_events_count, sizeof(pid_event), pid_event_cmp);
+        comm_events = !proc_events_lost;  // Lost events may include renames
+        
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long since = (now.tv_sec - last_rescan.tv_sec) * 1000000000LL +
+                          (now.tv_nsec - last_rescan.tv_nsec);
+        walk_rescan = initial || proc_events_lost || since >= 1000000000LL;
+        if (!walk_rescan) return;
+        last_rescan = now;
+        proc_events_lost = 0;
+    }
+    
+    // Open /proc directory on first call, rewind on subsequent calls
+    if (!d) {
+        d = opendir(proc_root);
+        if (!d) { perror(proc_root); exit(1); }
+    } else {
+        rewinddir(d);
+    }
+    
+    // Iterate through /proc entries
+    walk_count = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        // Skip non-numeric entries (not process directories)
+        if (!isdigit((unsigned char)de->d_name[0])) continue;
+        if (walk_count == walk_capacity) {
+            walk_capacity = walk_capacity ? walk_capacity * 2 : 1024;
+            walk_pids = realloc(walk_pids, walk_capacity * sizeof *walk_pids);
+        }
+        walk_pids[walk_count++] = atoi(de->d_name);
+    }
+}
+
+/*
+ * Batched stat reads (--io-uring)
+ * Instead of one pread() per process, the reads of every cached stat
+ * descriptor are queued on an io_uring, into one registered buffer pool,
+ * and handed to the kernel with a single io_uring_enter() per
+ * URING_ENTRIES processes that also waits for them all. Completions are
+ * then parsed in queue order, so the process cache comes out exactly as
+ * with the synchronous path. New PIDs still open() and read inline, and a
+ * read that did not return data is retried synchronously, which keeps the
+ * exit and PID reuse handling of read_pid_stat(). The ring is set up with
+ * raw syscalls on the sampling thread's first tick; kernels without
+ * io_uring, or with it disabled, keep the pread() path.
+ * procfs files do not support non-blocking reads, so the kernel completes
+ * each one on an io-wq worker thread. That trades the system calls for
+ * context switches: it pays off where syscall entry is expensive or the
+ * monitor has several CPUs for the workers, not on a single core.
+ */
+#define URING_ENTRIES 1024     // Reads per submission, and buffers in the pool
+
+typedef struct {
+    int state;                 // 0 until first used, 1 when open, -1 if unavailable,
+                               // 2 if open but failing
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map, *sqe_map;
+    size_t sq_size, cq_size, sqe_size;
+    int fixed;                 // Pool registered, reads use IORING_OP_READ_FIXED
+    char *bufs;                // URING_ENTRIES * PID_STAT_BUF
+    pid_sample pending[URING_ENTRIES];
+    ssize_t bytes[URING_ENTRIES];   // Completion result, or inline read, per entry
+    int queued[URING_ENTRIES];      // Whether the entry's read is on the ring
+    int n;                     // Entries pending
+    unsigned nqueued;          // Of which on the ring
+    unsigned long long submits, reads, retries;
+} uring_batch;
+
+static int use_uring;          // Read stat files through io_uring
+
+/**
+ * Creates the ring and registers the buffer pool
+ * @param u: Batch to open
+ * Returns: 0 on success, -1 with errno set
+ */
+static int uring_open(uring_batch *u) {
+    // A single submitter that reaps its own completions lets the kernel
+    // skip task-work interrupts; older kernels reject the flags
+    struct io_uring_params p = { .flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN };
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        p = (struct io_uring_params){0};
+        u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (u->fd < 0) return -1;
+    
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+        u->cq_size = 0;
+    }
+    u->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_map = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = u->cq_size ? mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)
+                           : u->sq_map;
+    u->sqe_map = mmap(NULL, u->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQES);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqe_map == MAP_FAILED) {
+        int err = errno;
+        if (u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_size);
+        if (u->cq_size && u->cq_map != MAP_FAILED) munmap(u->cq_map, u->cq_size);
+        if (u->sqe_map != MAP_FAILED) munmap(u->sqe_map, u->sqe_size);
+        close(u->fd);
+        errno = err;
+        return -1;
+    }
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->sqes = u->sqe_map;
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // Submission slot i always names SQE i
+    for (unsigned i = 0; i < p.sq_entries; i++) u->sq_array[i] = i;
+    
+    size_t pool = (size_t)URING_ENTRIES * PID_STAT_BUF;
+    u->bufs = mmap(NULL, pool, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->bufs == MAP_FAILED) { perror("mmap"); exit(1); }
+    struct iovec iov = { u->bufs, pool };
+    u->fixed = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    
+    // procfs reads cannot be done without blocking, so the kernel hands them
+    // to io-wq worker threads; keep those on the sampling thread's cores
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof mask, &mask) == 0) {
+        syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_IOWQ_AFF, &mask, sizeof mask);
+    }
+    return 0;
+}
+
+/**
+ * Closes the ring and reports how it was used
+ * @param u: Batch, which may never have been opened
+ * @param index: Shard number for the report
+ */
+static void uring_close(uring_batch *u, int index) {
+    if (u->state < 1) return;
+    if (profiling) {
+        fprintf(stderr, "io_uring: shard %d: %llu reads in %llu submissions, %llu retried "
+                "synchronously%s\n", index, u->reads, u->submits, u->retries,
+                u->fixed ? "" : ", buffers not registered");
+    }
+    munmap(u->bufs, (size_t)URING_ENTRIES * PID_STAT_BUF);
+    munmap(u->sqe_map, u->sqe_size);
+    if (u->cq_size) munmap(u->cq_map, u->cq_size);
+    munmap(u->sq_map, u->sq_size);
+    close(u->fd);
+}
+
+/**
+ * Submits the queued reads, waits for all of them and stores the pending
+ * samples in queue order
+ * @param u: Batch
+ * @param cache: Process cache to store results
+ * @param hash_table: Hash table for O(1) PID lookups
+ * @param prev: Previous process cache, or NULL
+ */
+static void uring_flush(uring_batch *u, proc_cache *cache, pid_table *hash_table,
+                        proc_cache *prev) {
+    unsigned want = u->nqueued;
+    unsigned tail = *u->sq_tail;
+    __atomic_store_n(u->sq_tail, tail + want, __ATOMIC_RELEASE);
+    
+    unsigned submitted = 0, completed = 0;
+    while (completed < want) {
+        int r = (int)syscall(__NR_io_uring_enter, u->fd, want - submitted, want - completed,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (submitted) { perror("io_uring_enter"); exit(1); }
+            // Nothing reached the kernel: take the synchronous path from now on
+            perror("io_uring_enter, falling back to pread");
+            __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+            u->state = 2;
+            for (int i = 0; i < u->n; i++) {
+                if (u->queued[i]) u->bytes[i] = -EAGAIN;
+            }
+            break;
+        }
+        if (r > 0) submitted += (unsigned)r;
+        u->submits++;
+        
+        unsigned head = *u->cq_head;
+        unsigned ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            u->bytes[cqe->user_data] = cqe->res;
+            completed++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    u->reads += completed;
+    
+    for (int i = 0; i < u->n; i++) {
+        pid_sample *ps = &u->pending[i];
+        char *buf = u->bufs + (size_t)i * PID_STAT_BUF;
+        if (u->queued[i] && u->bytes[i] <= 0) {
+            // Exited, or a read the ring could not do: redo it the usual way
+            u->bytes[i] = read_pid_stat(ps->tgid, ps->pid, &ps->fd, buf, PID_STAT_BUF - 1);
+            u->retries++;
+        }
+        sample_finish(ps, cache, hash_table, prev, buf, u->bytes[i]);
+    }
+    u->n = 0;
+    u->nqueued = 0;
+}
+
+/**
+ * Queues one PID: a read on the ring if it has a cached descriptor, else
+ * an inline open and read
+ * @param u: Batch, flushed when full
+ * @param cache: Process cache to store results
+ * @param hash_table: Hash table for O(1) PID lookups
+ * @param prev: Previous process cache, or NULL
+ * @param prev_hash: Hash table for the previous cache
+ * @param pid: Process ID to read
+ */
+static void uring_add(uring_batch *u, proc_cache *cache, pid_table *hash_table,
+                      proc_cache *prev, pid_table *prev_hash, int pid) {
+    int i = u->n++;
+    pid_sample *ps = &u->pending[i];
+    sample_begin(ps, prev, prev_hash, 0, pid);
+    char *buf = u->bufs + (size_t)i * PID_STAT_BUF;
+    u->queued[i] = ps->fd != -1;
+    if (!u->queued[i]) {
+        u->bytes[i] = read_pid_stat(0, pid, &ps->fd, buf, PID_STAT_BUF - 1);
+    } else {
+        struct io_uring_sqe *sqe = &u->sqes[(*u->sq_tail + u->nqueued++) & *u->sq_mask];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = ps->fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = PID_STAT_BUF - 1;
+        sqe->user_data = (uint64_t)i;
+    }
+    if (u->n == URING_ENTRIES) uring_flush(u, cache, hash_table, prev);
+}
+
+/**
+ * Reads all process statistics from /proc/[pid]/stat files
+ * Uses hash table for efficient PID lookups in subsequent comparisons
+ * Only PIDs belonging to the given shard are read; the PID set itself comes
+ * from prepare_process_walk()
+ * @param cache: Process cache to store results
+ * @param hash_table: Hash table for O(1) PID lookups
+ * @param prev: Previous process cache to take descriptors from, or NULL
+ * @param prev_hash: Hash table for the previous cache
+ * @param shard: Shard to read
+ * @param nshards: Total number of shards
+ * @param u: The shard's io_uring batch with --io-uring, else NULL
+ * Returns: Number of processes read
+ */
+static int read_processes_optimized(proc_cache *cache, pid_table *hash_table,
+                                    proc_cache *prev, pid_table *prev_hash,
+                                    int shard, int nshards, uring_batch *u) {
+    // Clear previous hash table
+    pid_table_clear(hash_table);
+    
+    cache->count = 0;
+    
+    // The ring belongs to the thread that first submits to it
+    if (u && u->state == 0) {
+        u->state = uring_open(u) == 0 ? 1 : -1;
+        if (u->state < 0) perror("io_uring, falling back to pread");
+    }
+    if (u && u->state != 1) u = NULL;
+    
+    if (walk_rescan || !prev) {
+        for (int i = 0; i < walk_count; i++) {
+            int pid = walk_pids[i];
+            if (pid % nshards != shard) continue;
+            if (u) uring_add(u, cache, hash_table, prev, prev_hash, pid);
+            else sample_pid(cache, hash_table, prev, prev_hash, 0, pid);
+        }
+    } else {
+        // Everything from last tick, unless its last event was an exit
+        for (int i = 0; i < prev->count; i++) {
+            pid_event *ev = last_pid_event(prev->pids[i]);
+            if (ev && !ev->alive) continue;
+            if (u) uring_add(u, cache, hash_table, prev, prev_hash, prev->pids[i]);
+            else sample_pid(cache, hash_table, prev, prev_hash, 0, prev->pids[i]);
+        }
+        
+        // Plus processes that appeared since then
+        for (int i = 0; i < pid_events_count; i++) {
+            pid_event *ev = &pid_events[i];
+            if (ev->pid % nshards != shard) continue;
+            if (i + 1 < pid_events_count && pid_events[i + 1].pid == ev->pid) continue;
+            if (!ev->alive || pid_lookup(prev_hash, ev->pid) >= 0) continue;
+            if (u) uring_add(u, cache, hash_table, prev, prev_hash, ev->pid);
+            else sample_pid(cache, hash_table, prev, prev_hash, 0, ev->pid);
+        }
+    }
+    if (u && u->n) uring_flush(u, cache, hash_table, prev);
+    
+    // Whatever was not taken over belongs to processes that have exited
+    if (prev) proc_cache_retire(prev);
+    
+    return cache->count;
+}
+
+/**
+ * Partition function for quickselect algorithm
+ * Partitions array around pivot for finding top K elements
+ * @param arr: Array of process usage data
+ * @param low: Start index
+ * @param high: End index
+ * Returns: Final position of pivot element
+ */
+static int partition(proc_usage *arr, int low, int high) {
+    double pivot = arr[high].pct;
+    int i = low - 1;
+    
+    // Move elements greater than pivot to the left
+    for (int j = low; j < high; j++) {
+        if (arr[j].pct > pivot) {
+            i++;
+            proc_usage temp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = temp;
+        }
+    }
+    
+    // Place pivot in correct position
+    proc_usage temp = arr[i + 1];
+    arr[i + 1] = arr[high];
+    arr[high] = temp;
+    
+    return i + 1;
+}
+
+/**
+ * Finds and sorts only the top k processes by CPU usage
+ * Uses quickselect for O(n) average time complexity
+ * @param arr: Array of process usage data
+ * @param n: Total number of processes
+ * @param k: Number of leading entries to select
+ */
+static void quickselect_top(proc_usage *arr, int n, int k) {
+    // Use quickselect to partition array so top k are at the beginning
+    int left = 0, right = n - 1;
+    while (n > k && left < right) {
+        int pivot_idx = partition(arr, left, right);
+        if (pivot_idx == k - 1) break;  // Top k are now in first k positions
+        else if (pivot_idx < k - 1) left = pivot_idx + 1;
+        else right = pivot_idx - 1;
+    }
+    
+    // Sort just the top k elements
+    for (int i = 0; i < k && i < n; i++) {
+        for (int j = i + 1; j < k && j < n; j++) {
+            if (arr[j].pct > arr[i].pct) {
+                proc_usage temp = arr[i];
+                arr[i] = arr[j];
+                arr[j] = temp;
+            }
+        }
+    }
+}
+
+#define TOP_SMALL_MAX 16       // Largest k served by insertion instead of quickselect
+
+/**
+ * Keeps the top k processes sorted in the leading entries with one pass
+ * Most entries cost a single compare against the current k-th value, and
+ * nothing is swapped unless an entry enters the top k. Always inlined so
+ * the default k = 5 is specialized with a constant bound
+ * The array stays a permutation of its input: evicted entries are moved
+ * into the slot of the entry that replaced them
+ * @param arr: Array of process usage data
+ * @param n: Total number of processes
+ * @param k: Number of leading entries to select
+ */
+static inline __attribute__((always_inline))
+void insertion_top(proc_usage *arr, int n, int k) {
+    int m = n < k ? n : k;
+    for (int i = 1; i < m; i++) {
+        proc_usage x = arr[i];
+        int j = i;
+        while (j > 0 && arr[j - 1].pct < x.pct) { arr[j] = arr[j - 1]; j--; }
+        arr[j] = x;
+    }
+    if (n <= k) return;
+    
+    double floor = arr[k - 1].pct;
+    for (int i = k; i < n; i++) {
+        if (arr[i].pct <= floor) continue;
+        proc_usage x = arr[i];
+        arr[i] = arr[k - 1];
+        int j = k - 1;
+        while (j > 0 && arr[j - 1].pct < x.pct) { arr[j] = arr[j - 1]; j--; }
+        arr[j] = x;
+        floor = arr[k - 1].pct;
+    }
+}
+
+/**
+ * Moves the top k processes by CPU usage to the front of arr, sorted
+ * Small k use the insertion pass, with the default of 5 compiled as its
+ * own specialization; larger k fall back to quickselect
+ * @param arr: Array of process usage data
+ * @param n: Total number of processes
+ * @param k: Number of leading entries to select
+ * Returns: Number of entries selected, min(n, k)
+ */
+static int select_top(proc_usage *arr, int n, int k) {
+    if (k == 5) insertion_top(arr, n, 5);
+    else if (k <= TOP_SMALL_MAX) insertion_top(arr, n, k);
+    else quickselect_top(arr, n, k);
+    return n < k ? n : k;
+}
+
+// Bounded min-heap for streaming top-N selection
+// The root holds the smallest of the N largest deltas seen so far, so a
+// process that does not beat it costs one integer compare and no copy.
+// Equal deltas rank by sample index, which keeps tie order stable
+typedef struct {
+    unsigned long long ticks;  // Delta since the previous tick, the key
+    int index;                 // Sample in the current cache
+} top_entry;
+
+typedef struct {
+    top_entry *e;              // Heap storage, k entries
+    int n;                     // Entries in use
+    int k;                     // Capacity, the N of top-N
+} top_heap;
+
+/**
+ * Allocates a heap for k entries
+ */
+static void top_heap_init(top_heap *h, int k) {
+    h->e = malloc(k * sizeof *h->e);
+    h->n = 0;
+    h->k = k;
+}
+
+/**
+ * Returns nonzero if entry a ranks below entry b
+ */
+static inline int top_below(const top_entry *a, const top_entry *b) {
+    return a->ticks < b->ticks || (a->ticks == b->ticks && a->index > b->index);
+}
+
+/**
+ * Restores the heap order below slot i
+ */
+static void top_heap_sift_down(top_entry *e, int n, int i) {
+    top_entry x = e[i];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n) break;
+        if (c + 1 < n && top_below(&e[c + 1], &e[c])) c++;
+        if (!top_below(&e[c], &x)) break;
+        e[i] = e[c];
+        i = c;
+    }
+    e[i] = x;
+}
+
+/**
+ * Offers one delta to the heap
+ * Samples must be pushed in increasing index order for the fast reject
+ * @param h: Heap
+ * @param ticks: Delta of the sample
+ * @param index: Sample index in the current cache
+ */
+static inline void top_heap_push(top_heap *h, unsigned long long ticks, int index) {
+    if (h->n == h->k) {
+        if (ticks <= h->e[0].ticks) return;  // Common case: not a winner
+        h->e[0] = (top_entry){ticks, index};
+        top_heap_sift_down(h->e, h->n, 0);
+        return;
+    }
+    int i = h->n++;
+    top_entry x = {ticks, index};
+    while (i > 0 && top_below(&x, &h->e[(i - 1) / 2])) {
+        h->e[i] = h->e[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->e[i] = x;
+}
+
+/**
+ * Sorts the heap in place, largest delta first, and empties it
+ * Returns: Number of sorted entries
+ */
+static int top_heap_sort(top_heap *h) {
+    int n = h->n;
+    for (int end = n - 1; end > 0; end--) {
+        top_entry t = h->e[0];
+        h->e[0] = h->e[end];
+        h->e[end] = t;
+        top_heap_sift_down(h->e, end, 0);
+    }
+    h->n = 0;
+    return n;
+}
+
+/**
+ * Converts sorted heap winners to usage entries, copying only their comm
+ * Fault deltas and the previous processor are looked up here, for the
+ * winners only, instead of for every process while sampling
+ * @param e: Sorted heap entries
+ * @param n: Entries
+ * @param cache: Cache the entries index into
+ * @param prev: Previous cache, or NULL
+ * @param prev_hash: Lookup table of prev
+ * @param dt_ticks: Total CPU ticks elapsed across all cores
+ * @param arr: Output, n entries
+ */
+static void top_emit(const top_entry *e, int n, const proc_cache *cache,
+                     const proc_cache *prev, const pid_table *prev_hash,
+                     unsigned long long dt_ticks, proc_usage *arr) {
+    for (int i = 0; i < n; i++) {
+        int j = e[i].index;
+        int p = prev ? pid_lookup(prev_hash, cache->pids[j]) : -1;
+        if (p >= 0 && prev->starts[p] != cache->starts[j]) p = -1;
+        arr[i].start = cache->starts[j];
+        arr[i].cpu = cache->cpus[j];
+        arr[i].prev_cpu = p >= 0 ? prev->cpus[p] : -1;
+        arr[i].minflt = p >= 0 ? cache->minflts[j] - prev->minflts[p] : 0;
+        arr[i].majflt = p >= 0 ? cache->majflts[j] - prev->majflts[p] : 0;
+        arr[i].vcsw = arr[i].ivcsw = arr[i].run_ns = arr[i].wait_ns = -1;
+        arr[i].pid = cache->pids[j];
+        arr[i].tgid = cache->tgids[j];
+        strcpy(arr[i].comm, comm_name(cache->pool, cache->comms[j]));  // At most 63 chars
+        arr[i].cmdline = show_cmdline && cache->comms[j] != COMM_NONE ?
+                         comm_cmdline(cache->pool, cache->comms[j], cache->pids[j]) : NULL;
+        arr[i].pct = dt_ticks ? 100.0 * (double)e[i].ticks / (double)dt_ticks : 0.0;
+        arr[i].ticks = e[i].ticks;
+    }
+}
+
+#define THREAD_MAX_PROCS 64    // Cap on processes --threads descends into per tick
+
+// Per-shard process sampling state
+// Shard k of n owns the PIDs with pid % n == k, so a PID and its cached
+// stat descriptor always stay with the same shard and worker thread
+typedef struct {
+    proc_cache cache[2];   // Double-buffered samples
+    pid_table table[2];    // Lookup tables matching cache[]
+    comm_pool pool;        // Names of the processes in cache[]
+    int cur;               // Index of the cache filled this tick
+    top_heap heap;         // Streaming top N selection
+    proc_usage *arr;       // This shard's top N processes, sorted
+    int top;               // Entries of arr filled this tick
+    int hot[THREAD_MAX_PROCS];  // Processes at or above hot_threshold
+    int nhot;
+    int index;             // Shard number
+    int cpu;               // Core the worker is pinned to, -1 for main thread
+    pthread_t thread;
+    phase_hist *prof;      // Phases timed by whoever samples the shard, with --profile
+    uring_batch *uring;    // Batched stat reads with --io-uring, else NULL
+} proc_shard;
+
+/**
+ * Allocates the caches and tables of a shard
+ * @param s: Shard to initialize
+ * @param index: Shard number
+ * @param cpu: Core for its worker thread, -1 if sampled by main
+ */
+static void shard_init(proc_shard *s, int index, int cpu) {
+    memset(s, 0, sizeof *s);
+    for (int k = 0; k < 2; k++) {
+        proc_cache_init(&s->cache[k], 1024, &s->pool);
+        pid_table_init(&s->table[k], 11);
+    }
+    top_heap_init(&s->heap, top_n);
+    s->arr = malloc(top_n * sizeof(proc_usage));
+    s->index = index;
+    s->cpu = cpu;
+    if (profiling) s->prof = calloc(PH_COUNT, sizeof *s->prof);
+    if (use_uring) s->uring = calloc(1, sizeof *s->uring);
+}
+
+/**
+ * Releases a shard, closing its cached stat descriptors
+ * @param s: Shard to free
+ */
+static void shard_free(proc_shard *s) {
+    // Only the newest cache holds descriptors
+    proc_cache *last = &s->cache[s->cur ^ 1];
+    for (int i = 0; i < last->count; i++) close_stat_fd(last->fds[i]);
+    for (int k = 0; k < 2; k++) {
+        proc_cache_free(&s->cache[k]);
+        free(s->table[k].slots);
+    }
+    comm_pool_free(&s->pool);
+    free(s->heap.e);
+    free(s->arr);
+    free(s->prof);
+    if (s->uring) uring_close(s->uring, s->index);
+    free(s->uring);
+}
+
+/**
+ * Selects the top N processes of a shard in one pass over its deltas
+ * Deltas were computed while sampling, so this only scans deltas[]: an idle
+ * process costs one compare against the heap root and the hot bound, with
+ * no lookup or copy. Percentages and names are only made for the winners
+ * @param s: Shard whose caches were just filled
+ * @param dt_ticks: Total CPU ticks elapsed across all cores
+ */
+static void shard_top(proc_shard *s, unsigned long long dt_ticks) {
+    proc_cache *cur = &s->cache[s->cur];
+    
+    // Delta that makes a process a --threads candidate, rounded up
+    unsigned long long hot_min = ~0ULL;
+    if (hot_threshold >= 0) {
+        double x = hot_threshold * (double)dt_ticks / 100.0;
+        hot_min = (unsigned long long)x;
+        if ((double)hot_min < x) hot_min++;
+    }
+    s->nhot = 0;
+    
+    const unsigned long long *deltas = cur->deltas;
+    int count = cur->count;
+    // Prime the heap so its root is a valid bound for the scan
+    int i = 0;
+    for (; i < count && s->heap.n < s->heap.k; i++) {
+        top_heap_push(&s->heap, deltas[i], i);
+        if (deltas[i] >= hot_min && s->nhot < THREAD_MAX_PROCS) s->hot[s->nhot++] = cur->pids[i];
+    }
+    while (i < count) {
+        // Skip blocks with no candidate with a branch-free compare that the
+        // compiler vectorizes; a candidate beats the root or is hot
+        unsigned long long bound = s->heap.e[0].ticks;
+        if (hot_min && hot_min - 1 < bound) bound = hot_min - 1;
+        if (hot_min && i + 8 <= count) {
+            int any = 0;
+            for (int j = 0; j < 8; j++) any |= deltas[i + j] > bound;
+            if (!any) { i += 8; continue; }
+        }
+        for (int end = i + 8 < count ? i + 8 : count; i < end; i++) {
+            unsigned long long d = deltas[i];
+            if (d <= s->heap.e[0].ticks && d < hot_min) continue;  // Idle this tick
+            top_heap_push(&s->heap, d, i);
+            if (d >= hot_min && s->nhot < THREAD_MAX_PROCS) s->hot[s->nhot++] = cur->pids[i];
+        }
+    }
+    
+    s->top = top_heap_sort(&s->heap);
+    top_emit(s->heap.e, s->top, cur, &s->cache[s->cur ^ 1], &s->table[s->cur ^ 1], dt_ticks,
+             s->arr);
+}
+
+/**
+ * Samples one shard's processes for this tick
+ * @param s: Shard to sample
+ * @param dt_ticks: Total CPU ticks elapsed across all cores
+ * @param initial: First sample, with nothing to diff against
+ */
+static void sample_shard(proc_shard *s, unsigned long long dt_ticks, int initial) {
+    int prev = s->cur ^ 1;
+    long long t = prof_start();
+    read_processes_optimized(&s->cache[s->cur], &s->table[s->cur],
+                             initial ? NULL : &s->cache[prev], &s->table[prev],
+                             s->index, shard_count, s->uring);
+    if (!initial) {
+        t = prof_lap(s->prof, PH_PIDS, t);
+        shard_top(s, dt_ticks);
+        prof_lap(s->prof, PH_SELECT, t);
+    }
+    s->cur = prev;  // Swap caches for the next tick (double buffering)
+}
+
+// Tick hand-off between the main thread and --monitor-cpus workers
+static pthread_barrier_t tick_start, tick_done;
+static unsigned long long tick_dt_ticks;   // Published before tick_start
+static int tick_initial;
+static volatile int workers_stop = 0;
+
+/**
+ * Worker thread: samples its shard once per tick, between the barriers
+ * @param arg: Shard owned by this worker
+ */
+static void *shard_worker(void *arg) {
+    proc_shard *s = arg;
+    pin_to_cpu(s->cpu);
+    for (;;) {
+        pthread_barrier_wait(&tick_start);
+        if (workers_stop) break;
+        sample_shard(s, tick_dt_ticks, tick_initial);
+        pthread_barrier_wait(&tick_done);
+    }
+    return NULL;
+}
+
+/**
+ * Samples every shard for this tick and waits until all are done
+ * Without worker threads the single shard is sampled inline
+ * @param shards: All shards
+ * @param dt_ticks: Total CPU ticks elapsed across all cores
+ * @param initial: First sample, with nothing to diff against
+ */
+static void sample_all_shards(proc_shard *shards, unsigned long long dt_ticks,
+                              int initial) {
+    long long t = prof_start();
+    prepare_process_walk(initial);
+    if (!initial) prof_lap(prof, PH_WALK, t);
+    if (shards[0].cpu < 0) {
+        sample_shard(&shards[0], dt_ticks, initial);
+        return;
+    }
+    tick_dt_ticks = dt_ticks;
+    tick_initial = initial;
+    pthread_barrier_wait(&tick_start);
+    pthread_barrier_wait(&tick_done);
+}
+
+/**
+ * Merges the shards' top N lists into the overall top N
+ * @param shards: All shards, sampled this tick
+ * @param out: Output for the sorted top processes
+ * Returns: Number of entries in *out, at most top_n
+ */
+static int merge_top(proc_shard *shards, proc_usage **out) {
+    static proc_usage *merged = NULL;   // Room for the shards' candidates
+    proc_usage *arr = shards[0].arr;
+    int n = shards[0].top;
+    
+    if (shard_count > 1) {
+        if (!merged) merged = malloc((size_t)shard_count * top_n * sizeof *merged);
+        n = 0;
+        for (int k = 0; k < shard_count; k++) {
+            memcpy(&merged[n], shards[k].arr, shards[k].top * sizeof(proc_usage));
+            n += shards[k].top;
+        }
+        arr = merged;
+        n = select_top(arr, n, top_n);
+    }
+    
+    *out = arr;
+    return n;
+}
+
+// Scheduler counters of the top processes for --counters
+// Context switches are only in /proc/[pid]/status and run-queue time only
+// in /proc/[pid]/schedstat, so unlike stat they are read for this tick's
+// top N alone. Both stay open while the process stays in the top list
+static int show_counters = 0;          // --counters: print them under each process
+
+typedef struct {
+    int pid;
+    unsigned long long start;  // With pid, the process identity
+    int status_fd, sched_fd;   // Cached descriptors, -1 if none
+    long long vcsw, ivcsw;     // Cumulative at the last read, -1 if unknown
+    long long run_ns, wait_ns;
+    unsigned int seen;         // Tick it was last in the top list
+} counter_entry;
+
+typedef struct {
+    counter_entry *e;
+    int n, cap;
+    unsigned int tick;
+    pid_table index;           // PID -> entry
+} counter_set;
+
+/**
+ * Reads a counter file, reusing or caching its descriptor like stat files
+ * @param pid: Process
+ * @param name: File under /proc/[pid]
+ * @param fd: In/out cached descriptor, -1 if none
+ * @param buf: Buffer, NUL terminated on success
+ * @param sz: Size of buffer
+ * Returns: Bytes read, or -1
+ */
+static ssize_t read_counter_file(int pid, const char *name, int *fd, char *buf, size_t sz) {
+    ssize_t bytes;
+    if (*fd != -1) {
+        bytes = pread(*fd, buf, sz - 1, 0);
+        if (bytes <= 0) {
+            close_stat_fd(*fd);
+            *fd = -1;
+            return -1;
+        }
+    } else {
+        char path[256];
+        snprintf(path, sizeof path, "%s/%d/%s", proc_root, pid, name);
+        int nfd = open(path, O_RDONLY | O_CLOEXEC);
+        if (nfd == -1) return -1;
+        bytes = pread(nfd, buf, sz - 1, 0);
+        if (bytes > 0 && fd_cached < fd_budget) {
+            *fd = nfd;
+            fd_cached++;
+        } else {
+            close(nfd);
+        }
+        if (bytes <= 0) return -1;
+    }
+    buf[bytes] = '\0';
+    return bytes;
+}
+
+/**
+ * Finds a "key:" line in /proc/[pid]/status and parses its value
+ * @param buf: status contents
+ * @param key: Line label including the colon, preceded by a newline
+ * Returns: Value, or -1 if the line is missing
+ */
+static long long status_value(const char *buf, const char *key) {
+    const char *p = strstr(buf, key);
+    if (!p) return -1;
+    p += strlen(key);
+    while (*p == ' ' || *p == '\t') p++;
+    const char *q = p;
+    unsigned long long v = parse_ull(&q);
+    return q == p ? -1 : (long long)v;
+}
+
+/**
+ * Closes the descriptors of an entry
+ */
+static void counter_close(counter_entry *c) {
+    close_stat_fd(c->status_fd);
+    close_stat_fd(c->sched_fd);
+}
+
+/**
+ * Reads the scheduler counters of this tick's top processes and stores
+ * their change since the previous tick in the entries
+ * A process new to the top list is read now and reported from the next
+ * tick on; entries of processes that left the list are closed
+ * @param cs: Counter state
+ * @param top: Sorted top processes
+ * @param ntop: Entries in top
+ */
+static void counters_sample(counter_set *cs, proc_usage *top, int ntop) {
+    char buf[4096];
+    unsigned int tick = ++cs->tick;
+    
+    for (int i = 0; i < ntop; i++) {
+        proc_usage *u = &top[i];
+        int k = pid_lookup(&cs->index, u->pid);
+        if (k >= 0 && cs->e[k].start != u->start) {
+            counter_close(&cs->e[k]);   // Recycled PID: start over
+            cs->e[k] = (counter_entry){ u->pid, u->start, -1, -1, -1, -1, -1, -1, tick };
+        }
+        if (k < 0) {
+            if (cs->n == cs->cap) {
+                cs->cap = cs->cap ? cs->cap * 2 : 16;
+                cs->e = realloc(cs->e, cs->cap * sizeof *cs->e);
+            }
+            k = cs->n++;
+            cs->e[k] = (counter_entry){ u->pid, u->start, -1, -1, -1, -1, -1, -1, tick };
+            pid_table_insert(&cs->index, u->pid, k);
+        }
+        counter_entry *c = &cs->e[k];
+        c->seen = tick;
+        
+        long long vcsw = -1, ivcsw = -1, run_ns = -1, wait_ns = -1;
+        if (read_counter_file(u->pid, "status", &c->status_fd, buf, sizeof buf) > 0) {
+            vcsw = status_value(buf, "\nvoluntary_ctxt_switches:");
+            ivcsw = status_value(buf, "\nnonvoluntary_ctxt_switches:");
+        }
+        if (read_counter_file(u->pid, "schedstat", &c->sched_fd, buf, sizeof buf) > 0) {
+            const char *p = buf, *q = p;
+            unsigned long long run = parse_ull(&q);
+            if (q != p && *q == ' ') {
+                p = ++q;
+                unsigned long long wait = parse_ull(&q);
+                if (q != p) { run_ns = (long long)run; wait_ns = (long long)wait; }
+            }
+        }
+        
+        u->vcsw = vcsw >= 0 && c->vcsw >= 0 ? vcsw - c->vcsw : -1;
+        u->ivcsw = ivcsw >= 0 && c->ivcsw >= 0 ? ivcsw - c->ivcsw : -1;
+        u->run_ns = run_ns >= 0 && c->run_ns >= 0 ? run_ns - c->run_ns : -1;
+        u->wait_ns = wait_ns >= 0 && c->wait_ns >= 0 ? wait_ns - c->wait_ns : -1;
+        c->vcsw = vcsw;
+        c->ivcsw = ivcsw;
+        c->run_ns = run_ns;
+        c->wait_ns = wait_ns;
+    }
+    
+    // Drop processes that left the top list and reindex the rest
+    int m = 0;
+    pid_table_clear(&cs->index);
+    for (int k = 0; k < cs->n; k++) {
+        if (cs->e[k].seen != tick) {
+            counter_close(&cs->e[k]);
+            continue;
+        }
+        cs->e[m] = cs->e[k];
+        pid_table_insert(&cs->index, cs->e[m].pid, m);
+        m++;
+    }
+    cs->n = m;
+}
+
+/**
+ * Releases counter state, closing its descriptors
+ */
+static void counters_free(counter_set *cs) {
+    for (int k = 0; k < cs->n; k++) counter_close(&cs->e[k]);
+    free(cs->e);
+    free(cs->index.slots);
+}
+
+/**
+ * Prints the extended counters of one top process
+ * The processor reads "cpu=A->B" when the process moved since the last
+ * tick. It is marked thrashed when it spent longer waiting on a run queue
+ * than running: it wanted a CPU more often than it got one
+ * @param out: Output stream
+ * @param u: Process
+ */
+static void print_counters(FILE *out, const proc_usage *u) {
+    fputs("        cpu=", out);
+    if (u->cpu < 0) fputc('?', out);
+    else if (u->prev_cpu >= 0 && u->prev_cpu != u->cpu) fprintf(out, "%d->%d", u->prev_cpu, u->cpu);
+    else fprintf(out, "%d", u->cpu);
+    fprintf(out, " faults=%llu/%llu", u->minflt, u->majflt);
+    if (u->vcsw >= 0 && u->ivcsw >= 0) fprintf(out, " cs=%lld/%lld", u->vcsw, u->ivcsw);
+    if (u->run_ns >= 0 && u->wait_ns >= 0) {
+        fprintf(out, " run=%.1fms wait=%.1fms", u->run_ns / 1e6, u->wait_ns / 1e6);
+        if (u->wait_ns > u->run_ns) fputs(" thrashed", out);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * Prints the top processes of this tick
+ * @param out: Output stream
+ * @param arr: Sorted top processes
+ * @param top: Number of entries
+ */
+static void print_top(FILE *out, const proc_usage *arr, int top) {
+    for (int i = 0; i < top; i++) {
+        fprintf(out, "    pid=%d %-20s %.1f%%", arr[i].pid, arr[i].comm, arr[i].pct);
+        if (arr[i].cmdline) fprintf(out, "  %s", arr[i].cmdline);
+        fputc('\n', out);
+        if (show_counters) print_counters(out, &arr[i]);
+    }
+}
+
+/**
+ * Tags a top list sampled over more than one tick with its resolution
+ * @param out: Output stream
+ * @param window_ns: Time the list covers
+ */
+static void print_window(FILE *out, long long window_ns) {
+    fprintf(out, "    window=%.1fms\n", window_ns / 1e6);
+}
+
+/**
+ * Formats a wall clock time with centisecond precision
+ * Format: HH:MM:SS:CC where CC is centiseconds (1/100 second)
+ * @param ts: Time to format
+ * @param buf: Buffer to store timestamp string
+ * @param sz: Size of buffer
+ */
+static void format_centis(const struct timespec *ts, char *buf, size_t sz) {
+    struct tm tm;
+    localtime_r(&ts->tv_sec, &tm);
+    int centi = (int)(ts->tv_nsec / 10000000L);  // Convert nanoseconds to centiseconds
+    if (centi > 99) centi = 99;
+    snprintf(buf, sz, "%02d:%02d:%02d:%02d", 
+             tm.tm_hour, tm.tm_min, tm.tm_sec, centi);
+}
+
+/**
+ * Creates timestamp string for the current time
+ * @param buf: Buffer to store timestamp string
+ * @param sz: Size of buffer
+ */
+static void timestamp_centis(char *buf, size_t sz) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    format_centis(&ts, buf, sz);
+}
+
+/**
+ * Reads the read and write syscall counts of this process
+ * @param syscr: Output for read-type syscalls
+ * @param syscw: Output for write-type syscalls
+ * Returns: 0 on success, -1 without task I/O accounting
+ */
+static int self_syscalls(unsigned long long *syscr, unsigned long long *syscw) {
+    int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    char buf[512];
+    ssize_t bytes = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (bytes <= 0) return -1;
+    buf[bytes] = '\0';
+    
+    const char *r = strstr(buf, "syscr: "), *w = strstr(buf, "syscw: ");
+    if (!r || !w) return -1;
+    r += 7;
+    w += 7;
+    *syscr = parse_ull(&r);
+    *syscw = parse_ull(&w);
+    return 0;
+}
+
+/**
+ * Prints the --profile report: per-phase latency percentiles, syscalls and
+ * the monitor's own CPU time, all since start
+ * Shard phases are sampled once per shard per tick, so with several shards
+ * their counts are a multiple of the tick count
+ * @param out: Output stream
+ * @param shards: All shards, quiescent between ticks
+ * @param ticks: Ticks run so far
+ * @param elapsed_ns: Time since the first tick
+ */
+static void profile_report(FILE *out, const proc_shard *shards, long ticks,
+                           long long elapsed_ns) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    double per_tick = ticks ? 1.0 / ticks : 0.0;
+    fprintf(out, "profile: %ld ticks in %.2f s, self CPU %.2f s user + %.2f s sys "
+            "(%.2f%% of a core)\n", ticks, elapsed_ns / 1e9, user, sys,
+            elapsed_ns ? 100.0 * (user + sys) * 1e9 / elapsed_ns : 0.0);
+    
+    unsigned long long syscr, syscw;
+    if (self_syscalls(&syscr, &syscw) == 0) {
+        fprintf(out, "profile: %.1f read and %.1f write syscalls, %.2f context switches "
+                "per tick\n", syscr * per_tick, syscw * per_tick,
+                (ru.ru_nvcsw + ru.ru_nivcsw) * per_tick);
+    }
+    
+    fprintf(out, "profile: %-8s %10s %10s %10s %10s %10s  (us)\n",
+            "phase", "count", "p50", "p99", "max", "mean");
+    for (int p = 0; p < PH_COUNT; p++) {
+        phase_hist h = prof[p];
+        for (int k = 0; k < shard_count; k++) {
+            const phase_hist *sh = &shards[k].prof[p];
+            h.count += sh->count;
+            h.sum += sh->sum;
+            if (sh->max > h.max) h.max = sh->max;
+            for (int i = 0; i < PROF_BUCKETS; i++) h.buckets[i] += sh->buckets[i];
+        }
+        if (h.count == 0) continue;
+        fprintf(out, "profile: %-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", phase_names[p],
+                (unsigned long long)h.count, prof_percentile(&h, 0.50) / 1e3,
+                prof_percentile(&h, 0.99) / 1e3, h.max / 1e3, (double)h.sum / h.count / 1e3);
+    }
+}
+
+// Per-thread sampling state for --threads
+// Threads are only read for processes that are interesting this tick, so
+// the cost scales with the number of hot processes, not with thread count
+
+typedef struct {
+    proc_cache cache[2];   // Double-buffered thread samples, keyed by TID
+    pid_table table[2];    // Lookup tables matching cache[]
+    comm_pool pool;        // Names of the threads in cache[]
+    int cur;               // Index of the cache filled this tick
+    top_heap heap;         // Streaming top N selection
+    proc_usage *arr;       // Top N threads, sorted
+    int top;               // Entries of arr filled this tick
+} thread_sampler;
+
+/**
+ * Allocates the caches and tables of the thread sampler
+ * Processes become candidates through the shards' hot lists, see
+ * hot_threshold
+ * @param ts: Sampler to initialize
+ */
+static void thread_sampler_init(thread_sampler *ts) {
+    memset(ts, 0, sizeof *ts);
+    for (int k = 0; k < 2; k++) {
+        proc_cache_init(&ts->cache[k], 256, &ts->pool);
+        pid_table_init(&ts->table[k], 9);
+    }
+    top_heap_init(&ts->heap, top_n);
+    ts->arr = malloc(top_n * sizeof(proc_usage));
+}
+
+/**
+ * Releases the thread sampler, closing its cached stat descriptors
+ * @param ts: Sampler to free
+ */
+static void thread_sampler_free(thread_sampler *ts) {
+    proc_cache *last = &ts->cache[ts->cur ^ 1];
+    for (int i = 0; i < last->count; i++) close_stat_fd(last->fds[i]);
+    for (int k = 0; k < 2; k++) {
+        proc_cache_free(&ts->cache[k]);
+        free(ts->table[k].slots);
+    }
+    comm_pool_free(&ts->pool);
+    free(ts->heap.e);
+    free(ts->arr);
+}
+
+/**
+ * Adds a process to the candidate list unless already present
+ */
+static void add_thread_candidate(int *pids, int *count, int pid) {
+    for (int i = 0; i < *count; i++) if (pids[i] == pid) return;
+    if (*count < THREAD_MAX_PROCS) pids[(*count)++] = pid;
+}
+
+/**
+ * Reads the threads of this tick's top processes and of any process above
+ * the threshold, then selects the top N threads
+ * A thread needs to have been read in the previous tick as well to get a
+ * delta, so it shows up from the second tick its process is a candidate
+ * @param ts: Thread sampler
+ * @param shards: All shards, sampled this tick
+ * @param top: This tick's top processes
+ * @param ntop: Entries in top
+ * @param dt_ticks: Total CPU ticks elapsed across all cores
+ */
+static void sample_threads(thread_sampler *ts, proc_shard *shards,
+                           const proc_usage *top, int ntop,
+                           unsigned long long dt_ticks) {
+    int pids[THREAD_MAX_PROCS], npids = 0;
+    for (int i = 0; i < ntop; i++) add_thread_candidate(pids, &npids, top[i].pid);
+    for (int k = 0; k < shard_count; k++) {
+        for (int i = 0; i < shards[k].nhot; i++)
+            add_thread_candidate(pids, &npids, shards[k].hot[i]);
+    }
+    
+    int prev_idx = ts->cur ^ 1;
+    proc_cache *cur = &ts->cache[ts->cur], *prev = &ts->cache[prev_idx];
+    pid_table *cur_hash = &ts->table[ts->cur], *prev_hash = &ts->table[prev_idx];
+    pid_table_clear(cur_hash);
+    cur->count = 0;
+    
+    for (int i = 0; i < npids; i++) {
+        char path[256];
+        snprintf(path, sizeof path, "%s/%d/task", proc_root, pids[i]);
+        DIR *d = opendir(path);
+        if (!d) continue;
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            if (!isdigit((unsigned char)de->d_name[0])) continue;
+            sample_pid(cur, cur_hash, prev, prev_hash, pids[i], atoi(de->d_name));
+        }
+        closedir(d);
+    }
+    
+    // Threads of processes that are no longer candidates
+    proc_cache_retire(prev);
+    
+    // Rank threads that have a previous sample to diff against
+    for (int i = 0; i < cur->count; i++) {
+        if (pid_lookup(prev_hash, cur->pids[i]) < 0) continue;
+        top_heap_push(&ts->heap, cur->deltas[i], i);
+    }
+    ts->top = top_heap_sort(&ts->heap);
+    top_emit(ts->heap.e, ts->top, cur, prev, prev_hash, dt_ticks, ts->arr);
+    ts->cur = prev_idx;  // Swap caches for the next tick
+}
+
+/**
+ * Prints the top threads of this tick
+ * @param out: Output stream
+ * @param ts: Thread sampler, sampled this tick
+ */
+static void print_top_threads(FILE *out, const thread_sampler *ts) {
+    for (int i = 0; i < ts->top; i++) {
+        const proc_usage *u = &ts->arr[i];
+        fprintf(out, "    tid=%d pid=%d %-20s %.1f%%", u->pid, u->tgid, u->comm, u->pct);
+        if (u->cmdline) fprintf(out, "  %s", u->cmdline);
+        fputc('\n', out);
+    }
+}
+
+// cgroup v2 CPU accounting state for --cgroups
+// Every leaf cgroup's cpu.stat stays open and is read with one pread() per
+// tick; the tree is re-walked once a second to pick up new and removed
+// cgroups, keeping the descriptors of the ones that remain
+#define CGROUP_MAX_DEPTH 32
+
+typedef struct {
+    char *path;                    // Relative to the root, "/" for the root
+    int fd;                        // cpu.stat descriptor
+    int fresh;                     // No reading to diff against yet
+    unsigned long long usage;      // usage_usec
+    unsigned long long throttled;  // throttled_usec, 0 without the cpu controller
+    unsigned long long d_usage;    // This tick's deltas
+    unsigned long long d_throttled;
+} cgroup_entry;
+
+typedef struct {
+    const char *root;              // cgroup2 mount point
+    cgroup_entry *e;               // Leaves, sorted by path
+    int count, capacity;
+    long long last_scan_ns;        // Time of the last tree walk
+    long long last_read_ns;        // Time of the last cpu.stat reads
+    double scale;                  // usec to % of all CPUs for this tick
+    top_heap heap;                 // Top N selection by usage
+    int ntop;                      // Sorted winners, in heap.e
+} cgroup_set;
+
+/**
+ * Finds where cgroup v2 is mounted
+ * Returns: /sys/fs/cgroup on unified hosts, else the hybrid unified mount
+ */
+static const char *cgroup_default_root(void) {
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0) return "/sys/fs/cgroup";
+    return "/sys/fs/cgroup/unified";
+}
+
+/**
+ * Orders cgroup leaves by path
+ */
+static int cgroup_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Collects the leaf cgroups below a directory
+ * @param root: cgroup2 mount point
+ * @param rel: Directory relative to root, "" for the root itself
+ * @param depth: Recursion depth
+ * @param paths: In/out array of strdup()ed relative paths
+ * @param count: In/out number of paths
+ * @param capacity: In/out capacity of paths
+ */
+static void cgroup_collect(const char *root, const char *rel, int depth,
+                           char ***paths, int *count, int *capacity) {
+    char dir[4096];
+    snprintf(dir, sizeof dir, "%s%s", root, rel);
+    DIR *d = opendir(dir);
+    if (!d) return;
+    
+    int children = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') continue;
+        children++;
+        if (depth >= CGROUP_MAX_DEPTH) continue;
+        char sub[4096];
+        if (snprintf(sub, sizeof sub, "%s/%s", rel, de->d_name) >= (int)sizeof sub) continue;
+        cgroup_collect(root, sub, depth + 1, paths, count, capacity);
+    }
+    closedir(d);
+    
+    if (children) return;
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *paths = realloc(*paths, *capacity * sizeof **paths);
+    }
+    (*paths)[(*count)++] = strdup(*rel ? rel : "/");
+}
+
+/**
+ * Re-walks the cgroup tree, keeping descriptors of leaves that remain
+ * @param cg: cgroup state
+ */
+static void cgroup_rescan(cgroup_set *cg) {
+    char **paths = NULL;
+    int npaths = 0, cap = 0;
+    cgroup_collect(cg->root, "", 0, &paths, &npaths, &cap);
+    qsort(paths, npaths, sizeof *paths, cgroup_path_cmp);
+    
+    // Merge the sorted walk with the sorted current leaves
+    cgroup_entry *next = malloc((npaths ? npaths : 1) * sizeof *next);
+    int n = 0, j = 0;
+    for (int i = 0; i < npaths; i++) {
+        while (j < cg->count && strcmp(cg->e[j].path, paths[i]) < 0) {
+            close(cg->e[j].fd);
+            free(cg->e[j].path);
+            j++;
+        }
+        if (j < cg->count && strcmp(cg->e[j].path, paths[i]) == 0) {
+            next[n++] = cg->e[j++];
+            free(paths[i]);
+            continue;
+        }
+        char file[4096];
+        snprintf(file, sizeof file, "%s%s/cpu.stat", cg->root,
+                 strcmp(paths[i], "/") == 0 ? "" : paths[i]);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) { free(paths[i]); continue; }
+        next[n++] = (cgroup_entry){ .path = paths[i], .fd = fd, .fresh = 1 };
+    }
+    for (; j < cg->count; j++) {
+        close(cg->e[j].fd);
+        free(cg->e[j].path);
+    }
+    free(paths);
+    free(cg->e);
+    cg->e = next;
+    cg->count = n;
+}
+
+/**
+ * Sets up cgroup sampling; the first cgroup_sample() walks the tree
+ * @param cg: State to initialize
+ * @param root: cgroup2 mount point
+ */
+static void cgroup_init(cgroup_set *cg, const char *root) {
+    memset(cg, 0, sizeof *cg);
+    cg->root = root;
+    top_heap_init(&cg->heap, top_n);
+}
+
+/**
+ * Releases cgroup state and closes its descriptors
+ */
+static void cgroup_free(cgroup_set *cg) {
+    for (int i = 0; i < cg->count; i++) {
+        close(cg->e[i].fd);
+        free(cg->e[i].path);
+    }
+    free(cg->e);
+    free(cg->heap.e);
+}
+
+/**
+ * Parses usage_usec and throttled_usec out of a cpu.stat image
+ * @param buf: NUL terminated file content
+ * @param usage: Output for usage_usec
+ * @param throttled: Output for throttled_usec, left alone if absent
+ */
+static void parse_cgroup_cpu_stat(const char *buf, unsigned long long *usage,
+                                  unsigned long long *throttled) {
+    for (const char *p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        const char *q;
+        if (strncmp(p, "usage_usec ", 11) == 0) {
+            q = p + 11;
+            *usage = parse_ull(&q);
+        } else if (strncmp(p, "throttled_usec ", 15) == 0) {
+            q = p + 15;
+            *throttled = parse_ull(&q);
+        }
+    }
+}
+
+/**
+ * Reads every leaf's cpu.stat and selects the top N by usage this tick
+ * @param cg: cgroup state
+ * @param ncpus: CPUs the usage is shared out over
+ */
+static void cgroup_sample(cgroup_set *cg, int ncpus) {
+    long long now = mono_ns();
+    if (now - cg->last_scan_ns >= 1000000000LL) {
+        cgroup_rescan(cg);
+        cg->last_scan_ns = now;
+    }
+    long long elapsed_us = (now - cg->last_read_ns) / 1000;
+    cg->last_read_ns = now;
+    cg->scale = elapsed_us > 0 ? 100.0 / ((double)elapsed_us * ncpus) : 0.0;
+    
+    for (int i = 0; i < cg->count; i++) {
+        cgroup_entry *e = &cg->e[i];
+        char buf[1024];
+        ssize_t bytes = pread(e->fd, buf, sizeof buf - 1, 0);
+        if (bytes <= 0) { e->d_usage = e->d_throttled = 0; continue; }
+        buf[bytes] = '\0';
+        
+        unsigned long long usage = e->usage, throttled = e->throttled;
+        parse_cgroup_cpu_stat(buf, &usage, &throttled);
+        e->d_usage = e->fresh ? 0 : usage - e->usage;
+        e->d_throttled = e->fresh ? 0 : throttled - e->throttled;
+        e->usage = usage;
+        e->throttled = throttled;
+        e->fresh = 0;
+        top_heap_push(&cg->heap, e->d_usage, i);
+    }
+    cg->ntop = top_heap_sort(&cg->heap);
+}
+
+/**
+ * Prints the top cgroups of this tick
+ * @param out: Output stream
+ * @param cg: cgroup state, sampled this tick
+ */
+static void print_top_cgroups(FILE *out, const cgroup_set *cg) {
+    for (int i = 0; i < cg->ntop; i++) {
+        const cgroup_entry *e = &cg->e[cg->heap.e[i].index];
+        fprintf(out, "    cgroup=%s %.1f%% throttled=%.1fms\n", e->path,
+                e->d_usage * cg->scale, e->d_throttled / 1000.0);
+    }
+}
+
+// Pressure stall information for --pressure and --psi-trigger
+// The three /proc/pressure files stay open and are read with one pread()
+// each per tick; the stall totals are in microseconds, so a tick's share of
+// stalled time is its total delta over the elapsed time. Triggers are
+// separate descriptors the kernel marks POLLPRI when a stall threshold is
+// crossed, which lets the sampler sleep at a low rate until then
+#define PSI_MAX_TRIGGERS 8
+
+enum { PSI_CPU, PSI_IO, PSI_MEMORY, PSI_RESOURCES };
+
+static const char *const psi_names[PSI_RESOURCES] = { "cpu", "io", "memory" };
+
+typedef struct {
+    int fd[PSI_RESOURCES];             // Sampling descriptors, -1 if unavailable
+    int fresh;                         // No reading to diff against yet
+    unsigned long long some[PSI_RESOURCES], full[PSI_RESOURCES];  // total= usec
+    double some_pct[PSI_RESOURCES], full_pct[PSI_RESOURCES];      // This tick
+    long long last_read_ns;
+    
+    // Event mode
+    struct pollfd trig[PSI_MAX_TRIGGERS];  // Trigger descriptors, polled for POLLPRI
+    int trig_res[PSI_MAX_TRIGGERS];        // Resource each trigger watches
+    int ntrig;
+    long long hold_ns;                 // Full rate lasts this long after an event
+    long long idle_ns, fast_ns;        // Tick intervals without and with a stall
+    long long fast_until_ns;           // End of the current full-rate stretch
+    int fast;                          // Sampling at full rate
+    int changed;                       // Rate switched before this tick: -1 down, 1 up
+    int woke_res;                      // Resource of the latest event
+} psi_state;
+
+typedef struct {
+    int res;                           // Resource file the trigger goes to
+    char text[64];                     // "some|full STALL_US WINDOW_US"
+    unsigned long long window_us;
+} psi_trigger_spec;
+
+/**
+ * Opens the /proc/pressure files for sampling
+ * @param psi: State to initialize
+ * Returns: Number of resources available, 0 without PSI support
+ */
+static int psi_open(psi_state *psi) {
+    memset(psi, 0, sizeof *psi);
+    psi->fresh = 1;
+    int opened = 0;
+    for (int r = 0; r < PSI_RESOURCES; r++) {
+        char path[64];
+        snprintf(path, sizeof path, "/proc/pressure/%s", psi_names[r]);
+        psi->fd[r] = open(path, O_RDONLY | O_CLOEXEC);
+        // Kernels booted with psi=0 have the files but fail reads
+        char probe[256];
+        if (psi->fd[r] != -1 && pread(psi->fd[r], probe, sizeof probe, 0) < 0) {
+            close(psi->fd[r]);
+            psi->fd[r] = -1;
+        }
+        if (psi->fd[r] != -1) opened++;
+    }
+    return opened;
+}
+
+/**
+ * Closes sampling and trigger descriptors
+ */
+static void psi_close(psi_state *psi) {
+    for (int r = 0; r < PSI_RESOURCES; r++) {
+        if (psi->fd[r] != -1) close(psi->fd[r]);
+    }
+    for (int i = 0; i < psi->ntrig; i++) {
+        if (psi->trig[i].fd >= 0) close(psi->trig[i].fd);
+    }
+}
+
+/**
+ * Parses the some and full totals out of a pressure file image
+ * @param buf: NUL terminated file content
+ * @param some: Output for the some line's total=, left alone if absent
+ * @param full: Output for the full line's total=, left alone if absent
+ */
+static void parse_psi_totals(const char *buf, unsigned long long *some,
+                             unsigned long long *full) {
+    for (const char *p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        unsigned long long *dst = strncmp(p, "some ", 5) == 0 ? some
+                                : strncmp(p, "full ", 5) == 0 ? full : NULL;
+        const char *q = dst ? strstr(p, "total=") : NULL;
+        const char *eol = strchr(p, '\n');
+        if (!q || (eol && q > eol)) continue;
+        q += 6;
+        *dst = parse_ull(&q);
+    }
+}
+
+/**
+ * Reads the pressure files and works out this tick's stall shares
+ * @param psi: State from psi_open()
+ */
+static void psi_sample(psi_state *psi) {
+    long long now = mono_ns();
+    long long elapsed_us = (now - psi->last_read_ns) / 1000;
+    psi->last_read_ns = now;
+    double scale = elapsed_us > 0 && !psi->fresh ? 100.0 / (double)elapsed_us : 0.0;
+    
+    for (int r = 0; r < PSI_RESOURCES; r++) {
+        char buf[256];
+        ssize_t bytes = psi->fd[r] == -1 ? -1 : pread(psi->fd[r], buf, sizeof buf - 1, 0);
+        if (bytes <= 0) { psi->some_pct[r] = psi->full_pct[r] = 0.0; continue; }
+        buf[bytes] = '\0';
+        
+        unsigned long long some = psi->some[r], full = psi->full[r];
+        parse_psi_totals(buf, &some, &full);
+        psi->some_pct[r] = (some - psi->some[r]) * scale;
+        psi->full_pct[r] = (full - psi->full[r]) * scale;
+        psi->some[r] = some;
+        psi->full[r] = full;
+    }
+    psi->fresh = 0;
+}
+
+/**
+ * Parses a PSI trigger specification
+ * @param t: Trigger to fill
+ * @param spec: [cpu:|io:|memory:]some|full STALL_US WINDOW_US, cpu if no
+ *              resource is named
+ * Returns: 0 on success, -1 on a malformed spec
+ */
+static int psi_parse_trigger(psi_trigger_spec *t, const char *spec) {
+    t->res = PSI_CPU;
+    for (int r = 0; r < PSI_RESOURCES; r++) {
+        size_t len = strlen(psi_names[r]);
+        if (strncmp(spec, psi_names[r], len) == 0 && spec[len] == ':') {
+            t->res = r;
+            spec += len + 1;
+            break;
+        }
+    }
+    char kind[8], extra;
+    unsigned long long stall_us;
+    if (sscanf(spec, "%7s %llu %llu %c", kind, &stall_us, &t->window_us, &extra) != 3 ||
+        (strcmp(kind, "some") != 0 && strcmp(kind, "full") != 0)) {
+        return -1;
+    }
+    snprintf(t->text, sizeof t->text, "%s %llu %llu", kind, stall_us, t->window_us);
+    return 0;
+}
+
+/**
+ * Registers a PSI trigger for event mode
+ * The kernel checks the thresholds: windows are 500ms to 10s, and a
+ * multiple of 2s for callers without CAP_SYS_RESOURCE
+ * @param psi: State from psi_open()
+ * @param t: Parsed trigger
+ * Returns: 0 on success, -1 with errno set
+ */
+static int psi_add_trigger(psi_state *psi, const psi_trigger_spec *t) {
+    char path[64];
+    snprintf(path, sizeof path, "/proc/pressure/%s", psi_names[t->res]);
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return -1;
+    // The kernel takes the trigger as a NUL terminated string
+    if (write(fd, t->text, strlen(t->text) + 1) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    
+    psi->trig[psi->ntrig] = (struct pollfd){ .fd = fd, .events = POLLPRI };
+    psi->trig_res[psi->ntrig++] = t->res;
+    // Events come at most once per window while the stall lasts, so two
+    // quiet windows in a row mean it is over
+    long long hold = 2 * (long long)t->window_us * 1000;
+    if (hold > psi->hold_ns) psi->hold_ns = hold;
+    return 0;
+}
+
+/**
+ * Prints this tick's stall shares, some/full per resource
+ * @param out: Output stream
+ * @param psi: State sampled this tick
+ */
+static void print_pressure(FILE *out, const psi_state *psi) {
+    fputs("    psi", out);
+    for (int r = 0; r < PSI_RESOURCES; r++) {
+        fprintf(out, " %s=%.1f%%/%.1f%%", psi_names[r], psi->some_pct[r], psi->full_pct[r]);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * Prints the column header of the text format
+ * @param out: Output stream
+ * @param n: Number of CPUs
+ * @param ids: CPU number of each column, NULL to number them from 0
+ */
+static void print_header(FILE *out, int n, const int *ids) {
+    fprintf(out, "HH:MM:SS:UU");
+    for (int i = 0; i < n; i++) fprintf(out, "\tcpu_%d", ids ? ids[i] : i);
+    fputc('\n', out);
+}
+
+/**
+ * Reads the CPU numbers an output format stores for its columns
+ * @param src: n uint32_t values, at any alignment
+ * @param n: Number of columns
+ * Returns: Array to free, or NULL if a number is out of range
+ */
+static int *load_cpu_ids(const void *src, uint32_t n) {
+    int *ids = malloc((n ? n : 1) * sizeof *ids);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t id;
+        memcpy(&id, (const char *)src + i * sizeof id, sizeof id);
+        if (id > INT_MAX) { free(ids); return NULL; }
+        ids[i] = (int)id;
+    }
+    return ids;
+}
+
+/**
+ * Computes one tick's per-CPU counter deltas for every /proc/stat column
+ * A flat loop over contiguous columns, so it compiles to vector subtracts
+ * @param cur: Current counters, CPU_FIELDS * n
+ * @param prev: Previous counters, CPU_FIELDS * n
+ * @param n: Number of CPUs
+ * @param out: Deltas in the same layout; a tick always fits 32 bits
+ */
+static void cpu_times_delta(const unsigned long long *restrict cur,
+                            const unsigned long long *restrict prev, int n,
+                            uint32_t *restrict out) {
+    size_t m = (size_t)CPU_FIELDS * n;
+    for (size_t i = 0; i < m; i++) out[i] = (uint32_t)(cur[i] - prev[i]);
+}
+
+/**
+ * Prints the per-CPU breakdown of one tick, one line per CPU
+ * Shares are of the CPU's elapsed time; guest time is already part of user
+ * and nice, so it is not counted again
+ * @param out: Output stream
+ * @param d: Column-major deltas from cpu_times_delta()
+ * @param n: Number of CPUs
+ * @param ids: CPU number of each column, NULL to number them from 0
+ */
+static void print_breakdown(FILE *out, const uint32_t *d, int n, const int *ids) {
+    for (int i = 0; i < n; i++) {
+        unsigned long long total = 0;
+        for (int k = CPU_USER; k <= CPU_STEAL; k++) total += d[k * n + i];
+        double scale = total ? 100.0 / (double)total : 0.0;
+        fprintf(out, "    cpu=%d user=%.0f%% nice=%.0f%% sys=%.0f%% iowait=%.0f%% "
+                "irq=%.0f%% softirq=%.0f%% steal=%.0f%%\n", ids ? ids[i] : i,
+                d[CPU_USER * n + i] * scale, d[CPU_NICE * n + i] * scale,
+                d[CPU_SYSTEM * n + i] * scale, d[CPU_IOWAIT * n + i] * scale,
+                d[CPU_IRQ * n + i] * scale, d[CPU_SOFTIRQ * n + i] * scale,
+                d[CPU_STEAL * n + i] * scale);
+    }
+}
+
+/**
+ * Prints one tick's usage per NUMA node, per package when packages and
+ * nodes differ, and per core when cores have SMT siblings
+ * A group's usage is its busy time over its elapsed time, so one core
+ * whose siblings are both busy reads 100%
+ * @param out: Output stream
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param n: Number of CPUs
+ */
+static void print_topology(FILE *out, const cpu_sample *curc, const cpu_sample *prevc, int n) {
+    cpu_grouping *groups[] = { &topo_nodes, &topo_packages, &topo_cores };
+    for (int g = 0; g < 3; g++) {
+        cpu_grouping *gr = groups[g];
+        if (gr == &topo_packages && topo_packages.ngroups == topo_nodes.ngroups) continue;
+        if (gr == &topo_cores && topo_cores.ngroups == n) continue;
+        memset(gr->busy, 0, gr->ngroups * sizeof *gr->busy);
+        memset(gr->total, 0, gr->ngroups * sizeof *gr->total);
+        for (int i = 0; i < n; i++) {
+            unsigned long long dt = curc[i].total - prevc[i].total;
+            gr->busy[gr->of[i]] += dt - (curc[i].idle - prevc[i].idle);
+            gr->total[gr->of[i]] += dt;
+        }
+        fprintf(out, "    %s", gr->name);
+        for (int k = 0; k < gr->ngroups; k++) {
+            fprintf(out, " %s=%.0f%%", gr->label[k],
+                    gr->total[k] ? 100.0 * gr->busy[k] / (double)gr->total[k] : 0.0);
+        }
+        fputc('\n', out);
+    }
+}
+
+/**
+ * Finds the busiest CPU of a tick
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param n: Number of CPUs
+ * Returns: Its usage in %
+ */
+static double busiest_cpu(const cpu_sample *curc, const cpu_sample *prevc, int n) {
+    double busiest = 0.0;
+    for (int i = 0; i < n; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        unsigned long long di = curc[i].idle - prevc[i].idle;
+        double usage = dt ? 100.0 * (dt - di) / (double)dt : 0.0;
+        if (usage > busiest) busiest = usage;
+    }
+    return busiest;
+}
+
+/**
+ * Prints one tick in the text format
+ * @param out: Output stream
+ * @param missed: Ticks skipped right before this one
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param n: Number of CPUs
+ * @param breakdown: Per-CPU column deltas for --breakdown, or NULL
+ * @param top: Sorted top processes
+ * @param ntop: Entries in top
+ * @param window_ns: Time the top lists cover when longer than a tick, else 0
+ * @param ts: Thread sampler with this tick's top threads, or NULL
+ * @param cg: cgroup state with this tick's top cgroups, or NULL
+ * @param psi: Pressure sampled this tick for --pressure, or NULL
+ */
+static void print_tick_text(FILE *out, long missed, const cpu_sample *curc,
+                            const cpu_sample *prevc, int n, const uint32_t *breakdown,
+                            const proc_usage *top, int ntop, long long window_ns,
+                            const thread_sampler *ts, const cgroup_set *cg,
+                            const psi_state *psi) {
+    if (missed) fprintf(out, "# missed %ld ticks\n", missed);
+    
+    // Print timestamp
+    char tbuf[32];
+    timestamp_centis(tbuf, sizeof tbuf);
+    fputs(tbuf, out);
+    
+    // Calculate and print per-CPU usage
+    for (int i = 0; i < n; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;  // Total ticks
+        unsigned long long di = curc[i].idle - prevc[i].idle;    // Idle ticks
+        double usage = dt ? 100.0 * (dt - di) / (double)dt : 0.0;
+        fprintf(out, "\t%2.0f%%", usage);
+    }
+    fputc('\n', out);
+    if (breakdown) print_breakdown(out, breakdown, n, cpu_ids);
+    if (show_topology) print_topology(out, curc, prevc, n);
+    if (psi) print_pressure(out, psi);
+    
+    // Print top N processes by CPU usage
+    if (window_ns) print_window(out, window_ns);
+    print_top(out, top, ntop);
+    if (ts) print_top_threads(out, ts);
+    if (cg) print_top_cgroups(out, cg);
+}
+
+/*
+ * Asynchronous text output
+ * Ticks are formatted into a stdio stream whose buffer drains into a tick
+ * buffer, and each complete tick is copied into a lock-free
+ * single-producer/single-consumer byte ring in one piece. A writer thread
+ * empties the ring with write(2) once a batch has built up or the flush
+ * interval has passed, so a slow pipe or NFS mount never stalls sampling.
+ * When the ring is full the tick is dropped and counted instead.
+ */
+#define OUT_RING_SIZE (4u << 20)       // Ring capacity, power of two
+#define OUT_BATCH     (64u << 10)      // Wake the writer after this many bytes
+#define OUT_FLUSH_MS  100              // Write at least this often
+
+typedef struct {
+    char *buf;                 // OUT_RING_SIZE bytes
+    _Atomic uint64_t head;     // Bytes produced, owned by the sampler
+    _Atomic uint64_t tail;     // Bytes consumed, owned by the writer
+    uint64_t signaled;         // head when the writer was last woken
+    char *tick;                // Tick being formatted, grown to the largest one
+    size_t tick_len, tick_cap;
+    long dropped;              // Ticks dropped since the last report
+    long dropped_total;        // Ticks dropped overall
+    int wake_fd;               // eventfd to wake the writer early
+    int fd;                    // Destination descriptor
+    volatile int stop;         // Drain and exit
+    pthread_t thread;
+} out_ring;
+
+/**
+ * Appends bytes to the ring, all or nothing
+ * @param r: Ring
+ * @param data: Bytes to append
+ * @param len: Number of bytes
+ * Returns: 0 on success, -1 if the ring has no room
+ */
+static int out_ring_push(out_ring *r, const char *data, size_t len) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (len > OUT_RING_SIZE - (head - tail)) return -1;
+    
+    size_t at = head & (OUT_RING_SIZE - 1);
+    size_t first = len < OUT_RING_SIZE - at ? len : OUT_RING_SIZE - at;
+    memcpy(r->buf + at, data, first);
+    memcpy(r->buf, data + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    
+    // Only a full batch is worth a syscall on the sampling thread
+    if (head + len - r->signaled >= OUT_BATCH) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof one) < 0) { /* writer still wakes on timeout */ }
+        r->signaled = head + len;
+    }
+    return 0;
+}
+
+/**
+ * fopencookie write hook: collects the stream's output until the tick ends
+ * A tick larger than the stdio buffer arrives in several calls
+ */
+static ssize_t out_ring_cookie_write(void *cookie, const char *data, size_t len) {
+    out_ring *r = cookie;
+    if (r->tick_len + len > r->tick_cap) {
+        size_t cap = r->tick_cap;
+        while (r->tick_len + len > cap) cap *= 2;
+        char *p = realloc(r->tick, cap);
+        if (!p) return -1;
+        r->tick = p;
+        r->tick_cap = cap;
+    }
+    memcpy(r->tick + r->tick_len, data, len);
+    r->tick_len += len;
+    return (ssize_t)len;
+}
+
+/**
+ * Hands the collected tick to the writer, or drops all of it
+ */
+static void out_ring_commit(out_ring *r) {
+    size_t len = r->tick_len;
+    if (len == 0) return;
+    r->tick_len = 0;
+    
+    // Tell the reader where the gap is once there is room again
+    char note[64];
+    int n = r->dropped ? snprintf(note, sizeof note, "# dropped %ld ticks\n", r->dropped) : 0;
+    uint64_t used = atomic_load_explicit(&r->head, memory_order_relaxed) -
+                    atomic_load_explicit(&r->tail, memory_order_acquire);
+    if ((size_t)n + len > OUT_RING_SIZE - used) {
+        r->dropped++;
+        r->dropped_total++;
+        return;
+    }
+    
+    if (n) out_ring_push(r, note, (size_t)n);
+    out_ring_push(r, r->tick, len);
+    r->dropped = 0;
+}
+
+/**
+ * Ends a tick: flushes the stream and hands the whole tick to the writer
+ * @param r: Ring
+ * @param f: Stream returned by out_ring_open()
+ */
+static void out_ring_flush(out_ring *r, FILE *f) {
+    fflush(f);
+    out_ring_commit(r);
+}
+
+/**
+ * Writer thread: drains the ring in batches
+ * @param arg: Ring to drain
+ */
+static void *out_ring_writer(void *arg) {
+    out_ring *r = arg;
+    for (;;) {
+        struct pollfd pfd = { r->wake_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, OUT_FLUSH_MS) > 0) {
+            uint64_t v;
+            if (read(r->wake_fd, &v, sizeof v) < 0) { /* drained below anyway */ }
+        }
+        int stop = r->stop;
+        
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail < head) {
+            size_t at = tail & (OUT_RING_SIZE - 1);
+            size_t len = head - tail < OUT_RING_SIZE - at ? head - tail : OUT_RING_SIZE - at;
+            ssize_t w = write(r->fd, r->buf + at, len);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) { perror("write"); tail = head; break; }  // Discard, keep sampling
+            tail += (uint64_t)w;
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+/**
+ * Starts the writer thread and returns a stream feeding it
+ * @param r: Ring to set up
+ * @param fd: Descriptor the writer thread writes to
+ * Returns: Fully buffered stream; end each tick with out_ring_flush()
+ */
+static FILE *out_ring_open(out_ring *r, int fd) {
+    memset(r, 0, sizeof *r);
+    r->buf = malloc(OUT_RING_SIZE);
+    r->tick_cap = OUT_BATCH;
+    r->tick = malloc(r->tick_cap);
+    if (!r->buf || !r->tick) { perror("malloc"); exit(1); }
+    r->fd = fd;
+    r->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->wake_fd == -1) { perror("eventfd"); exit(1); }
+    
+    FILE *f = fopencookie(r, "w", (cookie_io_functions_t){ .write = out_ring_cookie_write });
+    if (!f) { perror("fopencookie"); exit(1); }
+    setvbuf(f, NULL, _IOFBF, OUT_BATCH);
+    
+    int err = pthread_create(&r->thread, NULL, out_ring_writer, r);
+    if (err) { errno = err; perror("pthread_create"); exit(1); }
+    return f;
+}
+
+/**
+ * Flushes the stream, drains the ring and stops the writer thread
+ * @param r: Ring
+ * @param f: Stream returned by out_ring_open()
+ */
+static void out_ring_close(out_ring *r, FILE *f) {
+    fclose(f);
+    out_ring_commit(r);
+    if (r->dropped) {
+        // Best effort: mark a gap at the very end of the log too
+        char note[64];
+        int n = snprintf(note, sizeof note, "# dropped %ld ticks\n", r->dropped);
+        out_ring_push(r, note, (size_t)n);
+    }
+    r->stop = 1;
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof one) < 0) { /* writer exits on timeout */ }
+    pthread_join(r->thread, NULL);
+    close(r->wake_fd);
+    free(r->buf);
+    free(r->tick);
+}
+
+// Absolute-deadline tick scheduler
+// Deadlines advance by a fixed interval from the start time, so the time
+// spent sampling does not stretch the period
+typedef struct {
+    long long interval_ns;     // Sampling period
+    long long deadline_ns;     // Next wakeup on CLOCK_MONOTONIC
+    long overruns;             // Ticks whose deadline passed before sleeping
+    long skipped;              // Whole periods dropped to catch up
+    long long worst_late_ns;   // Largest lateness seen at a deadline
+} tick_clock;
+
+/**
+ * Starts the tick schedule from now
+ * @param tc: Scheduler state
+ * @param interval_ns: Sampling period
+ */
+static void tick_clock_start(tick_clock *tc, long long interval_ns) {
+    *tc = (tick_clock){ .interval_ns = interval_ns, .deadline_ns = mono_ns() };
+}
+
+/**
+ * Sleeps until the next deadline
+ * If the previous tick ran past its deadline, the overrun is recorded and
+ * any deadlines that already passed are skipped rather than run back to back
+ * @param tc: Scheduler state
+ * @param fds: Descriptors that end the sleep early when ready, or NULL
+ * @param nfds: Entries in fds; on an early wakeup the tick runs at once and
+ *              the schedule continues from there
+ * Returns: Number of ticks skipped, 0 if on time
+ */
+static long tick_wait(tick_clock *tc, struct pollfd *fds, int nfds) {
+    tc->deadline_ns += tc->interval_ns;
+    long long late = mono_ns() - tc->deadline_ns;
+    long missed = 0;
+    
+    if (late > 0) {
+        tc->overruns++;
+        if (late > tc->worst_late_ns) tc->worst_late_ns = late;
+        missed = (long)(late / tc->interval_ns);
+        tc->skipped += missed;
+        tc->deadline_ns += (long long)missed * tc->interval_ns;
+        if (missed == 0) return 0;  // Late but within the period: go now
+    }
+    
+    if (nfds == 0) {
+        struct timespec ts = { tc->deadline_ns / 1000000000LL, tc->deadline_ns % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && keep_running)
+            ;
+        return missed;
+    }
+    
+    // ppoll() only takes a relative timeout, so recompute it after signals
+    while (keep_running) {
+        long long left = tc->deadline_ns - mono_ns();
+        if (left <= 0) break;
+        struct timespec ts = { left / 1000000000LL, left % 1000000000LL };
+        int ready = ppoll(fds, nfds, &ts, NULL);
+        if (ready > 0) { tc->deadline_ns = mono_ns(); break; }
+        if (ready == 0 || errno != EINTR) break;
+    }
+    return missed;
+}
+
+/**
+ * Switches the sampling rate on PSI events after tick_wait()
+ * A trigger event moves to the full rate at once; the rate drops back to
+ * the idle one when no event has come for the hold time
+ * @param psi: State with registered triggers
+ * @param tc: Scheduler whose interval is switched
+ */
+static void psi_update_rate(psi_state *psi, tick_clock *tc) {
+    long long now = mono_ns();
+    psi->changed = 0;
+    for (int i = 0; i < psi->ntrig; i++) {
+        struct pollfd *p = &psi->trig[i];
+        if (p->revents & (POLLERR | POLLNVAL)) {
+            // The monitor is gone; keep the slot but stop polling it
+            close(p->fd);
+            p->fd = -1;
+        } else if (p->revents & POLLPRI) {
+            psi->fast_until_ns = now + psi->hold_ns;
+            psi->woke_res = psi->trig_res[i];
+            if (!psi->fast) {
+                psi->fast = 1;
+                psi->changed = 1;
+                tc->interval_ns = psi->fast_ns;
+            }
+        }
+        p->revents = 0;
+    }
+    if (psi->fast && now >= psi->fast_until_ns) {
+        psi->fast = 0;
+        psi->changed = -1;
+        tc->interval_ns = psi->idle_ns;
+    }
+}
+
+/*
+ * Spike capture (--trigger)
+ * Every tick is still formatted, but into memory: the last --pre seconds
+ * sit in a ring of tick texts, and only when the trigger fires is that ring
+ * written out, followed by the next --post seconds. Each further firing
+ * inside the window extends it, so a long spike is one contiguous capture.
+ */
+enum { TRIG_CPU, TRIG_PID };
+
+typedef struct {
+    char *buf;                 // Formatted tick text
+    size_t len, cap;
+} trigger_slot;
+
+typedef struct {
+    int metric;                // TRIG_CPU: busiest CPU %, TRIG_PID: top process %
+    double threshold;          // Fires above this
+    int for_ticks;             // Consecutive ticks above threshold needed
+    int run;                   // Current streak
+    const char *expr;          // Expression as given, for the capture notes
+    trigger_slot *ring;        // Pre-trigger context, oldest at head
+    long pre;                  // Ring capacity in ticks
+    long head, count;
+    long post;                 // Ticks written after the last firing
+    long post_left;            // Ticks still to write in the open window
+    long fired;                // Captures started
+    FILE *capture;             // Memory stream each tick is formatted into
+    char *capture_buf;
+    size_t capture_len;
+} trigger;
+
+/**
+ * Parses a trigger expression
+ * Accepts METRIC>PCT with an optional :TICKS streak length, where METRIC is
+ * "cpu" (busiest CPU) or "pid-pct" (busiest process)
+ * @param t: Trigger to fill
+ * @param expr: Expression, e.g. "cpu>90:3" or "pid-pct>50"
+ * Returns: 0 on success, -1 on a malformed expression
+ */
+static int trigger_parse(trigger *t, const char *expr) {
+    memset(t, 0, sizeof *t);
+    t->expr = expr;
+    const char *p;
+    if (strncmp(expr, "cpu>", 4) == 0) { t->metric = TRIG_CPU; p = expr + 4; }
+    else if (strncmp(expr, "pid-pct>", 8) == 0) { t->metric = TRIG_PID; p = expr + 8; }
+    else return -1;
+    
+    char *end;
+    t->threshold = strtod(p, &end);
+    if (end == p) return -1;
+    t->for_ticks = 1;
+    if (*end == ':') {
+        p = end + 1;
+        long n = strtol(p, &end, 10);
+        if (end == p || n < 1 || n > 1000000) return -1;
+        t->for_ticks = (int)n;
+    }
+    return *end ? -1 : 0;
+}
+
+/**
+ * Allocates the context ring and the capture stream
+ * @param t: Parsed trigger
+ * @param pre_ticks: Ticks of context kept before a firing
+ * @param post_ticks: Ticks written after the last firing
+ */
+static void trigger_init(trigger *t, long pre_ticks, long post_ticks) {
+    t->pre = pre_ticks;
+    t->post = post_ticks;
+    t->ring = calloc(pre_ticks ? pre_ticks : 1, sizeof *t->ring);
+    t->capture = open_memstream(&t->capture_buf, &t->capture_len);
+    if (!t->capture) { perror("open_memstream"); exit(1); }
+}
+
+/**
+ * Releases the ring and the capture stream
+ */
+static void trigger_free(trigger *t) {
+    for (long i = 0; i < t->pre; i++) free(t->ring[i].buf);
+    free(t->ring);
+    fclose(t->capture);
+    free(t->capture_buf);
+}
+
+/**
+ * Returns the stream this tick's text should be formatted into
+ */
+static FILE *trigger_begin_tick(trigger *t) {
+    rewind(t->capture);
+    return t->capture;
+}
+
+/**
+ * Routes one formatted tick: into the context ring, or out with its context
+ * @param t: Trigger
+ * @param out: Real output stream
+ * @param value: This tick's metric, busiest CPU or process %
+ * Returns: Nonzero if anything was written to out
+ */
+static int trigger_end_tick(trigger *t, FILE *out, double value) {
+    fflush(t->capture);
+    size_t len = t->capture_len;
+    
+    t->run = value > t->threshold ? t->run + 1 : 0;
+    int fire = t->run >= t->for_ticks;
+    
+    if (fire && t->post_left == 0) {
+        // New capture: the note, then the context leading up to it
+        char tbuf[32];
+        timestamp_centis(tbuf, sizeof tbuf);
+        fprintf(out, "# trigger %s fired at %s (%.1f%%), %ld ticks of context\n",
+                t->expr, tbuf, value, t->count);
+        for (long i = 0; i < t->count; i++) {
+            trigger_slot *s = &t->ring[(t->head + i) % t->pre];
+            fwrite(s->buf, 1, s->len, out);
+        }
+        t->head = t->count = 0;
+        t->fired++;
+    }
+    if (fire) t->post_left = t->post + 1;  // This tick plus post after it
+    
+    if (t->post_left > 0) {
+        fwrite(t->capture_buf, 1, len, out);
+        if (--t->post_left == 0) fprintf(out, "# trigger %s window closed\n", t->expr);
+        return 1;
+    }
+    
+    // Quiet tick: keep it as context, overwriting the oldest when full
+    if (t->pre == 0) return 0;
+    trigger_slot *s;
+    if (t->count < t->pre) {
+        s = &t->ring[(t->head + t->count++) % t->pre];
+    } else {
+        s = &t->ring[t->head];
+        t->head = (t->head + 1) % t->pre;
+    }
+    if (s->cap < len) {
+        s->cap = len * 2;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf, t->capture_buf, len);
+    s->len = len;
+    return 0;
+}
+
+/*
+ * Metrics exporter (--serve [HOST]:PORT)
+ * Sampling stays at the full rate, but nothing is printed: every tick is
+ * folded into per-CPU aggregates for the current scrape window (max, p99
+ * from a 1% histogram, mean), cumulative time-above-threshold counters and
+ * the peak share of the busiest processes. A scrape renders them in the
+ * Prometheus text format and starts a new window. Each scraper has a window
+ * of its own, keyed by the scraper= query parameter or else the client's
+ * address, so an HA pair or a curl next to Prometheus does not cut the
+ * others' windows short and hide their spikes; a scraper's first request
+ * opens its window and reports an empty one. The listening socket and
+ * connections are non-blocking and serviced once per tick from the
+ * sampling thread, so a slow scraper only ever costs a failed send().
+ */
+#define SERVE_MAX_CONNS 16             // Concurrent scrapers
+#define SERVE_REQUEST_MAX 4096         // Request header bytes accepted
+#define SERVE_TIMEOUT_NS 5000000000LL  // Connections are closed after this
+#define SERVE_PEAKS_PER_TOP 4          // Peak table size, in multiples of top_n
+#define SERVE_MAX_WINDOWS 8            // Scrapers tracked; the least recent gives way
+
+typedef struct {
+    int fd;                            // Client socket, -1 if the slot is free
+    long long opened_ns;
+    char peer[64];                     // Client address, the default window key
+    char in[SERVE_REQUEST_MAX];        // Request read so far
+    size_t in_len;
+    char *out;                         // Response being sent, NULL until rendered
+    size_t out_len, out_sent;
+} http_conn;
+
+typedef struct {
+    int pid;
+    char comm[64];
+    double peak;                       // Highest share of the window
+} serve_peak;
+
+// One scraper's window, reset by each of its scrapes
+typedef struct {
+    char key[64];                      // Scraper name or address, empty if the slot is free
+    long long scraped_ns;              // Last scrape, for eviction
+    uint32_t *hist;                    // ncpu rows of 101 busy % buckets
+    double *max, *sum;                 // Per CPU
+    unsigned long window_ticks;
+    long long window_start_ns;
+    serve_peak *peaks;                 // Busiest processes, unordered
+    int npeaks;
+} serve_window;
+
+typedef struct {
+    int listen_fd;
+    http_conn conns[SERVE_MAX_CONNS];
+    int ncpu;
+    int *cpu;                          // CPU number of each column, for the labels
+    double threshold;                  // Busy % counted as above threshold
+    serve_window windows[SERVE_MAX_WINDOWS];
+    int peaks_cap;                     // Peak table size of every window
+    
+    // Counters since start
+    double *above_s;                   // Per-CPU seconds above threshold
+    unsigned long long ticks_total;
+    unsigned long long scrapes_total;
+} serve_state;
+
+/**
+ * Resolves a [HOST]:PORT option value
+ * @param opt: Option name for messages
+ * @param addr: [HOST]:PORT, with HOST in brackets for IPv6, empty for any
+ * @param hints: getaddrinfo hints
+ * @param res: Output address list, freed with freeaddrinfo
+ * Returns: 0 on success, -1 with a message printed
+ */
+static int resolve_host_port(const char *opt, const char *addr,
+                             const struct addrinfo *hints, struct addrinfo **res) {
+    char host[256];
+    const char *colon = strrchr(addr, ':');
+    if (!colon || !colon[1] || (size_t)(colon - addr) >= sizeof host) {
+        fprintf(stderr, "%s: expected [HOST]:PORT, got '%s'\n", opt, addr);
+        return -1;
+    }
+    memcpy(host, addr, (size_t)(colon - addr));
+    host[colon - addr] = '\0';
+    char *h = host;
+    size_t hlen = strlen(h);
+    if (hlen >= 2 && h[0] == '[' && h[hlen - 1] == ']') { h[hlen - 1] = '\0'; h++; }
+    
+    int err = getaddrinfo(*h ? h : NULL, colon + 1, hints, res);
+    if (err) {
+        fprintf(stderr, "%s: %s: %s\n", opt, addr, gai_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens the metrics listener
+ * @param sv: State to initialize
+ * @param addr: [HOST]:PORT, with HOST in brackets for IPv6, empty for all
+ * @param ncpu: Number of CPUs
+ * @param ids: CPU number of each column, or NULL if they are 0 to ncpu - 1
+ * @param threshold: Busy % counted by the above-threshold counters
+ * Returns: 0 on success, -1 with a message printed
+ */
+static int serve_open(serve_state *sv, const char *addr, int ncpu, const int *ids,
+                      double threshold) {
+    memset(sv, 0, sizeof *sv);
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM }, *res;
+    if (resolve_host_port("--serve", addr, &hints, &res) != 0) return -1;
+    sv->listen_fd = -1;
+    for (struct addrinfo *ai = res; ai && sv->listen_fd == -1; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+            sv->listen_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(res);
+    if (sv->listen_fd == -1) { perror(addr); return -1; }
+    
+    for (int i = 0; i < SERVE_MAX_CONNS; i++) sv->conns[i].fd = -1;
+    sv->ncpu = ncpu;
+    sv->cpu = malloc(ncpu * sizeof *sv->cpu);
+    for (int i = 0; i < ncpu; i++) sv->cpu[i] = ids ? ids[i] : i;
+    sv->threshold = threshold;
+    sv->above_s = calloc(ncpu, sizeof *sv->above_s);
+    sv->peaks_cap = top_n * SERVE_PEAKS_PER_TOP;
+    return 0;
+}
+
+/**
+ * Closes the listener and all connections
+ */
+static void serve_close(serve_state *sv) {
+    close(sv->listen_fd);
+    for (int i = 0; i < SERVE_MAX_CONNS; i++) {
+        if (sv->conns[i].fd != -1) close(sv->conns[i].fd);
+        free(sv->conns[i].out);
+    }
+    for (int i = 0; i < SERVE_MAX_WINDOWS; i++) {
+        serve_window *w = &sv->windows[i];
+        free(w->hist);
+        free(w->max);
+        free(w->sum);
+        free(w->peaks);
+    }
+    free(sv->cpu);
+    free(sv->above_s);
+}
+
+/**
+ * Empties a window
+ * @param sv: Exporter state
+ * @param w: Window to reset
+ * @param now: CLOCK_MONOTONIC, ns, the new window's start
+ */
+static void serve_window_reset(serve_state *sv, serve_window *w, long long now) {
+    memset(w->hist, 0, (size_t)sv->ncpu * 101 * sizeof *w->hist);
+    memset(w->max, 0, sv->ncpu * sizeof *w->max);
+    memset(w->sum, 0, sv->ncpu * sizeof *w->sum);
+    w->window_ticks = 0;
+    w->window_start_ns = now;
+    w->npeaks = 0;
+}
+
+/**
+ * Finds a scraper's window, opening one if it is new
+ * A new scraper takes a free slot or the one scraped least recently
+ * @param sv: Exporter state
+ * @param key: Scraper name or address
+ * @param now: CLOCK_MONOTONIC, ns
+ */
+static serve_window *serve_window_find(serve_state *sv, const char *key, long long now) {
+    serve_window *w = NULL;
+    for (int i = 0; i < SERVE_MAX_WINDOWS; i++) {
+        serve_window *c = &sv->windows[i];
+        if (c->key[0] && strncmp(c->key, key, sizeof c->key - 1) == 0) return c;
+        if (!w || (w->key[0] && (!c->key[0] || c->scraped_ns < w->scraped_ns))) w = c;
+    }
+    if (!w->hist) {
+        w->hist = malloc((size_t)sv->ncpu * 101 * sizeof *w->hist);
+        w->max = malloc(sv->ncpu * sizeof *w->max);
+        w->sum = malloc(sv->ncpu * sizeof *w->sum);
+        w->peaks = malloc(sv->peaks_cap * sizeof *w->peaks);
+        if (!w->hist || !w->max || !w->sum || !w->peaks) { perror("malloc"); exit(1); }
+    }
+    snprintf(w->key, sizeof w->key, "%s", key);
+    serve_window_reset(sv, w, now);
+    return w;
+}
+
+/**
+ * Folds one tick into every scraper's window
+ * @param sv: Exporter state
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param top: Sorted top processes of this tick
+ * @param ntop: Entries in top, 0 on ticks without a process scan
+ * @param interval_ns: Length of this tick
+ */
+static void serve_tick(serve_state *sv, const cpu_sample *curc, const cpu_sample *prevc,
+                       const proc_usage *top, int ntop, long long interval_ns) {
+    for (int i = 0; i < sv->ncpu; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        unsigned long long di = curc[i].idle - prevc[i].idle;
+        double usage = dt ? 100.0 * (dt - di) / (double)dt : 0.0;
+        int bucket = (int)(usage + 0.5);
+        if (bucket > 100) bucket = 100;
+        for (int k = 0; k < SERVE_MAX_WINDOWS; k++) {
+            serve_window *w = &sv->windows[k];
+            if (!w->key[0]) continue;
+            w->hist[i * 101 + bucket]++;
+            if (usage > w->max[i]) w->max[i] = usage;
+            w->sum[i] += usage;
+        }
+        if (usage > sv->threshold) sv->above_s[i] += interval_ns / 1e9;
+    }
+    sv->ticks_total++;
+    
+    for (int k = 0; k < SERVE_MAX_WINDOWS; k++) {
+        serve_window *w = &sv->windows[k];
+        if (!w->key[0]) continue;
+        w->window_ticks++;
+        
+        // Keep each process's peak; when the table is full, a newcomer evicts
+        // the smallest peak if it beats it. Process ticks are counted at
+        // USER_HZ, so one sampling tick can see more than its share; clamp to
+        // all CPUs
+        for (int t = 0; t < ntop; t++) {
+            double pct = top[t].pct < 100.0 ? top[t].pct : 100.0;
+            if (pct <= 0.0) break;   // Sorted, so the rest are idle too
+            int found = -1, lowest = 0;
+            for (int j = 0; j < w->npeaks; j++) {
+                if (w->peaks[j].pid == top[t].pid) { found = j; break; }
+                if (w->peaks[j].peak < w->peaks[lowest].peak) lowest = j;
+            }
+            if (found < 0) {
+                if (w->npeaks < sv->peaks_cap) found = w->npeaks++;
+                else if (pct > w->peaks[lowest].peak) found = lowest;
+                else continue;
+                w->peaks[found] = (serve_peak){ .pid = top[t].pid, .peak = pct };
+                snprintf(w->peaks[found].comm, sizeof w->peaks[found].comm, "%s", top[t].comm);
+            } else if (pct > w->peaks[found].peak) {
+                w->peaks[found].peak = pct;
+            }
+        }
+    }
+}
+
+/**
+ * Orders peaks from the busiest down
+ */
+static int serve_peak_cmp(const void *a, const void *b) {
+    double pa = ((const serve_peak *)a)->peak, pb = ((const serve_peak *)b)->peak;
+    return (pa < pb) - (pa > pb);
+}
+
+/**
+ * Writes a Prometheus label value, escaping backslash, quote and newline
+ */
+static void serve_label(FILE *out, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"') { fputc('\\', out); fputc(*s, out); }
+        else if (*s == '\n') fputs("\\n", out);
+        else fputc(*s, out);
+    }
+}
+
+/**
+ * Renders the metrics of a scraper's window and starts it again
+ * @param sv: Exporter state
+ * @param key: Scraper name or address
+ * @param out: Stream to render into
+ */
+static void serve_render(serve_state *sv, const char *key, FILE *out) {
+    long long now = mono_ns();
+    serve_window *w = serve_window_find(sv, key, now);
+    w->scraped_ns = now;
+    sv->scrapes_total++;
+    fprintf(out, "# HELP cpu100_window_seconds Time covered by this scrape's window metrics.\n"
+            "# TYPE cpu100_window_seconds gauge\n"
+            "cpu100_window_seconds %.3f\n", (now - w->window_start_ns) / 1e9);
+    fprintf(out, "# HELP cpu100_window_ticks Samples in this scrape's window.\n"
+            "# TYPE cpu100_window_ticks gauge\n"
+            "cpu100_window_ticks %lu\n", w->window_ticks);
+    fprintf(out, "# HELP cpu100_ticks_total Samples taken since start.\n"
+            "# TYPE cpu100_ticks_total counter\n"
+            "cpu100_ticks_total %llu\n", sv->ticks_total);
+    
+    fputs("# HELP cpu100_cpu_busy_max_percent Highest per-tick busy share in the window.\n"
+          "# TYPE cpu100_cpu_busy_max_percent gauge\n", out);
+    for (int i = 0; i < sv->ncpu; i++)
+        fprintf(out, "cpu100_cpu_busy_max_percent{cpu=\"%d\"} %.1f\n", sv->cpu[i], w->max[i]);
+    fputs("# HELP cpu100_cpu_busy_p99_percent 99th percentile per-tick busy share in the window.\n"
+          "# TYPE cpu100_cpu_busy_p99_percent gauge\n", out);
+    for (int i = 0; i < sv->ncpu; i++) {
+        const uint32_t *h = &w->hist[i * 101];
+        unsigned long want = w->window_ticks - w->window_ticks / 100, seen = 0;
+        int p = 0;
+        while (p < 100 && (seen += h[p]) < want) p++;
+        fprintf(out, "cpu100_cpu_busy_p99_percent{cpu=\"%d\"} %d\n", sv->cpu[i],
+                w->window_ticks ? p : 0);
+    }
+    fputs("# HELP cpu100_cpu_busy_mean_percent Mean busy share in the window.\n"
+          "# TYPE cpu100_cpu_busy_mean_percent gauge\n", out);
+    for (int i = 0; i < sv->ncpu; i++) {
+        fprintf(out, "cpu100_cpu_busy_mean_percent{cpu=\"%d\"} %.1f\n", sv->cpu[i],
+                w->window_ticks ? w->sum[i] / w->window_ticks : 0.0);
+    }
+    fprintf(out, "# HELP cpu100_cpu_above_threshold_seconds_total Time the CPU spent above "
+            "%.0f%% busy.\n# TYPE cpu100_cpu_above_threshold_seconds_total counter\n",
+            sv->threshold);
+    for (int i = 0; i < sv->ncpu; i++) {
+        fprintf(out, "cpu100_cpu_above_threshold_seconds_total{cpu=\"%d\"} %.2f\n", sv->cpu[i],
+                sv->above_s[i]);
+    }
+    
+    qsort(w->peaks, w->npeaks, sizeof *w->peaks, serve_peak_cmp);
+    fputs("# HELP cpu100_process_peak_percent Highest per-tick share of all CPUs in the window.\n"
+          "# TYPE cpu100_process_peak_percent gauge\n", out);
+    for (int k = 0; k < w->npeaks && k < top_n; k++) {
+        fprintf(out, "cpu100_process_peak_percent{pid=\"%d\",comm=\"", w->peaks[k].pid);
+        serve_label(out, w->peaks[k].comm);
+        fprintf(out, "\"} %.1f\n", w->peaks[k].peak);
+    }
+    
+    serve_window_reset(sv, w, now);
+}
+
+/**
+ * Builds the HTTP response for a complete request
+ * @param sv: Exporter state
+ * @param c: Connection with its request headers in
+ */
+static void serve_respond(serve_state *sv, http_conn *c) {
+    char path[256] = "";
+    sscanf(c->in, "GET %255s", path);
+    char *q = strchr(path, '?');
+    if (q) *q++ = '\0';
+    
+    // ?scraper=NAME separates scrapers that share an address
+    const char *key = c->peer;
+    for (char *param = q; param; param = strchr(param, '&')) {
+        if (*param == '&') *param++ = '\0';
+        if (strncmp(param, "scraper=", 8) == 0 && param[8]) key = param + 8;
+    }
+    
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (!f) { perror("open_memstream"); exit(1); }
+    const char *status = "200 OK", *type = "text/plain; version=0.0.4; charset=utf-8";
+    if (strcmp(path, "/metrics") == 0) {
+        serve_render(sv, key, f);
+    } else if (strcmp(path, "/") == 0) {
+        type = "text/html";
+        fputs("<html><body><a href=\"/metrics\">Metrics</a></body></html>\n", f);
+    } else {
+        status = *path ? "404 Not Found" : "405 Method Not Allowed";
+        type = "text/plain";
+        fprintf(f, "%s\n", status);
+    }
+    fclose(f);
+    
+    FILE *r = open_memstream(&c->out, &c->out_len);
+    if (!r) { perror("open_memstream"); exit(1); }
+    fprintf(r, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", status, type, body_len);
+    fwrite(body, 1, body_len, r);
+    fclose(r);
+    free(body);
+    c->out_sent = 0;
+}
+
+/**
+ * Closes a connection and frees its slot
+ */
+static void serve_drop(http_conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+}
+
+/**
+ * Accepts scrapers and moves their requests and responses along
+ * Never blocks: whatever the sockets cannot take now waits for the next tick
+ * @param sv: Exporter state
+ */
+static void serve_poll(serve_state *sv) {
+    long long now = mono_ns();
+    for (;;) {
+        int slot = 0;
+        while (slot < SERVE_MAX_CONNS && sv->conns[slot].fd != -1) slot++;
+        if (slot == SERVE_MAX_CONNS) break;   // Full: the backlog holds the rest
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof peer;
+        int fd = accept4(sv->listen_fd, (struct sockaddr *)&peer, &peer_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) break;
+        sv->conns[slot] = (http_conn){ .fd = fd, .opened_ns = now };
+        if (getnameinfo((struct sockaddr *)&peer, peer_len, sv->conns[slot].peer,
+                        sizeof sv->conns[slot].peer, NULL, 0, NI_NUMERICHOST) != 0) {
+            snprintf(sv->conns[slot].peer, sizeof sv->conns[slot].peer, "?");
+        }
+    }
+    
+    for (int i = 0; i < SERVE_MAX_CONNS; i++) {
+        http_conn *c = &sv->conns[i];
+        if (c->fd == -1) continue;
+        if (now - c->opened_ns > SERVE_TIMEOUT_NS) { serve_drop(c); continue; }
+        
+        if (!c->out) {
+            ssize_t bytes = recv(c->fd, c->in + c->in_len, sizeof c->in - 1 - c->in_len, 0);
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+                serve_drop(c);
+                continue;
+            }
+            if (bytes > 0) c->in_len += (size_t)bytes;
+            c->in[c->in_len] = '\0';
+            if (!strstr(c->in, "\r\n\r\n") && !strstr(c->in, "\n\n")) {
+                if (c->in_len == sizeof c->in - 1) serve_drop(c);  // Oversized request
+                continue;
+            }
+            serve_respond(sv, c);
+        }
+        
+        ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+                            MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EINTR) { serve_drop(c); continue; }
+        if (sent > 0) c->out_sent += (size_t)sent;
+        if (c->out_sent == c->out_len) serve_drop(c);
+    }
+}
+
+/*
+ * Binary ring output (--binary FILE, --decode FILE)
+ * The file is a fixed header, a ring of fixed-size tick records and a ring
+ * of interned comm strings, all memory-mapped so a tick costs a memcpy and
+ * no syscalls. Top process entries refer to comm strings by sequence number,
+ * and a string is only appended when a PID first shows up in a top list or
+ * changes its name. The header is followed by the CPU number of each
+ * column. --decode turns a file back into the text format.
+ */
+#define BIN_MAGIC "CPU100R1"
+
+typedef struct {
+    char magic[8];             // BIN_MAGIC
+    uint32_t version;          // Layout version, 1
+    uint32_t ncpu;             // CPUs per record
+    uint32_t topn;             // Top process slots per record
+    uint32_t record_size;      // Bytes per tick record
+    uint64_t capacity;         // Tick records in the ring
+    uint64_t comm_capacity;    // Comm entries in the ring
+    uint64_t ring_offset;      // File offset of the tick ring
+    uint64_t comm_offset;      // File offset of the comm ring
+    int64_t realtime_offset;   // CLOCK_REALTIME - CLOCK_MONOTONIC at start, ns
+    int64_t interval_ns;       // Sampling period
+    uint64_t head;             // Tick records written so far
+    uint64_t comm_head;        // Comm entries written so far
+    uint32_t nfields;          // Breakdown columns per CPU, 0 without --breakdown
+    uint32_t reserved;
+    // Followed by uint32_t cpu[ncpu], the CPU number of each column
+} bin_header;
+
+typedef struct {
+    uint64_t seq;              // Record number
+    uint64_t mono_ns;          // CLOCK_MONOTONIC at sampling time
+    uint32_t missed;           // Ticks skipped right before this one
+    uint32_t ntop;             // Valid entries in the top list
+    uint32_t window;           // Ticks the top list covers, 0 if it was not sampled
+    uint32_t window_total;     // CPU ticks of all CPUs over that window
+    // Followed by uint32_t busy[ncpu], total[ncpu], bin_top top[topn] and
+    // the column-major breakdown, uint32_t fields[nfields][ncpu]
+} bin_record;
+
+typedef struct {
+    uint32_t pid;              // Process ID
+    uint32_t ticks;            // CPU ticks used during the tick
+    uint32_t comm_seq;         // Sequence number of the comm entry
+} bin_top;
+
+typedef struct {
+    uint32_t pid;              // Process the name belongs to
+    char comm[64];             // NUL terminated process name
+} bin_comm;
+
+// Writer state
+typedef struct {
+    bin_header *hdr;           // Mapped file
+    size_t size;               // Mapping size
+    pid_table comms;           // PID -> latest comm sequence number
+} bin_writer;
+
+/**
+ * Returns a pointer to ring slot seq of a mapped file
+ */
+static bin_record *bin_slot(bin_header *hdr, uint64_t seq) {
+    return (bin_record *)((char *)hdr + hdr->ring_offset +
+                          (seq % hdr->capacity) * hdr->record_size);
+}
+
+/**
+ * Returns a pointer to comm ring slot seq of a mapped file
+ */
+static bin_comm *bin_comm_slot(bin_header *hdr, uint64_t seq) {
+    return (bin_comm *)((char *)hdr + hdr->comm_offset) + seq % hdr->comm_capacity;
+}
+
+/**
+ * Creates and maps a binary ring file
+ * @param bw: Writer to initialize
+ * @param path: File to create, truncated if it exists
+ * @param ncpu: CPUs per record
+ * @param ids: CPU number of each column, or NULL if they are 0 to ncpu - 1
+ * @param capacity: Tick records in the ring
+ * @param interval_ns: Sampling period
+ * @param nfields: Breakdown columns per CPU, 0 for none
+ */
+static void bin_open(bin_writer *bw, const char *path, int ncpu, const int *ids,
+                     uint64_t capacity, long long interval_ns, int nfields) {
+    uint32_t record_size = (uint32_t)(sizeof(bin_record) + 2 * ncpu * sizeof(uint32_t) +
+                                      top_n * sizeof(bin_top) +
+                                      (size_t)nfields * ncpu * sizeof(uint32_t));
+    record_size = (record_size + 7) & ~7u;
+    uint64_t comm_capacity = top_n * capacity < 65536 ? 65536 : top_n * capacity;
+    uint64_t ring_offset = (sizeof(bin_header) + (uint64_t)ncpu * sizeof(uint32_t) + 4095) & ~4095ull;
+    uint64_t comm_offset = ring_offset + capacity * record_size;
+    size_t size = comm_offset + comm_capacity * sizeof(bin_comm);
+    
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) { perror(path); exit(1); }
+    if (ftruncate(fd, (off_t)size) != 0) { perror("ftruncate"); exit(1); }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { perror("mmap"); exit(1); }
+    close(fd);
+    
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    long long mono = mono_ns();
+    
+    bw->hdr = map;
+    bw->size = size;
+    *bw->hdr = (bin_header){
+        .version = 1, .ncpu = (uint32_t)ncpu, .topn = (uint32_t)top_n, .record_size = record_size,
+        .capacity = capacity, .comm_capacity = comm_capacity,
+        .ring_offset = ring_offset, .comm_offset = comm_offset,
+        .realtime_offset = rt.tv_sec * 1000000000LL + rt.tv_nsec - mono,
+        .interval_ns = interval_ns, .nfields = (uint32_t)nfields,
+    };
+    uint32_t *cpu = (uint32_t *)(bw->hdr + 1);
+    for (int i = 0; i < ncpu; i++) cpu[i] = (uint32_t)(ids ? ids[i] : i);
+    memcpy(bw->hdr->magic, BIN_MAGIC, 8);
+    pid_table_init(&bw->comms, 10);
+}
+
+/**
+ * Finds the comm entry for a process, appending one if it is new or renamed
+ * @param bw: Writer
+ * @param pid: Process ID
+ * @param comm: Current process name
+ * Returns: Comm sequence number
+ */
+static uint32_t bin_intern_comm(bin_writer *bw, int pid, const char *comm) {
+    bin_header *hdr = bw->hdr;
+    int seq = pid_lookup(&bw->comms, pid);
+    if (seq >= 0 && hdr->comm_head - (uint64_t)seq <= hdr->comm_capacity) {
+        bin_comm *e = bin_comm_slot(hdr, (uint64_t)seq);
+        if (e->pid == (uint32_t)pid && strcmp(e->comm, comm) == 0) return (uint32_t)seq;
+    }
+    
+    uint64_t next = hdr->comm_head;
+    bin_comm *e = bin_comm_slot(hdr, next);
+    e->pid = (uint32_t)pid;
+    snprintf(e->comm, sizeof e->comm, "%s", comm);
+    __atomic_store_n(&hdr->comm_head, next + 1, __ATOMIC_RELEASE);
+    pid_table_update(&bw->comms, pid, (int)next);
+    return (uint32_t)next;
+}
+
+/**
+ * Clamps a tick delta into a record field
+ */
+static uint32_t bin_u32(unsigned long long v) {
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+/**
+ * Appends one tick to the ring
+ * @param bw: Writer
+ * @param mono: CLOCK_MONOTONIC at sampling time, ns
+ * @param missed: Ticks skipped before this one
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param breakdown: Column deltas, nfields * ncpu, or NULL without a breakdown
+ * @param arr: Top processes, sorted
+ * @param ntop: Entries in arr (at most top_n)
+ * @param window: Ticks the top list was sampled over, 0 for none this tick
+ * @param window_total: CPU ticks of all CPUs over the window
+ */
+static void bin_write_tick(bin_writer *bw, long long mono, long missed,
+                           const cpu_sample *curc, const cpu_sample *prevc,
+                           const uint32_t *breakdown, const proc_usage *arr, int ntop,
+                           long window, unsigned long long window_total) {
+    bin_header *hdr = bw->hdr;
+    uint64_t seq = hdr->head;
+    bin_record *r = bin_slot(hdr, seq);
+    uint32_t *busy = (uint32_t *)(r + 1);
+    uint32_t *total = busy + hdr->ncpu;
+    bin_top *top = (bin_top *)(total + hdr->ncpu);
+    
+    r->seq = seq;
+    r->mono_ns = (uint64_t)mono;
+    r->missed = (uint32_t)missed;
+    r->ntop = (uint32_t)ntop;
+    r->window = (uint32_t)window;
+    r->window_total = bin_u32(window_total);
+    for (uint32_t i = 0; i < hdr->ncpu; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        unsigned long long di = curc[i].idle - prevc[i].idle;
+        busy[i] = bin_u32(dt - di);
+        total[i] = bin_u32(dt);
+    }
+    for (int i = 0; i < ntop; i++) {
+        top[i] = (bin_top){ (uint32_t)arr[i].pid, bin_u32(arr[i].ticks),
+                            bin_intern_comm(bw, arr[i].pid, arr[i].comm) };
+    }
+    if (hdr->nfields) {
+        memcpy(top + hdr->topn, breakdown, (size_t)hdr->nfields * hdr->ncpu * sizeof(uint32_t));
+    }
+    
+    // Publish the record only once it is complete
+    __atomic_store_n(&hdr->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Flushes and unmaps a binary ring file
+ * @param bw: Writer
+ */
+static void bin_close(bin_writer *bw) {
+    msync(bw->hdr, bw->size, MS_SYNC);
+    munmap(bw->hdr, bw->size);
+    free(bw->comms.slots);
+}
+
+/**
+ * Checks that a header describes rings that fit in the file, so a
+ * truncated or damaged file cannot send the decoder out of the mapping
+ * @param hdr: Mapped file
+ * @param size: File size
+ * Returns: 1 if the file can be decoded, 0 if not
+ */
+static int bin_header_valid(const bin_header *hdr, uint64_t size) {
+    if (memcmp(hdr->magic, BIN_MAGIC, 8) != 0 || hdr->version != 1) return 0;
+    if (hdr->ncpu < 1 || hdr->ncpu > 65536 || hdr->topn > 1000 || hdr->nfields > CPU_FIELDS) return 0;
+    uint64_t min_record = sizeof(bin_record) + 2 * (uint64_t)hdr->ncpu * sizeof(uint32_t) +
+                          hdr->topn * sizeof(bin_top) +
+                          (uint64_t)hdr->nfields * hdr->ncpu * sizeof(uint32_t);
+    if (hdr->record_size < min_record || hdr->capacity == 0 || hdr->comm_capacity == 0) return 0;
+    uint64_t head_size = sizeof(bin_header) + (uint64_t)hdr->ncpu * sizeof(uint32_t);
+    if (hdr->ring_offset < head_size || hdr->ring_offset > size ||
+        hdr->capacity > (size - hdr->ring_offset) / hdr->record_size) return 0;
+    if (hdr->comm_offset < head_size || hdr->comm_offset > size ||
+        hdr->comm_capacity > (size - hdr->comm_offset) / sizeof(bin_comm)) return 0;
+    return 1;
+}
+
+/**
+ * Prints a binary ring file in the text format, oldest record first
+ * @param path: File written with --binary
+ * Returns: Process exit status
+ */
+static int bin_decode(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { perror(path); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("fstat"); close(fd); return 1; }
+    if ((size_t)st.st_size < sizeof(bin_header)) {
+        fprintf(stderr, "%s: not a cpu100 binary file\n", path);
+        close(fd);
+        return 1;
+    }
+    bin_header *hdr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) { perror("mmap"); return 1; }
+    
+    int *ids = NULL;
+    if (!bin_header_valid(hdr, (uint64_t)st.st_size) || !(ids = load_cpu_ids(hdr + 1, hdr->ncpu))) {
+        fprintf(stderr, "%s: not a cpu100 binary file\n", path);
+        munmap(hdr, (size_t)st.st_size);
+        return 1;
+    }
+    
+    print_header(stdout, (int)hdr->ncpu, ids);
+    
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t comm_head = __atomic_load_n(&hdr->comm_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > hdr->capacity ? head - hdr->capacity : 0;
+    for (uint64_t seq = first; seq < head; seq++) {
+        const bin_record *r = bin_slot(hdr, seq);
+        const uint32_t *busy = (const uint32_t *)(r + 1);
+        const uint32_t *total = busy + hdr->ncpu;
+        const bin_top *top = (const bin_top *)(total + hdr->ncpu);
+        
+        if (r->missed) printf("# missed %u ticks\n", r->missed);
+        
+        long long wall = (long long)r->mono_ns + hdr->realtime_offset;
+        struct timespec ts = { wall / 1000000000LL, wall % 1000000000LL };
+        char tbuf[32];
+        format_centis(&ts, tbuf, sizeof tbuf);
+        printf("%s", tbuf);
+        
+        unsigned long long dt_ticks = 0;
+        for (uint32_t i = 0; i < hdr->ncpu; i++) {
+            double usage = total[i] ? 100.0 * busy[i] / (double)total[i] : 0.0;
+            printf("\t%2.0f%%", usage);
+            dt_ticks += total[i];
+        }
+        putchar('\n');
+        if (hdr->nfields == CPU_FIELDS)
+            print_breakdown(stdout, (const uint32_t *)(top + hdr->topn), (int)hdr->ncpu, ids);
+        
+        // Top lists sampled over several ticks are shares of that window
+        if (r->window > 1) print_window(stdout, r->window * hdr->interval_ns);
+        dt_ticks = r->window_total;
+        for (uint32_t i = 0; i < r->ntop && i < hdr->topn; i++) {
+            const char *comm = "?";
+            if (top[i].comm_seq < comm_head && comm_head - top[i].comm_seq <= hdr->comm_capacity) {
+                const bin_comm *e = bin_comm_slot(hdr, top[i].comm_seq);
+                if (e->pid == top[i].pid) comm = e->comm;
+            }
+            double pct = dt_ticks ? 100.0 * (double)top[i].ticks / (double)dt_ticks : 0.0;
+            printf("    pid=%u %-20s %.1f%%\n", top[i].pid, comm, pct);
+        }
+    }
+    
+    free(ids);
+    munmap(hdr, (size_t)st.st_size);
+    return 0;
+}
+
+/*
+ * Shared-memory live feed (--shm NAME, --shm-read NAME)
+ * Every tick is published into a POSIX shared-memory segment as one
+ * snapshot guarded by a seqlock: the writer makes the sequence number odd,
+ * rewrites the snapshot and makes it even again. A reader copies the
+ * snapshot between two loads of the sequence number and retries if they
+ * differ or are odd, so any number of readers get a consistent latest tick
+ * without locks or syscalls, and a slow reader never holds up the sampler.
+ * The CPU number of each column never changes and sits after the snapshot,
+ * outside the seqlock. A writer killed mid-publish leaves the sequence odd
+ * for good, so readers give up after SHM_STALL_NS instead of spinning.
+ */
+#define SHM_MAGIC "CPU100S1"
+#define SHM_DATA_OFFSET 64     // Snapshot starts on its own cache line
+#define SHM_STALL_NS 50000000LL    // Longest a reader waits out an odd sequence
+
+typedef struct {
+    char magic[8];             // SHM_MAGIC
+    uint32_t version;          // Layout version, 1
+    uint32_t ncpu;             // CPUs per snapshot
+    uint32_t topn;             // Top process slots per snapshot
+    uint32_t writer_pid;       // Sampler publishing into the segment
+    uint64_t snapshot_size;    // Bytes of the snapshot at SHM_DATA_OFFSET
+    int64_t realtime_offset;   // CLOCK_REALTIME - CLOCK_MONOTONIC at start, ns
+    int64_t interval_ns;       // Sampling period
+    uint64_t seq;              // Seqlock sequence, odd while a tick is written
+    // The snapshot at SHM_DATA_OFFSET is followed by uint32_t cpu[ncpu],
+    // the CPU number of each column
+} shm_header;
+
+typedef struct {
+    uint64_t tick;             // Ticks published so far
+    uint64_t mono_ns;          // CLOCK_MONOTONIC at sampling time
+    uint64_t top_tick;         // Tick the top list was sampled at
+    uint32_t missed;           // Ticks skipped right before this one
+    uint32_t ntop;             // Valid entries in the top list
+    // Followed by shm_cpu cpu[ncpu], shm_top top[topn] and shm_cpu_sum sum[ncpu]
+} shm_snapshot;
+
+typedef struct {
+    uint32_t busy;             // Busy ticks of the CPU during the tick
+    uint32_t total;            // All ticks of the CPU during the tick
+} shm_cpu;
+
+typedef struct {
+    int32_t pid;               // Process ID
+    float pct;                 // Share of all CPUs, as in the text output
+    char comm[64];             // NUL terminated process name
+} shm_top;
+
+typedef struct {
+    uint64_t busy;             // Busy ticks of the CPU since boot
+    uint64_t total;            // All ticks of the CPU since boot
+} shm_cpu_sum;
+
+_Static_assert(sizeof(shm_header) <= SHM_DATA_OFFSET, "shm header overlaps the snapshot");
+
+// Writer state
+typedef struct {
+    const char *name;          // Segment name, unlinked at exit
+    shm_header *hdr;           // Mapped segment
+    size_t size;               // Mapping size
+    uint64_t tick;
+} shm_writer;
+
+/**
+ * Returns the snapshot of a mapped segment
+ */
+static shm_snapshot *shm_data(const shm_header *hdr) {
+    return (shm_snapshot *)((char *)hdr + SHM_DATA_OFFSET);
+}
+
+/**
+ * Returns the size of a snapshot
+ * @param ncpu: CPUs per snapshot
+ * @param topn: Top process slots per snapshot
+ */
+static uint64_t shm_snapshot_bytes(uint32_t ncpu, uint32_t topn) {
+    return sizeof(shm_snapshot) + (uint64_t)ncpu * (sizeof(shm_cpu) + sizeof(shm_cpu_sum)) +
+           (uint64_t)topn * sizeof(shm_top);
+}
+
+/**
+ * Returns the CPU numbers of a mapped segment's columns
+ */
+static const uint32_t *shm_cpu_ids(const shm_header *hdr) {
+    return (const uint32_t *)((const char *)hdr + SHM_DATA_OFFSET + hdr->snapshot_size);
+}
+
+/**
+ * Returns the cumulative CPU counters of a snapshot copy
+ * @param hdr: Segment the snapshot was copied from
+ * @param s: Snapshot copy
+ */
+static shm_cpu_sum *shm_sums(const shm_header *hdr, shm_snapshot *s) {
+    return (shm_cpu_sum *)((char *)(s + 1) + (size_t)hdr->ncpu * sizeof(shm_cpu) +
+                           (size_t)hdr->topn * sizeof(shm_top));
+}
+
+/**
+ * Creates and maps the live feed segment
+ * @param sw: Writer to initialize
+ * @param name: Segment name, starting with '/', or NULL for a mapping private
+ *              to this process (--tui without --shm)
+ * @param ncpu: CPUs per snapshot
+ * @param ids: CPU number of each column, or NULL if they are 0 to ncpu - 1
+ * @param interval_ns: Sampling period
+ */
+static void shm_open_writer(shm_writer *sw, const char *name, int ncpu, const int *ids,
+                            long long interval_ns) {
+    uint64_t snapshot_size = shm_snapshot_bytes((uint32_t)ncpu, (uint32_t)top_n);
+    size_t size = SHM_DATA_OFFSET + snapshot_size + (size_t)ncpu * sizeof(uint32_t);
+    
+    void *map;
+    if (name) {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) { perror(name); exit(1); }
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0) { perror("ftruncate"); exit(1); }
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map == MAP_FAILED) { perror("mmap"); exit(1); }
+    
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    long long mono = mono_ns();
+    
+    sw->name = name;
+    sw->hdr = map;
+    sw->size = size;
+    sw->tick = 0;
+    *sw->hdr = (shm_header){
+        .version = 1, .ncpu = (uint32_t)ncpu, .topn = (uint32_t)top_n,
+        .writer_pid = (uint32_t)getpid(), .snapshot_size = snapshot_size,
+        .realtime_offset = rt.tv_sec * 1000000000LL + rt.tv_nsec - mono,
+        .interval_ns = interval_ns,
+    };
+    uint32_t *cpu = (uint32_t *)((char *)map + SHM_DATA_OFFSET + snapshot_size);
+    for (int i = 0; i < ncpu; i++) cpu[i] = (uint32_t)(ids ? ids[i] : i);
+    // Readers check the magic last, so it goes in once the rest is valid
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(sw->hdr->magic, SHM_MAGIC, 8);
+}
+
+/**
+ * Publishes one tick
+ * @param sw: Writer
+ * @param mono: CLOCK_MONOTONIC at sampling time, ns
+ * @param missed: Ticks skipped before this one
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param arr: Top processes, sorted
+ * @param ntop: Entries in arr
+ * @param scanned: Whether arr was sampled this tick; if not, the previous
+ *                 top list stays and keeps its top_tick
+ */
+static void shm_publish(shm_writer *sw, long long mono, long missed,
+                        const cpu_sample *curc, const cpu_sample *prevc,
+                        const proc_usage *arr, int ntop, int scanned) {
+    shm_header *hdr = sw->hdr;
+    shm_snapshot *s = shm_data(hdr);
+    shm_cpu *cpu = (shm_cpu *)(s + 1);
+    shm_top *top = (shm_top *)(cpu + hdr->ncpu);
+    shm_cpu_sum *sum = shm_sums(hdr, s);
+    
+    uint64_t seq = hdr->seq;
+    __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);   // Odd before any data changes
+    
+    s->tick = ++sw->tick;
+    s->mono_ns = (uint64_t)mono;
+    s->missed = (uint32_t)missed;
+    for (uint32_t i = 0; i < hdr->ncpu; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        unsigned long long di = curc[i].idle - prevc[i].idle;
+        cpu[i] = (shm_cpu){ bin_u32(dt - di), bin_u32(dt) };
+        sum[i] = (shm_cpu_sum){ curc[i].total - curc[i].idle, curc[i].total };
+    }
+    if (scanned) {
+        s->top_tick = s->tick;
+        s->ntop = (uint32_t)ntop;
+        for (int i = 0; i < ntop; i++) {
+            top[i].pid = arr[i].pid;
+            top[i].pct = (float)arr[i].pct;
+            memcpy(top[i].comm, arr[i].comm, sizeof top[i].comm);
+        }
+    }
+    
+    __atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Unmaps and removes the live feed segment
+ * Readers that still have it mapped keep the last snapshot
+ * @param sw: Writer
+ */
+static void shm_close_writer(shm_writer *sw) {
+    munmap(sw->hdr, sw->size);
+    if (sw->name) shm_unlink(sw->name);
+}
+
+/**
+ * Copies a consistent snapshot out of a mapped segment
+ * @param hdr: Mapped segment
+ * @param out: Buffer of hdr->snapshot_size bytes, left undefined on failure
+ * @param seq: Output for the sequence number of the copy, 0 if nothing is
+ *             published yet
+ * Returns: 0 on success, -1 if the writer stayed mid-publish for SHM_STALL_NS
+ */
+static int shm_read_snapshot(const shm_header *hdr, void *out, uint64_t *seq) {
+    long long deadline = 0;
+    for (;;) {
+        uint64_t before = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            // Mid-write, for microseconds unless this reader preempted the
+            // writer on its own CPU, as the --tui render thread can, or the
+            // writer died before finishing
+            long long now = mono_ns();
+            if (!deadline) deadline = now + SHM_STALL_NS;
+            else if (now >= deadline) return -1;
+            sched_yield();
+            continue;
+        }
+        memcpy(out, shm_data(hdr), hdr->snapshot_size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);   // Copy before the recheck
+        if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == before) {
+            *seq = before;
+            return 0;
+        }
+    }
+}
+
+/**
+ * Maps a live feed segment read-only
+ * @param name: Segment name
+ * @param size: Output for the mapping size
+ * Returns: Mapped header, or NULL with a message printed
+ */
+static const shm_header *shm_open_reader(const char *name, size_t *size) {
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) { perror(name); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("fstat"); close(fd); return NULL; }
+    *size = (size_t)st.st_size;
+    const shm_header *hdr = NULL;
+    if (*size >= SHM_DATA_OFFSET) {
+        void *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) hdr = map;
+    }
+    close(fd);
+    if (!hdr || memcmp(hdr->magic, SHM_MAGIC, 8) != 0 || hdr->version != 1 ||
+        hdr->snapshot_size != shm_snapshot_bytes(hdr->ncpu, hdr->topn) ||
+        hdr->snapshot_size > *size - SHM_DATA_OFFSET ||
+        (uint64_t)hdr->ncpu * sizeof(uint32_t) > *size - SHM_DATA_OFFSET - hdr->snapshot_size) {
+        fprintf(stderr, "%s: not a cpu100 shared-memory feed\n", name);
+        if (hdr) munmap((void *)hdr, *size);
+        return NULL;
+    }
+    return hdr;
+}
+
+/**
+ * Prints the latest snapshot of a live feed in the text format
+ * @param name: Segment name
+ * Returns: Process exit status
+ */
+static int shm_read_main(const char *name) {
+    size_t size;
+    const shm_header *hdr = shm_open_reader(name, &size);
+    if (!hdr) return 1;
+    
+    shm_snapshot *s = malloc(hdr->snapshot_size);
+    uint64_t seq;
+    int stalled = shm_read_snapshot(hdr, s, &seq) != 0;
+    if (stalled || seq == 0) {
+        fprintf(stderr, "%s: %s\n", name, stalled ? "writer stalled mid-tick" : "no tick published yet");
+        munmap((void *)hdr, size);
+        free(s);
+        return 1;
+    }
+    const shm_cpu *cpu = (const shm_cpu *)(s + 1);
+    const shm_top *top = (const shm_top *)(cpu + hdr->ncpu);
+    int *ids = load_cpu_ids(shm_cpu_ids(hdr), hdr->ncpu);
+    
+    print_header(stdout, (int)hdr->ncpu, ids);
+    if (s->missed) printf("# missed %u ticks\n", s->missed);
+    long long wall = (long long)s->mono_ns + hdr->realtime_offset;
+    struct timespec ts = { wall / 1000000000LL, wall % 1000000000LL };
+    char tbuf[32];
+    format_centis(&ts, tbuf, sizeof tbuf);
+    printf("%s", tbuf);
+    for (uint32_t i = 0; i < hdr->ncpu; i++) {
+        printf("\t%2.0f%%", cpu[i].total ? 100.0 * cpu[i].busy / (double)cpu[i].total : 0.0);
+    }
+    putchar('\n');
+    if (s->top_tick != s->tick) printf("# top list from tick %llu\n", (unsigned long long)s->top_tick);
+    for (uint32_t i = 0; i < s->ntop && i < hdr->topn; i++) {
+        printf("    pid=%d %-20s %.1f%%\n", top[i].pid, top[i].comm, top[i].pct);
+    }
+    
+    free(ids);
+    munmap((void *)hdr, size);
+    free(s);
+    return 0;
+}
+
+/*
+ * Terminal dashboard (--tui, --tui=NAME)
+ * Shows per-CPU bars with a short busy history, an all-CPU sparkline and
+ * the top processes about ten times a second, rendered from the snapshot
+ * the shared-memory feed publishes. Plain --tui publishes into a private
+ * mapping (or the --shm segment) and draws on a separate thread while the
+ * main thread keeps sampling at the full rate; --tui=NAME attaches to the
+ * feed of a running cpu100 --shm=NAME instead. Busy percentages come from
+ * the snapshot's cumulative counters, so a frame covers every tick since
+ * the previous frame rather than only the latest one. Each frame is drawn
+ * into a grid of cells and compared with the grid already on the terminal,
+ * and only the cells that changed are written, cursor-addressed, in a
+ * single write(): a steady screen costs a few bytes per frame over ssh.
+ * A single tick's top list is quantized to whole clock ticks, so the
+ * process table shows each process's share averaged over recent frames.
+ */
+#define TUI_FRAME_NS 100000000LL   // 10 frames per second
+#define TUI_BAR 20                 // Bar cells per CPU
+#define TUI_SPARK 12               // History cells per CPU
+#define TUI_HISTORY 256            // Frames of history kept, the widest sparkline
+#define TUI_STALL_NS 1000000000LL  // A feed silent this long is shown as stalled
+#define TUI_SMOOTH 0.2f            // Weight of the newest top list in the process table
+
+enum { TUI_PLAIN, TUI_INVERSE, TUI_LOW, TUI_MID, TUI_HIGH };   // Cell attributes
+static const char *const tui_sgr[] = {
+    "\033[0m", "\033[0;7m", "\033[0;32m", "\033[0;33m", "\033[0;31m"
+};
+
+typedef struct {
+    uint32_t glyph;            // UTF-8 bytes of the character, first byte lowest
+    uint32_t attr;             // TUI_*
+} tui_cell;
+
+typedef struct {
+    const shm_header *hdr;     // Feed being shown
+    int *ids;                  // CPU number of each column
+    shm_snapshot *snap;        // Latest consistent copy of its snapshot
+    shm_snapshot *next;        // Copy being read, swapped with snap once consistent
+    uint64_t stuck;            // Odd sequence the writer stalled at, 0 if none
+    shm_cpu_sum *prev;         // CPU counters at the previous frame
+    int have_prev;
+    uint64_t seq;              // Sequence of the latest copy, 0 before the first tick
+    long long seq_ns;          // When the sequence last changed
+    float *pct;                // Busy percent over the last frame, ncpu + 1 (all CPUs last)
+    uint8_t *history;          // ncpu + 1 rings of TUI_HISTORY busy percents
+    int hist_len, hist_head;   // Frames in the rings, slot of the next one
+    shm_top *procs;            // Process table, averaged shares, 2 * topn slots
+    uint32_t nprocs;
+    uint64_t top_tick;         // Tick of the top list last folded in
+    int utf8;                  // Terminal takes block characters
+    int rows, cols;
+    tui_cell *front;           // Cells as on the terminal
+    tui_cell *back;            // Cells of the frame being drawn
+    char *out;                 // Output of one frame
+    size_t out_len;
+    uint32_t attr;             // Attribute the terminal is set to
+    struct termios saved;      // Terminal mode to restore
+    int raw;                   // Whether stdin was switched to unbuffered keys
+    pthread_t thread;          // Render thread of an in-process --tui
+    long frames;
+    unsigned long long bytes;
+} tui_state;
+
+static volatile sig_atomic_t tui_resized;
+static void on_sigwinch(int sig) { (void)sig; tui_resized = 1; }
+static tui_state *tui_active;  // Terminal to restore at exit
+
+/**
+ * Writes all of a buffer to the terminal, giving up on errors
+ */
+static void tui_write(const char *p, size_t len) {
+    while (len) {
+        ssize_t w = write(STDOUT_FILENO, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        p += w;
+        len -= (size_t)w;
+    }
+}
+
+/**
+ * Leaves the alternate screen and restores the terminal mode
+ * Also registered with atexit(), so that a fatal error does not leave the
+ * terminal in raw mode
+ */
+static void tui_restore(void) {
+    tui_state *t = tui_active;
+    if (!t) return;
+    tui_active = NULL;
+    static const char leave[] = "\033[0m\033[?25h\033[?1049l";
+    tui_write(leave, sizeof leave - 1);
+    if (t->raw) tcsetattr(STDIN_FILENO, TCSANOW, &t->saved);
+}
+
+/**
+ * Returns whether the locale asks for UTF-8 output
+ */
+static int tui_utf8_locale(void) {
+    const char *v = getenv("LC_ALL");
+    if (!v || !*v) v = getenv("LC_CTYPE");
+    if (!v || !*v) v = getenv("LANG");
+    return v && (strcasestr(v, "utf-8") || strcasestr(v, "utf8"));
+}
+
+/**
+ * Packs a code point from U+0800 to U+FFFF into a cell glyph
+ */
+static uint32_t tui_utf8(uint32_t cp) {
+    return (0xe0u | cp >> 12) | (0x80u | ((cp >> 6) & 0x3f)) << 8 | (0x80u | (cp & 0x3f)) << 16;
+}
+
+/**
+ * Forgets what is on the terminal and clears it, so the next frame is
+ * written in full
+ */
+static void tui_clear(tui_state *t) {
+    for (size_t i = 0; i < (size_t)t->rows * t->cols; i++) t->front[i] = (tui_cell){ ' ', TUI_PLAIN };
+    t->attr = TUI_PLAIN;
+    static const char clear[] = "\033[0m\033[H\033[2J";
+    tui_write(clear, sizeof clear - 1);
+    t->bytes += sizeof clear - 1;
+}
+
+/**
+ * Sizes the cell grids to the terminal
+ */
+static void tui_resize(tui_state *t) {
+    struct winsize ws;
+    t->rows = 24;
+    t->cols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        t->rows = ws.ws_row < 1000 ? ws.ws_row : 1000;
+        t->cols = ws.ws_col < 1000 ? ws.ws_col : 1000;
+    }
+    size_t cells = (size_t)t->rows * t->cols;
+    free(t->front);
+    free(t->back);
+    free(t->out);
+    t->front = malloc(cells * sizeof *t->front);
+    t->back = malloc(cells * sizeof *t->back);
+    // Per cell at most a cursor move, an attribute and a glyph
+    t->out = malloc(cells * 24 + 16);
+    tui_clear(t);
+}
+
+/**
+ * Sets one cell of the frame being drawn, clipped to the terminal
+ */
+static void tui_set(tui_state *t, int r, int c, uint32_t glyph, uint32_t attr) {
+    if (r < 0 || r >= t->rows || c < 0 || c >= t->cols) return;
+    t->back[(size_t)r * t->cols + c] = (tui_cell){ glyph, attr };
+}
+
+/**
+ * Draws formatted text, one cell per byte; bytes outside printable ASCII,
+ * as process names may have, show as '?'
+ * Returns: Column after the text
+ */
+__attribute__((format(printf, 5, 6)))
+static int tui_printf(tui_state *t, int r, int c, uint32_t attr, const char *fmt, ...) {
+    char text[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof text, fmt, ap);
+    va_end(ap);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++, c++) {
+        tui_set(t, r, c, *p >= 0x20 && *p < 0x7f ? *p : '?', attr);
+    }
+    return c;
+}
+
+/**
+ * Returns the attribute for a busy percentage
+ */
+static uint32_t tui_level(double pct) {
+    return pct < 50.0 ? TUI_LOW : pct < 85.0 ? TUI_MID : TUI_HIGH;
+}
+
+/**
+ * Draws a horizontal bar in eighths of a cell
+ * @param width: Cells of a full bar
+ * @param pct: Busy percent
+ */
+static void tui_bar(tui_state *t, int r, int c, int width, double pct) {
+    int eighths = (int)(pct * width * 8 / 100.0 + 0.5);
+    uint32_t attr = tui_level(pct);
+    for (int i = 0; i < width; i++, eighths -= 8) {
+        uint32_t glyph = ' ';
+        if (eighths >= 8) glyph = t->utf8 ? tui_utf8(0x2588) : '|';
+        else if (eighths > 0 && t->utf8) glyph = tui_utf8(0x2590 - (uint32_t)eighths);
+        else if (eighths >= 4) glyph = '|';
+        tui_set(t, r, c + i, glyph, glyph == ' ' ? TUI_PLAIN : attr);
+    }
+}
+
+/**
+ * Draws the most recent frames of a history ring, newest at the right
+ * @param width: Cells, at most TUI_HISTORY
+ * @param ring: CPU index, or ncpu for all CPUs
+ */
+static void tui_spark(tui_state *t, int r, int c, int width, uint32_t ring) {
+    static const char ascii[] = ".:-=+*#@";
+    const uint8_t *h = t->history + (size_t)ring * TUI_HISTORY;
+    if (width > TUI_HISTORY) width = TUI_HISTORY;
+    for (int i = 0; i < width; i++) {
+        int age = width - 1 - i;
+        if (age >= t->hist_len) continue;
+        int v = h[(t->hist_head - 1 - age + TUI_HISTORY) % TUI_HISTORY];
+        if (v == 0) continue;
+        int level = (v * 8 + 99) / 100;    // 1 to 8
+        tui_set(t, r, c + i, t->utf8 ? tui_utf8(0x2580 + (uint32_t)level) : (uint32_t)ascii[level - 1],
+                tui_level(v));
+    }
+}
+
+/**
+ * Copies the latest snapshot and, if it is new, the busy percentages
+ * since the previous frame into the history
+ * @param now: CLOCK_MONOTONIC, ns
+ */
+static void tui_sample(tui_state *t, long long now) {
+    // A stalled writer is shown as such by the title bar; waiting it out
+    // again every frame would only burn CPU
+    if (t->stuck && __atomic_load_n(&t->hdr->seq, __ATOMIC_RELAXED) == t->stuck) return;
+    uint64_t seq;
+    if (shm_read_snapshot(t->hdr, t->next, &seq) != 0) {
+        t->stuck = __atomic_load_n(&t->hdr->seq, __ATOMIC_RELAXED);
+        return;
+    }
+    t->stuck = 0;
+    if (seq == t->seq) return;
+    shm_snapshot *s = t->snap;
+    t->snap = t->next;
+    t->next = s;
+    t->seq = seq;
+    t->seq_ns = now;
+    
+    uint32_t n = t->hdr->ncpu;
+    const shm_cpu_sum *sum = shm_sums(t->hdr, t->snap);
+    if (t->have_prev) {
+        unsigned long long all_busy = 0, all_total = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            unsigned long long dt = 0, db = 0;
+            if (sum[i].total >= t->prev[i].total && sum[i].busy >= t->prev[i].busy) {
+                dt = sum[i].total - t->prev[i].total;
+                db = sum[i].busy - t->prev[i].busy;
+                if (db > dt) db = dt;
+            }
+            t->pct[i] = dt ? (float)(100.0 * (double)db / (double)dt) : 0.0f;
+            all_busy += db;
+            all_total += dt;
+        }
+        t->pct[n] = all_total ? (float)(100.0 * (double)all_busy / (double)all_total) : 0.0f;
+        for (uint32_t i = 0; i <= n; i++) {
+            t->history[(size_t)i * TUI_HISTORY + (size_t)t->hist_head] = (uint8_t)(t->pct[i] + 0.5f);
+        }
+        t->hist_head = (t->hist_head + 1) % TUI_HISTORY;
+        if (t->hist_len < TUI_HISTORY) t->hist_len++;
+    }
+    memcpy(t->prev, sum, n * sizeof *t->prev);
+    t->have_prev = 1;
+    
+    // Fold a new top list into the averaged process table
+    if (t->snap->top_tick == t->top_tick) return;
+    t->top_tick = t->snap->top_tick;
+    const shm_top *top = (const shm_top *)((const shm_cpu *)(t->snap + 1) + n);
+    uint32_t ntop = t->snap->ntop < t->hdr->topn ? t->snap->ntop : t->hdr->topn;
+    uint32_t cap = 2 * t->hdr->topn;
+    for (uint32_t k = 0; k < t->nprocs; k++) t->procs[k].pct *= 1.0f - TUI_SMOOTH;
+    for (uint32_t i = 0; i < ntop; i++) {
+        uint32_t k = 0;
+        while (k < t->nprocs && t->procs[k].pid != top[i].pid) k++;
+        if (k == t->nprocs) {
+            // A newcomer takes a free slot or the one with the smallest share
+            if (t->nprocs < cap) {
+                t->nprocs++;
+            } else {
+                k = t->nprocs - 1;
+                if (t->procs[k].pct > TUI_SMOOTH * top[i].pct) continue;
+            }
+            t->procs[k] = top[i];
+            t->procs[k].pct = 0.0f;
+        }
+        memcpy(t->procs[k].comm, top[i].comm, sizeof top[i].comm);
+        t->procs[k].pct += TUI_SMOOTH * top[i].pct;
+    }
+    // Insertion sort, largest share first; the table is nearly sorted already
+    for (uint32_t k = 1; k < t->nprocs; k++) {
+        shm_top e = t->procs[k];
+        uint32_t j = k;
+        for (; j > 0 && t->procs[j - 1].pct < e.pct; j--) t->procs[j] = t->procs[j - 1];
+        t->procs[j] = e;
+    }
+}
+
+/**
+ * Draws a frame into the back grid
+ * @param now: CLOCK_MONOTONIC, ns
+ */
+static void tui_draw(tui_state *t, long long now) {
+    const shm_header *hdr = t->hdr;
+    const shm_snapshot *s = t->snap;
+    uint32_t n = hdr->ncpu;
+    for (size_t i = 0; i < (size_t)t->rows * t->cols; i++) t->back[i] = (tui_cell){ ' ', TUI_PLAIN };
+    
+    // Title bar: wall clock of the tick, rate and the state of the feed
+    char clock[16] = "--:--:--";
+    const char *state = "";
+    if (t->seq) {
+        time_t sec = (time_t)(((long long)s->mono_ns + hdr->realtime_offset) / 1000000000LL);
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(clock, sizeof clock, "%H:%M:%S", &tm);
+    }
+    if (t->stuck || (t->seq && now - t->seq_ns > TUI_STALL_NS)) {
+        state = kill((pid_t)hdr->writer_pid, 0) != 0 && errno == ESRCH ? "writer exited"
+                                                                      : "feed stalled";
+    } else if (!t->seq) {
+        state = "waiting for the first tick";
+    }
+    for (int c = 0; c < t->cols; c++) tui_set(t, 0, c, ' ', TUI_INVERSE);
+    int c = tui_printf(t, 0, 1, TUI_INVERSE, "cpu100  %s  %u CPUs at %.0f Hz  %s", clock, n,
+                       1e9 / (double)hdr->interval_ns, state);
+    if (c + 10 <= t->cols) tui_printf(t, 0, t->cols - 8, TUI_INVERSE, "q: quit");
+    
+    // All CPUs, with as much history as fits
+    c = tui_printf(t, 1, 0, TUI_PLAIN, "all [");
+    tui_bar(t, 1, c, TUI_BAR, t->pct[n]);
+    c = tui_printf(t, 1, c + TUI_BAR, TUI_PLAIN, "] %3.0f%% ", t->pct[n]);
+    tui_spark(t, 1, c, t->cols - c, n);
+    
+    // CPUs side by side as the width allows, leaving room for a few processes
+    int cell = 3 + 2 + TUI_BAR + 7 + TUI_SPARK + 2;   // "%3d [", bar, "] %3.0f%% ", history, gap
+    int per_row = (t->cols + 2) / cell;
+    if (per_row < 1) per_row = 1;
+    uint32_t ntop = t->nprocs < hdr->topn ? t->nprocs : hdr->topn;
+    int cpu_rows = (int)((n + (uint32_t)per_row - 1) / (uint32_t)per_row);
+    int room = t->rows - 5 - (ntop < 3 ? (int)ntop : 3);
+    if (cpu_rows > room) cpu_rows = room > 1 ? room : 1;
+    uint32_t shown = (uint32_t)(cpu_rows * per_row) < n ? (uint32_t)(cpu_rows * per_row) : n;
+    for (uint32_t i = 0; i < shown; i++) {
+        int r = 3 + (int)(i / (uint32_t)per_row), c0 = (int)(i % (uint32_t)per_row) * cell;
+        if (shown < n && i == shown - 1) {
+            tui_printf(t, r, c0, TUI_PLAIN, "+%u more CPUs", n - i);
+            break;
+        }
+        c = tui_printf(t, r, c0, TUI_PLAIN, "%3d [", t->ids ? t->ids[i] : (int)i);
+        tui_bar(t, r, c, TUI_BAR, t->pct[i]);
+        c = tui_printf(t, r, c + TUI_BAR, TUI_PLAIN, "] %3.0f%% ", t->pct[i]);
+        tui_spark(t, r, c, TUI_SPARK, i);
+    }
+    
+    // Busiest processes, averaged over recent top lists
+    int r = 3 + cpu_rows + 1;
+    char age[48] = "";
+    if (s->top_tick != s->tick) {
+        snprintf(age, sizeof age, "  (%llu ticks old)", (unsigned long long)(s->tick - s->top_tick));
+    }
+    tui_printf(t, r++, 0, TUI_INVERSE, "%7s  %-20s %6s%s", "PID", "COMMAND", "CPU%", age);
+    for (uint32_t i = 0; i < ntop && r < t->rows; i++, r++) {
+        const shm_top *p = &t->procs[i];
+        tui_printf(t, r, 0, TUI_PLAIN, "%7d  %-20.20s %5.1f%%", p->pid, p->comm, p->pct);
+    }
+}
+
+/**
+ * Appends one cell to the output, setting its attribute first if needed
+ */
+static void tui_put_cell(tui_state *t, tui_cell cell) {
+    if (cell.attr != t->attr) {
+        size_t len = strlen(tui_sgr[cell.attr]);
+        memcpy(t->out + t->out_len, tui_sgr[cell.attr], len);
+        t->out_len += len;
+        t->attr = cell.attr;
+    }
+    for (uint32_t g = cell.glyph; g; g >>= 8) t->out[t->out_len++] = (char)(g & 0xff);
+}
+
+/**
+ * Writes the cells that differ from the terminal in one write()
+ */
+static void tui_flush(tui_state *t) {
+    t->out_len = 0;
+    int cr = -1, cc = -1;      // Cursor position, -1 when unknown
+    for (int r = 0; r < t->rows; r++) {
+        for (int c = 0; c < t->cols; c++) {
+            size_t i = (size_t)r * t->cols + c;
+            if (t->back[i].glyph == t->front[i].glyph && t->back[i].attr == t->front[i].attr) continue;
+            if (r == cr && c > cc && c - cc <= 4) {
+                // Rewriting a few unchanged cells is shorter than moving the cursor
+                for (; cc < c; cc++) tui_put_cell(t, t->back[(size_t)r * t->cols + cc]);
+            } else if (r != cr || c != cc) {
+                t->out_len += (size_t)sprintf(t->out + t->out_len, "\033[%d;%dH", r + 1, c + 1);
+            }
+            tui_put_cell(t, t->back[i]);
+            t->front[i] = t->back[i];
+            cr = r;
+            cc = c + 1;
+        }
+    }
+    if (!t->out_len) return;
+    if (t->attr != TUI_PLAIN) tui_put_cell(t, (tui_cell){ 0, TUI_PLAIN });
+    tui_write(t->out, t->out_len);
+    t->bytes += t->out_len;
+}
+
+/**
+ * Handles the keys waiting on stdin: q quits, r or Ctrl-L redraws
+ */
+static void tui_keys(tui_state *t) {
+    char keys[64];
+    ssize_t got = read(STDIN_FILENO, keys, sizeof keys);
+    for (ssize_t i = 0; i < got; i++) {
+        if (keys[i] == 'q' || keys[i] == 'Q') keep_running = 0;
+        else if (keys[i] == 'r' || keys[i] == '\f') tui_clear(t);
+    }
+}
+
+/**
+ * Switches the terminal to the dashboard
+ * @param t: State to initialize
+ * @param hdr: Feed to show
+ * Returns: 0, or -1 with a message printed
+ */
+static int tui_open(tui_state *t, const shm_header *hdr) {
+    if (!isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "--tui: standard output is not a terminal\n");
+        return -1;
+    }
+    *t = (tui_state){ .hdr = hdr, .seq_ns = mono_ns(), .utf8 = tui_utf8_locale() };
+    t->ids = load_cpu_ids(shm_cpu_ids(hdr), hdr->ncpu);
+    t->snap = malloc(hdr->snapshot_size);
+    t->next = malloc(hdr->snapshot_size);
+    t->prev = calloc(hdr->ncpu, sizeof *t->prev);
+    t->pct = calloc(hdr->ncpu + 1, sizeof *t->pct);
+    t->history = calloc((size_t)(hdr->ncpu + 1) * TUI_HISTORY, 1);
+    t->procs = calloc(2 * (size_t)hdr->topn, sizeof *t->procs);
+    
+    // Keys arrive one at a time without echo; Ctrl-C still raises SIGINT
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &t->saved) == 0) {
+        struct termios keys = t->saved;
+        keys.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+        keys.c_cc[VMIN] = 0;
+        keys.c_cc[VTIME] = 0;
+        t->raw = tcsetattr(STDIN_FILENO, TCSANOW, &keys) == 0;
+    }
+    tui_active = t;
+    atexit(tui_restore);
+    signal(SIGWINCH, on_sigwinch);
+    static const char enter[] = "\033[?1049h\033[?25l";   // Alternate screen, no cursor
+    tui_write(enter, sizeof enter - 1);
+    tui_resize(t);
+    return 0;
+}
+
+/**
+ * Draws frames until keep_running drops, from q, SIGINT or the sampler
+ */
+static void tui_run(tui_state *t) {
+    long long next = mono_ns();
+    while (keep_running) {
+        long long now = mono_ns();
+        if (now >= next) {
+            if (tui_resized) {
+                tui_resized = 0;
+                tui_resize(t);
+            }
+            tui_sample(t, now);
+            tui_draw(t, now);
+            tui_flush(t);
+            t->frames++;
+            next += TUI_FRAME_NS;
+            if (next <= now) next = now + TUI_FRAME_NS;   // Fell behind; drop frames
+            continue;
+        }
+        struct pollfd pfd = { t->raw ? STDIN_FILENO : -1, POLLIN, 0 };
+        if (poll(&pfd, 1, (int)((next - now + 999999) / 1000000)) > 0) {
+            if (pfd.revents & POLLIN) tui_keys(t);
+            else if (pfd.revents & (POLLHUP | POLLERR)) keep_running = 0;   // Terminal gone
+        }
+    }
+}
+
+static void *tui_thread(void *arg) {
+    tui_run(arg);
+    return NULL;
+}
+
+/**
+ * Restores the terminal and frees the dashboard
+ */
+static void tui_close(tui_state *t) {
+    tui_restore();
+    if (t->frames) {
+        fprintf(stderr, "tui: %ld frames, %.0f bytes written per frame\n", t->frames,
+                (double)t->bytes / (double)t->frames);
+    }
+    free(t->ids);
+    free(t->snap);
+    free(t->next);
+    free(t->prev);
+    free(t->pct);
+    free(t->history);
+    free(t->procs);
+    free(t->front);
+    free(t->back);
+    free(t->out);
+}
+
+/**
+ * Shows the feed of another cpu100 --shm on the dashboard
+ * @param name: Segment name
+ * Returns: Process exit status
+ */
+static int tui_main(const char *name) {
+    size_t size;
+    const shm_header *hdr = shm_open_reader(name, &size);
+    if (!hdr) return 1;
+    tui_state t;
+    if (tui_open(&t, hdr) != 0) {
+        munmap((void *)hdr, size);
+        return 1;
+    }
+    signal(SIGINT, on_sigint);
+    tui_run(&t);
+    tui_close(&t);
+    munmap((void *)hdr, size);
+    return 0;
+}
+
+/*
+ * Columnar long-term log (--record FILE, --query FILE)
+ * Ticks are buffered into blocks of LOG_BLOCK_TICKS and each block is
+ * written column by column: the tick timestamps, then a busy and a total
+ * column per CPU, then one column per process in the block's dictionary of
+ * (PID, comm) pairs giving its ticks on each tick it made the top list.
+ * Each column is stored as varints, runs or bit-packed values, of either
+ * the values or their zigzag deltas, whichever is smallest, so steady
+ * timing becomes delta-of-delta zeros and a stable top set a few bytes per
+ * process per block. Every block header carries
+ * its time range and size, and an index of block offsets is appended at
+ * exit, so a query reads only the blocks that overlap its window; without
+ * the index (a recorder that was killed) it walks the block headers.
+ */
+#define LOG_MAGIC "CPU100L1"
+#define LOG_INDEX_MAGIC "CPU100IX"
+#define LOG_BLOCK_MAGIC 0x314b4c42u    // "BLK1"
+#define LOG_BLOCK_TICKS 100
+#define LOG_TIME_UNIT_NS 1000000LL  // Timestamp resolution after the first tick
+
+typedef struct {
+    char magic[8];             // LOG_MAGIC
+    uint32_t version;          // Layout version, 1
+    uint32_t ncpu;             // CPU columns per block
+    uint32_t topn;             // Largest top list per tick
+    uint32_t reserved;
+    int64_t interval_ns;       // Sampling period
+    // Followed by uint32_t cpu[ncpu], the CPU number of each column, then
+    // the blocks
+} log_header;
+
+typedef struct {
+    uint32_t magic;            // LOG_BLOCK_MAGIC
+    uint32_t nticks;           // Ticks in the block
+    int64_t first_ns;          // CLOCK_REALTIME of the first tick
+    int64_t last_ns;           // CLOCK_REALTIME of the last tick
+    uint32_t size;             // Encoded bytes following this header
+    uint32_t ndict;            // Dictionary entries, encoded first in PID order
+} log_block;
+
+typedef struct {
+    uint64_t offset;           // File offset of the block header
+    int64_t first_ns, last_ns;
+} log_index_entry;
+
+typedef struct {
+    uint64_t index_offset;     // File offset of the log_index_entry array
+    uint64_t nblocks;
+    char magic[8];             // LOG_INDEX_MAGIC, last bytes of the file
+} log_footer;
+
+// Growable byte buffer for encoding
+typedef struct {
+    uint8_t *p;
+    size_t len, cap;
+} byte_buf;
+
+/**
+ * Appends an unsigned LEB128 varint
+ */
+static void put_uvarint(byte_buf *b, uint64_t v) {
+    if (b->len + 10 > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        b->p = realloc(b->p, b->cap);
+    }
+    while (v >= 0x80) {
+        b->p[b->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    b->p[b->len++] = (uint8_t)v;
+}
+
+/**
+ * Reads an unsigned varint
+ * @param pp: In/out read position
+ * @param end: End of the buffer
+ * @param v: Output value
+ * Returns: 0 on success, -1 if the buffer ends mid-varint
+ */
+static int get_uvarint(const uint8_t **pp, const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; *pp < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*pp)++;
+        x |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) { *v = x; return 0; }
+    }
+    return -1;
+}
+
+/**
+ * Appends a string as its length and bytes, without the NUL
+ */
+static void put_string(byte_buf *b, const char *s) {
+    size_t len = strlen(s);
+    put_uvarint(b, len);
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, s, len);
+    b->len += len;
+}
+
+/**
+ * Reads a string written by put_string
+ * @param pp: In/out read position
+ * @param end: End of the buffer
+ * @param out: Output, NUL terminated and cut to fit
+ * @param sz: Size of out
+ * Returns: 0 on success, -1 if the buffer ends mid-string
+ */
+static int get_string(const uint8_t **pp, const uint8_t *end, char *out, size_t sz) {
+    uint64_t len;
+    if (get_uvarint(pp, end, &len) != 0 || len > (uint64_t)(end - *pp)) return -1;
+    size_t keep = len < sz ? len : sz - 1;
+    memcpy(out, *pp, keep);
+    out[keep] = '\0';
+    *pp += len;
+    return 0;
+}
+
+// Zigzag maps signed values to unsigned so small magnitudes stay short
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static int64_t unzigzag(uint64_t u) { return (int64_t)(u >> 1) ^ -(int64_t)(u & 1); }
+
+static int uvarint_len(uint64_t v) {
+    int n = 1;
+    while (v >= 0x80) { v >>= 7; n++; }
+    return n;
+}
+
+static int bit_width(uint64_t v) { return v ? 64 - __builtin_clzll(v) : 0; }
+
+// Column layouts; the mode varint is layout * 2 + 1 if values are deltas
+enum { COL_PLAIN, COL_RUNS, COL_PACKED, COL_LAYOUTS };
+
+/**
+ * Bytes a column takes in a layout
+ * @param v: Values
+ * @param n: Number of values
+ * @param layout: COL_PLAIN, COL_RUNS or COL_PACKED
+ */
+static size_t column_cost(const uint64_t *v, size_t n, int layout) {
+    size_t cost = 0, i, j;
+    uint64_t all = 0;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && v[j] == v[i]; j++) {}
+        if (layout == COL_PLAIN) cost += (j - i) * uvarint_len(v[i]);
+        if (layout == COL_RUNS) cost += uvarint_len(v[i]) + uvarint_len(j - i - 1);
+        all |= v[i];
+    }
+    if (layout == COL_PACKED) cost = 1 + (n * bit_width(all) + 7) / 8;
+    return cost;
+}
+
+/**
+ * Appends a column in the layout that stores it in the fewest bytes, over
+ * either its values or their zigzag deltas: varints, (value, repeats) runs
+ * so a steady counter or a process that stays in the top list costs a few
+ * bytes per block, or every value packed in the bit width of the largest one, which
+ * is what jittery small values such as per-tick jiffies need
+ * @param b: Output buffer
+ * @param v: Values
+ * @param n: Number of values, at most LOG_BLOCK_TICKS
+ */
+static void put_column(byte_buf *b, const uint64_t *v, size_t n) {
+    uint64_t deltas[LOG_BLOCK_TICKS];
+    for (size_t i = 0; i < n; i++) deltas[i] = zigzag((int64_t)(v[i] - (i ? v[i - 1] : 0)));
+    
+    int best = 0;
+    size_t best_cost = SIZE_MAX;
+    for (int mode = 0; mode < COL_LAYOUTS * 2; mode++) {
+        size_t cost = column_cost(mode & 1 ? deltas : v, n, mode >> 1);
+        if (cost < best_cost) { best = mode; best_cost = cost; }
+    }
+    const uint64_t *src = best & 1 ? deltas : v;
+    int layout = best >> 1;
+    put_uvarint(b, (uint64_t)best);
+    if (b->len + best_cost > b->cap) {
+        b->cap = (b->len + best_cost) * 2;
+        b->p = realloc(b->p, b->cap);
+    }
+    
+    if (layout == COL_PACKED) {
+        uint64_t all = 0;
+        for (size_t i = 0; i < n; i++) all |= src[i];
+        int width = bit_width(all);
+        b->p[b->len++] = (uint8_t)width;
+        uint64_t acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t x = src[i];
+            for (int left = width; left > 0;) {
+                int take = left < 32 ? left : 32;
+                acc |= (x & ((1ULL << take) - 1)) << bits;
+                bits += take;
+                x >>= take;
+                left -= take;
+                for (; bits >= 8; bits -= 8, acc >>= 8) b->p[b->len++] = (uint8_t)acc;
+            }
+        }
+        if (bits) b->p[b->len++] = (uint8_t)acc;
+        return;
+    }
+    for (size_t i = 0, j; i < n; i = j) {
+        j = i + 1;
+        if (layout == COL_RUNS) while (j < n && src[j] == src[i]) j++;
+        put_uvarint(b, src[i]);
+        if (layout == COL_RUNS) put_uvarint(b, j - i - 1);
+    }
+}
+
+/**
+ * Reads a column written by put_column
+ * @param pp: In/out read position
+ * @param end: End of the buffer
+ * @param v: Output values
+ * @param n: Number of values
+ * Returns: 0 on success, -1 if the column is damaged
+ */
+static int get_column(const uint8_t **pp, const uint8_t *end, uint64_t *v, size_t n) {
+    uint64_t mode, x, repeats;
+    if (get_uvarint(pp, end, &mode) != 0 || mode >= COL_LAYOUTS * 2) return -1;
+    int layout = (int)(mode >> 1);
+    
+    if (layout == COL_PACKED) {
+        if (*pp >= end) return -1;
+        int width = *(*pp)++;
+        if (width > 64 || (n * width + 7) / 8 > (size_t)(end - *pp)) return -1;
+        uint64_t acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < n; i++) {
+            x = 0;
+            for (int got = 0; got < width;) {
+                if (bits == 0) { acc = *(*pp)++; bits = 8; }
+                int take = width - got < bits ? width - got : bits;
+                x |= (acc & ((1ULL << take) - 1)) << got;
+                acc >>= take;
+                bits -= take;
+                got += take;
+            }
+            v[i] = x;
+        }
+    } else {
+        for (size_t i = 0; i < n;) {
+            if (get_uvarint(pp, end, &x) != 0) return -1;
+            repeats = 0;
+            if (layout == COL_RUNS && (get_uvarint(pp, end, &repeats) != 0 || repeats >= n - i))
+                return -1;
+            for (uint64_t k = 0; k <= repeats; k++) v[i++] = x;
+        }
+    }
+    
+    if (mode & 1) {
+        for (size_t i = 0; i < n; i++) v[i] = (i ? v[i - 1] : 0) + (uint64_t)unzigzag(v[i]);
+    }
+    return 0;
+}
+
+// Writer state: the block being filled, in raw columns
+typedef struct {
+    int fd;
+    int ncpu;
+    int64_t realtime_offset;   // CLOCK_REALTIME - CLOCK_MONOTONIC, ns
+    uint64_t offset;           // File size so far
+    int n;                     // Ticks buffered
+    int64_t *times;            // CLOCK_REALTIME per tick
+    uint32_t *missed;
+    uint32_t *busy, *total;    // [cpu * LOG_BLOCK_TICKS + tick]
+    uint32_t *ntop;
+    uint32_t *window;          // Ticks the top list covers, 0 if not scanned
+    uint32_t *window_total;    // CPU ticks of that window when it spans ticks
+    uint32_t *top_ref;         // [tick * top_n + slot], dictionary index
+    uint32_t *top_ticks;
+    uint64_t *column;          // Values of the column being encoded
+    int *scan_pos;             // Position of each tick among the scanned ones
+    uint32_t *occ_tick;        // Top list appearances grouped by entry: tick
+    uint32_t *occ_ticks;       // and process ticks
+    pid_table dict_ids;        // PID -> latest dictionary index in this block
+    int *dict_pids;
+    char (*dict_comms)[64];
+    uint64_t *dict_order;      // PID << 32 | index, sorted when writing
+    uint32_t *occ_start;       // First appearance of each entry, ndict + 1
+    int ndict, dict_cap;
+    int *name_slots;           // Hash of the block's names, dictionary index + 1
+    uint32_t *name_ids;        // Name number of each occupied slot
+    size_t name_cap;
+    byte_buf enc;
+    log_index_entry *index;
+    uint64_t nindex, index_cap;
+    unsigned long long ticks_total;
+} log_writer;
+
+/**
+ * Creates a log file and writes its header
+ * @param lw: Writer to initialize
+ * @param path: File to create, truncated if it exists
+ * @param ncpu: CPUs per tick
+ * @param ids: CPU number of each column, or NULL if they are 0 to ncpu - 1
+ * @param interval_ns: Sampling period
+ */
+static void log_open(log_writer *lw, const char *path, int ncpu, const int *ids,
+                     long long interval_ns) {
+    memset(lw, 0, sizeof *lw);
+    lw->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (lw->fd == -1) { perror(path); exit(1); }
+    
+    size_t head_size = sizeof(log_header) + (size_t)ncpu * sizeof(uint32_t);
+    log_header *hdr = calloc(1, head_size);
+    *hdr = (log_header){ .version = 1, .ncpu = (uint32_t)ncpu, .topn = (uint32_t)top_n,
+                         .interval_ns = interval_ns };
+    memcpy(hdr->magic, LOG_MAGIC, 8);
+    uint32_t *cpu = (uint32_t *)(hdr + 1);
+    for (int i = 0; i < ncpu; i++) cpu[i] = (uint32_t)(ids ? ids[i] : i);
+    if (write(lw->fd, hdr, head_size) != (ssize_t)head_size) { perror(path); exit(1); }
+    free(hdr);
+    lw->offset = head_size;
+    
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    lw->realtime_offset = rt.tv_sec * 1000000000LL + rt.tv_nsec - mono_ns();
+    lw->ncpu = ncpu;
+    lw->times = malloc(LOG_BLOCK_TICKS * sizeof *lw->times);
+    lw->missed = malloc(LOG_BLOCK_TICKS * sizeof *lw->missed);
+    lw->busy = malloc((size_t)ncpu * LOG_BLOCK_TICKS * sizeof *lw->busy);
+    lw->total = malloc((size_t)ncpu * LOG_BLOCK_TICKS * sizeof *lw->total);
+    lw->ntop = malloc(LOG_BLOCK_TICKS * sizeof *lw->ntop);
+    lw->column = malloc(LOG_BLOCK_TICKS * sizeof *lw->column);
+    lw->window = malloc(LOG_BLOCK_TICKS * sizeof *lw->window);
+    lw->window_total = malloc(LOG_BLOCK_TICKS * sizeof *lw->window_total);
+    lw->top_ref = malloc((size_t)top_n * LOG_BLOCK_TICKS * sizeof *lw->top_ref);
+    lw->top_ticks = malloc((size_t)top_n * LOG_BLOCK_TICKS * sizeof *lw->top_ticks);
+    lw->scan_pos = malloc(LOG_BLOCK_TICKS * sizeof *lw->scan_pos);
+    lw->occ_tick = malloc((size_t)top_n * LOG_BLOCK_TICKS * sizeof *lw->occ_tick);
+    lw->occ_ticks = malloc((size_t)top_n * LOG_BLOCK_TICKS * sizeof *lw->occ_ticks);
+    pid_table_init(&lw->dict_ids, 8);
+}
+
+/**
+ * Finds or adds the dictionary entry of a process in the current block
+ * @param lw: Writer
+ * @param pid: Process ID
+ * @param comm: Current process name
+ * Returns: Dictionary index
+ */
+static uint32_t log_intern(log_writer *lw, int pid, const char *comm) {
+    int idx = pid_lookup(&lw->dict_ids, pid);
+    if (idx >= 0 && strcmp(lw->dict_comms[idx], comm) == 0) return (uint32_t)idx;
+    if (lw->ndict == lw->dict_cap) {
+        lw->dict_cap = lw->dict_cap ? lw->dict_cap * 2 : 64;
+        lw->dict_pids = realloc(lw->dict_pids, lw->dict_cap * sizeof *lw->dict_pids);
+        lw->dict_comms = realloc(lw->dict_comms, lw->dict_cap * sizeof *lw->dict_comms);
+        lw->dict_order = realloc(lw->dict_order, lw->dict_cap * sizeof *lw->dict_order);
+        lw->occ_start = realloc(lw->occ_start, (lw->dict_cap + 1) * sizeof *lw->occ_start);
+    }
+    idx = lw->ndict++;
+    lw->dict_pids[idx] = pid;
+    snprintf(lw->dict_comms[idx], sizeof lw->dict_comms[idx], "%s", comm);
+    pid_table_update(&lw->dict_ids, pid, idx);
+    return (uint32_t)idx;
+}
+
+/**
+ * Orders dictionary keys, PID first
+ */
+static int log_order_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Encodes and writes the buffered block, then starts a new one
+ * @param lw: Writer
+ */
+static void log_flush_block(log_writer *lw) {
+    if (lw->n == 0) return;
+    byte_buf *b = &lw->enc;
+    b->len = 0;
+    
+    // Dictionary in PID order, as PID deltas and names; each name is written
+    // once per block and referred to by its number after that
+    for (int i = 0; i < lw->ndict; i++) {
+        lw->dict_order[i] = (uint64_t)lw->dict_pids[i] << 32 | (uint32_t)i;
+    }
+    qsort(lw->dict_order, lw->ndict, sizeof *lw->dict_order, log_order_cmp);
+    size_t slots = 64;
+    while (slots < 2 * (size_t)lw->ndict) slots *= 2;
+    if (slots > lw->name_cap) {
+        lw->name_cap = slots;
+        lw->name_slots = realloc(lw->name_slots, slots * sizeof *lw->name_slots);
+        lw->name_ids = realloc(lw->name_ids, slots * sizeof *lw->name_ids);
+    }
+    memset(lw->name_slots, 0, slots * sizeof *lw->name_slots);
+    int prev_pid = 0, nnames = 0;
+    for (int o = 0; o < lw->ndict; o++) {
+        int i = (int)(uint32_t)lw->dict_order[o];
+        put_uvarint(b, zigzag((int64_t)lw->dict_pids[i] - prev_pid));
+        prev_pid = lw->dict_pids[i];
+        
+        uint32_t h = 2166136261u;  // FNV-1a
+        for (const char *c = lw->dict_comms[i]; *c; c++) h = (h ^ (uint8_t)*c) * 16777619u;
+        size_t k = h & (slots - 1);
+        while (lw->name_slots[k] && strcmp(lw->dict_comms[lw->name_slots[k] - 1], lw->dict_comms[i]))
+            k = (k + 1) & (slots - 1);
+        if (lw->name_slots[k]) {
+            put_uvarint(b, lw->name_ids[k]);
+            continue;
+        }
+        lw->name_slots[k] = i + 1;
+        lw->name_ids[k] = (uint32_t)nnames;
+        put_uvarint(b, (uint64_t)nnames++);   // The next number: a new name follows
+        put_string(b, lw->dict_comms[i]);
+    }
+    
+    // Timestamps: gaps in LOG_TIME_UNIT_NS, the first time is in the header
+    uint64_t *col = lw->column;
+    for (int t = 1; t < lw->n; t++) {
+        col[t - 1] = (uint64_t)(lw->times[t] / LOG_TIME_UNIT_NS - lw->times[t - 1] / LOG_TIME_UNIT_NS);
+    }
+    put_column(b, col, lw->n - 1);
+    for (int t = 0; t < lw->n; t++) col[t] = lw->missed[t];
+    put_column(b, col, lw->n);
+    
+    // One busy and one total column per CPU
+    for (int i = 0; i < lw->ncpu; i++) {
+        const uint32_t *raw[2] = { lw->busy + (size_t)i * LOG_BLOCK_TICKS,
+                                   lw->total + (size_t)i * LOG_BLOCK_TICKS };
+        for (int k = 0; k < 2; k++) {
+            for (int t = 0; t < lw->n; t++) col[t] = raw[k][t];
+            put_column(b, col, lw->n);
+        }
+    }
+    
+    // Scans: the ticks each top list covers, 0 when processes were not
+    // scanned, and their CPU ticks when that is more than one tick
+    int m = 0, scanned = 0;
+    for (int t = 0; t < lw->n; t++) col[t] = lw->window[t];
+    put_column(b, col, lw->n);
+    for (int t = 0; t < lw->n; t++) {
+        if (lw->window[t] > 1) col[m++] = lw->window_total[t];
+        lw->scan_pos[t] = lw->window[t] ? scanned++ : -1;
+    }
+    put_column(b, col, m);
+    
+    // Top lists: one column per dictionary entry over the scanned ticks,
+    // ticks + 1 where the process made the list and 0 where it did not, so
+    // a process that stays in the list is a run however the ranks shift.
+    // Appearances are first grouped by entry with a counting sort
+    memset(lw->occ_start, 0, (lw->ndict + 1) * sizeof *lw->occ_start);
+    for (int t = 0; t < lw->n; t++) {
+        for (uint32_t s = 0; s < lw->ntop[t]; s++) lw->occ_start[lw->top_ref[t * top_n + s] + 1]++;
+    }
+    for (int i = 0; i < lw->ndict; i++) lw->occ_start[i + 1] += lw->occ_start[i];
+    for (int t = 0; t < lw->n; t++) {
+        for (uint32_t s = 0; s < lw->ntop[t]; s++) {
+            uint32_t at = lw->occ_start[lw->top_ref[t * top_n + s]]++;
+            lw->occ_tick[at] = (uint32_t)t;
+            lw->occ_ticks[at] = lw->top_ticks[t * top_n + s];
+        }
+    }
+    // occ_start[i] now ends entry i, which is where entry i + 1 starts
+    for (int o = 0; o < lw->ndict; o++) {
+        int i = (int)(uint32_t)lw->dict_order[o];
+        memset(col, 0, scanned * sizeof *col);
+        for (uint32_t at = i ? lw->occ_start[i - 1] : 0; at < lw->occ_start[i]; at++) {
+            col[lw->scan_pos[lw->occ_tick[at]]] = (uint64_t)lw->occ_ticks[at] + 1;
+        }
+        put_column(b, col, scanned);
+    }
+    
+    log_block blk = { .magic = LOG_BLOCK_MAGIC, .nticks = (uint32_t)lw->n,
+                      .first_ns = lw->times[0], .last_ns = lw->times[lw->n - 1],
+                      .size = (uint32_t)b->len, .ndict = (uint32_t)lw->ndict };
+    struct iovec iov[2] = { { &blk, sizeof blk }, { b->p, b->len } };
+    ssize_t want = (ssize_t)(sizeof blk + b->len);
+    if (writev(lw->fd, iov, 2) != want) { perror("record"); exit(1); }
+    
+    if (lw->nindex == lw->index_cap) {
+        lw->index_cap = lw->index_cap ? lw->index_cap * 2 : 256;
+        lw->index = realloc(lw->index, lw->index_cap * sizeof *lw->index);
+    }
+    lw->index[lw->nindex++] = (log_index_entry){ lw->offset, blk.first_ns, blk.last_ns };
+    lw->offset += (uint64_t)want;
+    
+    lw->n = 0;
+    lw->ndict = 0;
+    pid_table_clear(&lw->dict_ids);
+}
+
+/**
+ * Buffers one tick, writing the block out when it is full
+ * @param lw: Writer
+ * @param mono: CLOCK_MONOTONIC at sampling time, ns
+ * @param missed: Ticks skipped before this one
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param arr: Top processes, sorted
+ * @param ntop: Entries in arr
+ * @param window: Ticks the top list covers, 0 if processes were not scanned
+ * @param window_total: CPU ticks of all CPUs over those ticks
+ */
+static void log_write_tick(log_writer *lw, long long mono, long missed,
+                           const cpu_sample *curc, const cpu_sample *prevc,
+                           const proc_usage *arr, int ntop,
+                           long window, unsigned long long window_total) {
+    int t = lw->n++;
+    lw->times[t] = mono + lw->realtime_offset;
+    lw->missed[t] = (uint32_t)missed;
+    for (int i = 0; i < lw->ncpu; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        unsigned long long di = curc[i].idle - prevc[i].idle;
+        lw->busy[(size_t)i * LOG_BLOCK_TICKS + t] = bin_u32(dt - di);
+        lw->total[(size_t)i * LOG_BLOCK_TICKS + t] = bin_u32(dt);
+    }
+    lw->window[t] = (uint32_t)window;
+    lw->window_total[t] = bin_u32(window_total);
+    lw->ntop[t] = (uint32_t)ntop;
+    for (int s = 0; s < ntop; s++) {
+        lw->top_ref[t * top_n + s] = log_intern(lw, arr[s].pid, arr[s].comm);
+        lw->top_ticks[t * top_n + s] = bin_u32(arr[s].ticks);
+    }
+    lw->ticks_total++;
+    if (lw->n == LOG_BLOCK_TICKS) log_flush_block(lw);
+}
+
+/**
+ * Writes the last block and the index, then closes the log
+ * @param lw: Writer
+ */
+static void log_close(log_writer *lw) {
+    log_flush_block(lw);
+    log_footer footer = { .index_offset = lw->offset, .nblocks = lw->nindex };
+    memcpy(footer.magic, LOG_INDEX_MAGIC, 8);
+    size_t index_size = lw->nindex * sizeof *lw->index;
+    if ((index_size && write(lw->fd, lw->index, index_size) != (ssize_t)index_size) ||
+        write(lw->fd, &footer, sizeof footer) != (ssize_t)sizeof footer) {
+        perror("record");
+    }
+    lw->offset += index_size + sizeof footer;
+    close(lw->fd);
+    fprintf(stderr, "record: %llu ticks in %llu blocks, %llu bytes (%.1f bytes per tick)\n",
+            lw->ticks_total, (unsigned long long)lw->nindex, (unsigned long long)lw->offset,
+            lw->ticks_total ? (double)lw->offset / lw->ticks_total : 0.0);
+    free(lw->times);
+    free(lw->missed);
+    free(lw->busy);
+    free(lw->total);
+    free(lw->ntop);
+    free(lw->column);
+    free(lw->window);
+    free(lw->window_total);
+    free(lw->top_ref);
+    free(lw->top_ticks);
+    free(lw->scan_pos);
+    free(lw->occ_tick);
+    free(lw->occ_ticks);
+    free(lw->dict_order);
+    free(lw->occ_start);
+    free(lw->dict_ids.slots);
+    free(lw->dict_pids);
+    free(lw->dict_comms);
+    free(lw->name_slots);
+    free(lw->name_ids);
+    free(lw->enc.p);
+    free(lw->index);
+}
+
+/**
+ * Parses a --from or --to time
+ * Accepts @EPOCH_SECONDS, +SECONDS from the start of the log,
+ * YYYY-MM-DD HH:MM:SS (or with a T), or HH:MM[:SS] on the day the log
+ * starts, moved to the next day if that is before the start
+ * @param s: Text to parse
+ * @param start_ns: CLOCK_REALTIME of the first tick in the log
+ * @param out: Output time, CLOCK_REALTIME ns
+ * Returns: 0 on success, -1 if s is not a time
+ */
+static int log_parse_time(const char *s, int64_t start_ns, int64_t *out) {
+    char *end;
+    if (s[0] == '@' || s[0] == '+') {
+        double sec = strtod(s + 1, &end);
+        if (end == s + 1 || *end) return -1;
+        *out = (int64_t)(sec * 1e9) + (s[0] == '+' ? start_ns : 0);
+        return 0;
+    }
+    
+    // Fields a format leaves out come from the start of the log
+    static const char *const formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%H:%M:%S", "%H:%M"
+    };
+    struct tm start, tm;
+    time_t start_sec = (time_t)(start_ns / 1000000000LL);
+    localtime_r(&start_sec, &start);
+    start.tm_sec = 0;
+    size_t f = 0;
+    for (; f < sizeof formats / sizeof formats[0]; f++) {
+        tm = start;   // strptime leaves a failed attempt's fields behind
+        if ((end = strptime(s, formats[f], &tm)) && !*end) break;
+    }
+    if (f == sizeof formats / sizeof formats[0]) return -1;
+    int day_relative = f >= 2;
+    tm.tm_isdst = -1;
+    int64_t t = (int64_t)mktime(&tm) * 1000000000LL;
+    // A clock time before the start means the next day's
+    if (day_relative && t + 1000000000LL <= start_ns) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        t = (int64_t)mktime(&tm) * 1000000000LL;
+    }
+    *out = t;
+    return 0;
+}
+
+/**
+ * Lists the blocks of a log from its index, or by walking the block
+ * headers when the index is missing or damaged
+ * @param base: Mapped file
+ * @param size: File size
+ * @param head_size: Bytes of the header and CPU numbers before the first block
+ * @param nblocks: Output number of blocks
+ * Returns: Block array to free, in file order
+ */
+static log_index_entry *log_load_index(const uint8_t *base, size_t size, size_t head_size,
+                                       uint64_t *nblocks) {
+    if (size >= head_size + sizeof(log_footer)) {
+        log_footer footer;
+        memcpy(&footer, base + size - sizeof footer, sizeof footer);
+        uint64_t index_size = footer.nblocks * sizeof(log_index_entry);
+        if (memcmp(footer.magic, LOG_INDEX_MAGIC, 8) == 0 &&
+            footer.nblocks <= size / sizeof(log_index_entry) &&
+            footer.index_offset + index_size + sizeof footer == size) {
+            log_index_entry *index = malloc(index_size ? index_size : 1);
+            memcpy(index, base + footer.index_offset, index_size);
+            *nblocks = footer.nblocks;
+            return index;
+        }
+    }
+    
+    fprintf(stderr, "query: no index, scanning block headers\n");
+    uint64_t n = 0, cap = 256;
+    log_index_entry *index = malloc(cap * sizeof *index);
+    size_t off = head_size;
+    while (off + sizeof(log_block) <= size) {
+        log_block blk;
+        memcpy(&blk, base + off, sizeof blk);
+        if (blk.magic != LOG_BLOCK_MAGIC || blk.size > size - off - sizeof blk) break;
+        if (n == cap) {
+            cap *= 2;
+            index = realloc(index, cap * sizeof *index);
+        }
+        index[n++] = (log_index_entry){ off, blk.first_ns, blk.last_ns };
+        off += sizeof blk + blk.size;
+    }
+    *nblocks = n;
+    return index;
+}
+
+// Decoded columns of one block
+typedef struct {
+    int64_t times[LOG_BLOCK_TICKS];
+    uint32_t missed[LOG_BLOCK_TICKS];
+    uint32_t window[LOG_BLOCK_TICKS];
+    uint64_t window_total[LOG_BLOCK_TICKS];
+    uint32_t ntop[LOG_BLOCK_TICKS];
+    uint32_t *busy, *total;                // [cpu * LOG_BLOCK_TICKS + tick]
+    uint32_t *refs, *ticks;                // [tick * topn + slot]
+    int *dict_pids;
+    char (*dict_comms)[64];
+    uint32_t *names;                       // Dictionary index of each distinct name
+} log_columns;
+
+/**
+ * Decodes the dictionary of a block
+ * @param lc: Output columns
+ * @param blk: Block header
+ * @param pp: In/out read position, at the start of the block payload
+ * @param end: End of the block payload
+ * Returns: 0 on success, -1 if the block is damaged
+ */
+static int log_decode_dict(log_columns *lc, const log_block *blk,
+                           const uint8_t **pp, const uint8_t *end) {
+    int64_t pid = 0;
+    uint32_t nnames = 0;
+    for (uint32_t i = 0; i < blk->ndict; i++) {
+        uint64_t d, name;
+        if (get_uvarint(pp, end, &d) != 0 || get_uvarint(pp, end, &name) != 0 || name > nnames)
+            return -1;
+        pid += unzigzag(d);
+        lc->dict_pids[i] = (int)pid;
+        if (name < nnames) {
+            memcpy(lc->dict_comms[i], lc->dict_comms[lc->names[name]], sizeof lc->dict_comms[i]);
+            continue;
+        }
+        lc->names[nnames++] = i;
+        if (get_string(pp, end, lc->dict_comms[i], sizeof lc->dict_comms[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decodes the tick columns of a block, after its dictionary
+ * @param lc: Output columns, with buffers for ncpu CPUs and topn entries
+ * @param blk: Block header
+ * @param ncpu: CPU columns
+ * @param topn: Largest top list per tick
+ * @param p: Read position after the dictionary
+ * @param end: End of the block payload
+ * Returns: 0 on success, -1 if the block is damaged
+ */
+static int log_decode_ticks(log_columns *lc, const log_block *blk, uint32_t ncpu, uint32_t topn,
+                            const uint8_t *p, const uint8_t *end) {
+    uint32_t n = blk->nticks;
+    uint64_t col[LOG_BLOCK_TICKS];
+    
+    int64_t now = blk->first_ns / LOG_TIME_UNIT_NS;
+    if (get_column(&p, end, col, n - 1) != 0) return -1;
+    lc->times[0] = blk->first_ns;
+    for (uint32_t t = 1; t < n; t++) {
+        now += (int64_t)col[t - 1];
+        lc->times[t] = now * LOG_TIME_UNIT_NS;
+    }
+    if (get_column(&p, end, col, n) != 0) return -1;
+    for (uint32_t t = 0; t < n; t++) lc->missed[t] = (uint32_t)col[t];
+    
+    for (uint32_t i = 0; i < ncpu; i++) {
+        uint32_t *raw[2] = { lc->busy + (size_t)i * LOG_BLOCK_TICKS,
+                             lc->total + (size_t)i * LOG_BLOCK_TICKS };
+        for (int k = 0; k < 2; k++) {
+            if (get_column(&p, end, col, n) != 0) return -1;
+            for (uint32_t t = 0; t < n; t++) raw[k][t] = (uint32_t)col[t];
+        }
+    }
+    
+    uint32_t m = 0, scanned = 0, scan_tick[LOG_BLOCK_TICKS];
+    if (get_column(&p, end, col, n) != 0) return -1;
+    for (uint32_t t = 0; t < n; t++) {
+        lc->window[t] = (uint32_t)col[t];
+        if (col[t] > 1) m++;
+        if (col[t]) scan_tick[scanned++] = t;
+    }
+    if (get_column(&p, end, col, m) != 0) return -1;
+    m = 0;
+    for (uint32_t t = 0; t < n; t++) {
+        lc->window_total[t] = 0;
+        if (lc->window[t] > 1) {
+            lc->window_total[t] = col[m++];
+        } else {
+            for (uint32_t i = 0; i < ncpu; i++) {
+                lc->window_total[t] += lc->total[(size_t)i * LOG_BLOCK_TICKS + t];
+            }
+        }
+    }
+    
+    // Entry columns, in PID order; a stable insertion by ticks then puts
+    // each list in rank order with ties by PID
+    memset(lc->ntop, 0, sizeof lc->ntop);
+    for (uint32_t e = 0; e < blk->ndict; e++) {
+        if (get_column(&p, end, col, scanned) != 0) return -1;
+        for (uint32_t k = 0; k < scanned; k++) {
+            if (!col[k]) continue;
+            uint32_t t = scan_tick[k], ticks = (uint32_t)(col[k] - 1);
+            if (lc->ntop[t] == topn) return -1;
+            uint32_t *refs = lc->refs + t * topn, *tk = lc->ticks + t * topn;
+            uint32_t j = lc->ntop[t]++;
+            for (; j > 0 && tk[j - 1] < ticks; j--) {
+                refs[j] = refs[j - 1];
+                tk[j] = tk[j - 1];
+            }
+            refs[j] = e;
+            tk[j] = ticks;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints the ticks of a --record log in a time range in the text format
+ * Only the blocks overlapping the range are read, and with a PID only
+ * the blocks whose dictionary holds it are decoded
+ * @param path: Log file
+ * @param from: Start of the range, see log_parse_time, or NULL
+ * @param to: End of the range, or NULL
+ * @param pid: Process to report, or 0 for all
+ * Returns: Process exit status
+ */
+static int log_query(const char *path, const char *from, const char *to, int pid) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { perror(path); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror(path); close(fd); return 1; }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(log_header)) {
+        fprintf(stderr, "%s: not a cpu100 log\n", path);
+        close(fd);
+        return 1;
+    }
+    const uint8_t *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { perror("mmap"); return 1; }
+    
+    log_header hdr;
+    memcpy(&hdr, base, sizeof hdr);
+    size_t head_size = sizeof hdr + (size_t)hdr.ncpu * sizeof(uint32_t);
+    int *ids = NULL;
+    if (memcmp(hdr.magic, LOG_MAGIC, 8) != 0 || hdr.version != 1 ||
+        hdr.ncpu < 1 || hdr.ncpu > 65536 || hdr.topn < 1 || hdr.topn > 1000 ||
+        head_size > size || !(ids = load_cpu_ids(base + sizeof hdr, hdr.ncpu))) {
+        fprintf(stderr, "%s: not a cpu100 log\n", path);
+        munmap((void *)base, size);
+        return 1;
+    }
+    
+    uint64_t nblocks;
+    log_index_entry *index = log_load_index(base, size, head_size, &nblocks);
+    int64_t lo = INT64_MIN, hi = INT64_MAX;
+    int64_t start_ns = nblocks ? index[0].first_ns : 0;
+    const char *bad = from && log_parse_time(from, start_ns, &lo) != 0 ? from
+                    : to && log_parse_time(to, start_ns, &hi) != 0 ? to : NULL;
+    if (bad) {
+        fprintf(stderr, "--from/--to: expected @EPOCH, +SECONDS or "
+                "[YYYY-MM-DD ]HH:MM[:SS], got '%s'\n", bad);
+        free(index);
+        free(ids);
+        munmap((void *)base, size);
+        return 1;
+    }
+    
+    // First block that ends at or after the start of the range
+    uint64_t b = 0, e = nblocks;
+    while (b < e) {
+        uint64_t mid = b + (e - b) / 2;
+        if (index[mid].last_ns < lo) b = mid + 1;
+        else e = mid;
+    }
+    
+    log_columns lc;
+    lc.busy = malloc((size_t)hdr.ncpu * LOG_BLOCK_TICKS * sizeof *lc.busy);
+    lc.total = malloc((size_t)hdr.ncpu * LOG_BLOCK_TICKS * sizeof *lc.total);
+    lc.refs = malloc((size_t)hdr.topn * LOG_BLOCK_TICKS * sizeof *lc.refs);
+    lc.ticks = malloc((size_t)hdr.topn * LOG_BLOCK_TICKS * sizeof *lc.ticks);
+    lc.dict_pids = malloc((size_t)hdr.topn * LOG_BLOCK_TICKS * sizeof *lc.dict_pids);
+    lc.dict_comms = malloc((size_t)hdr.topn * LOG_BLOCK_TICKS * sizeof *lc.dict_comms);
+    lc.names = malloc((size_t)hdr.topn * LOG_BLOCK_TICKS * sizeof *lc.names);
+    
+    print_header(stdout, (int)hdr.ncpu, ids);
+    uint64_t read_blocks = 0;
+    for (; b < nblocks && index[b].first_ns <= hi; b++) {
+        log_block blk;
+        if (index[b].offset + sizeof blk > size) break;
+        memcpy(&blk, base + index[b].offset, sizeof blk);
+        const uint8_t *p = base + index[b].offset + sizeof blk, *end = p + blk.size;
+        if (blk.magic != LOG_BLOCK_MAGIC || blk.size > size - index[b].offset - sizeof blk ||
+            blk.nticks < 1 || blk.nticks > LOG_BLOCK_TICKS ||
+            blk.ndict > hdr.topn * LOG_BLOCK_TICKS || log_decode_dict(&lc, &blk, &p, end) != 0) {
+            fprintf(stderr, "%s: damaged block at offset %llu\n", path,
+                    (unsigned long long)index[b].offset);
+            continue;
+        }
+        
+        // Skip blocks the process never made the top list in
+        if (pid) {
+            uint32_t i = 0;
+            while (i < blk.ndict && lc.dict_pids[i] != pid) i++;
+            if (i == blk.ndict) continue;
+        }
+        if (log_decode_ticks(&lc, &blk, hdr.ncpu, hdr.topn, p, end) != 0) {
+            fprintf(stderr, "%s: damaged block at offset %llu\n", path,
+                    (unsigned long long)index[b].offset);
+            continue;
+        }
+        read_blocks++;
+        
+        for (uint32_t t = 0; t < blk.nticks; t++) {
+            if (lc.times[t] < lo || lc.times[t] > hi) continue;
+            const uint32_t *refs = lc.refs + t * hdr.topn, *ticks = lc.ticks + t * hdr.topn;
+            if (pid) {
+                uint32_t s = 0;
+                while (s < lc.ntop[t] && lc.dict_pids[refs[s]] != pid) s++;
+                if (s == lc.ntop[t]) continue;
+            }
+            
+            if (lc.missed[t]) printf("# missed %u ticks\n", lc.missed[t]);
+            struct timespec ts = { lc.times[t] / 1000000000LL, lc.times[t] % 1000000000LL };
+            char tbuf[32];
+            format_centis(&ts, tbuf, sizeof tbuf);
+            printf("%s", tbuf);
+            for (uint32_t i = 0; i < hdr.ncpu; i++) {
+                uint32_t busy = lc.busy[(size_t)i * LOG_BLOCK_TICKS + t];
+                uint32_t total = lc.total[(size_t)i * LOG_BLOCK_TICKS + t];
+                printf("\t%2.0f%%", total ? 100.0 * busy / (double)total : 0.0);
+            }
+            putchar('\n');
+            if (lc.window[t] > 1) print_window(stdout, lc.window[t] * hdr.interval_ns);
+            for (uint32_t s = 0; s < lc.ntop[t]; s++) {
+                if (pid && lc.dict_pids[refs[s]] != pid) continue;
+                double pct = lc.window_total[t] ? 100.0 * ticks[s] / (double)lc.window_total[t] : 0.0;
+                printf("    pid=%d %-20s %.1f%%\n", lc.dict_pids[refs[s]],
+                       lc.dict_comms[refs[s]], pct);
+            }
+        }
+    }
+    fprintf(stderr, "query: decoded %llu of %llu blocks\n",
+            (unsigned long long)read_blocks, (unsigned long long)nblocks);
+    
+    free(lc.busy);
+    free(lc.total);
+    free(lc.refs);
+    free(lc.ticks);
+    free(lc.dict_pids);
+    free(lc.dict_comms);
+    free(lc.names);
+    free(index);
+    free(ids);
+    munmap((void *)base, size);
+    return 0;
+}
+
+/*
+ * Multi-host streaming (--agent HOST:PORT, --collect [HOST]:PORT)
+ * The agent encodes every tick into one datagram of varints: a header with
+ * its host name, tick number and a CLOCK_MONOTONIC/CLOCK_REALTIME pair
+ * read back to back, the CPU columns with their CPU numbers (offline CPUs
+ * have no column), then as many top entries as fit an
+ * unfragmented frame. Datagrams are queued and handed to the kernel with
+ * one sendmmsg every AGENT_FLUSH_NS, never blocking the sampler; what the
+ * socket refuses is counted and dropped.
+ *
+ * The collector places each host's ticks on its own clock rather than
+ * trusting the hosts' wall clocks. For every host it keeps the smallest
+ * (kernel receive time - agent monotonic time) seen recently: that is the
+ * offset between the two clocks plus the least network delay, and unlike
+ * the agent's CLOCK_REALTIME it never steps. Aligned ticks are folded into
+ * time slots of the collector's --hz, and a slot is printed once every live
+ * host has moved past it, or COLLECT_DELAY_NS after it ended.
+ */
+#define AGENT_MAGIC "CPU100U1"
+#define AGENT_BATCH 32                      // Datagrams per sendmmsg at most
+#define AGENT_FLUSH_NS 100000000LL          // Longest a tick waits for its batch
+#define AGENT_MTU 1472                      // UDP payload of a 1500-byte frame
+#define AGENT_PACKET_MAX 65536              // Largest datagram the collector takes
+#define COLLECT_MAX_HOSTS 256
+#define COLLECT_BATCH 64                    // Datagrams per recvmmsg
+#define COLLECT_DELAY_NS 500000000LL        // How long a slot waits for slow hosts
+#define COLLECT_LIVE_NS 2000000000LL        // Hosts silent this long are not waited for
+#define COLLECT_OFFSET_SPAN_NS 30000000000LL // Clock offsets are re-estimated over this
+
+// Agent state
+typedef struct {
+    int fd;                                 // Connected UDP socket
+    char name[64];                          // Host name sent with every tick
+    uint64_t session;                       // Tells the collector about restarts
+    uint64_t seq;                           // Ticks encoded so far
+    byte_buf pkt[AGENT_BATCH];              // Queued datagrams
+    struct iovec iov[AGENT_BATCH];
+    struct mmsghdr msgs[AGENT_BATCH];
+    int n;                                  // Datagrams queued
+    long long first_ns;                     // When the oldest queued tick was taken
+    unsigned long long calls, dropped, trimmed;
+} agent_state;
+
+// Header fields of a received tick
+typedef struct {
+    uint64_t session, seq;
+    int64_t mono_ns, realtime_ns, interval_ns;
+    uint64_t missed;
+    char name[64];
+    uint32_t ncpu;
+    const uint8_t *p, *end;                 // CPU columns and top entries follow
+} agent_msg;
+
+typedef struct {
+    char name[64];
+    uint64_t session;
+    uint64_t next_seq;                      // Tick number expected next
+    uint32_t ncpu;
+    long long last_recv_ns;                 // Collector CLOCK_REALTIME of the last tick
+    int64_t offset;                         // Collector clock - agent monotonic clock
+    int64_t offset_cur, offset_prev;        // Minimums of this and the previous span
+    long long span_end_ns;
+    int64_t skew;                           // Agent wall clock - aligned time, last tick
+    int64_t latest;                         // Latest slot the host reported into
+    unsigned long long ticks, lost, late;
+} collect_host;
+
+typedef struct {
+    int host;
+    int pid;
+    char comm[64];
+    double share_ns;                        // Share of the host's CPUs times ns sampled
+    double cpu_ns;                          // CPUs' worth times ns sampled, the rank
+} collect_top;
+
+// Cluster view of one time slot
+typedef struct {
+    uint64_t hosts[COLLECT_MAX_HOSTS / 64]; // Hosts that reported into the slot
+    int nhosts;
+    double max;                             // Busiest CPU of any host
+    int max_host, max_cpu;                  // -1 until a CPU reported
+    unsigned long long busy, total;         // All CPUs of all hosts
+    double sampled_ns[COLLECT_MAX_HOSTS];   // Time each host's top lists covered
+    int ntop;
+    collect_top *top;                       // top_n entries, busiest first
+} collect_slot;
+
+typedef struct {
+    int fd;
+    long long interval_ns;                  // Slot width
+    collect_host *hosts;
+    int nhosts;
+    collect_slot *slots;
+    int64_t nslots;                         // Power of two
+    int64_t head;                           // Oldest slot not printed yet, -1 before any tick
+    int64_t newest;
+    unsigned long long bad, unknown;        // Damaged datagrams, hosts beyond the table
+} collect_state;
+
+/**
+ * Connects the agent's UDP socket
+ * @param as: Agent to initialize
+ * @param addr: Collector HOST:PORT
+ * @param name: Name to report under, NULL for the host name
+ * Returns: 0 on success, -1 with a message printed
+ */
+static int agent_open(agent_state *as, const char *addr, const char *name) {
+    memset(as, 0, sizeof *as);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *res;
+    if (resolve_host_port("--agent", addr, &hints, &res) != 0) return -1;
+    as->fd = -1;
+    for (struct addrinfo *ai = res; ai && as->fd == -1; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) as->fd = fd;
+        else close(fd);
+    }
+    freeaddrinfo(res);
+    if (as->fd == -1) { perror(addr); return -1; }
+    
+    if (name) snprintf(as->name, sizeof as->name, "%s", name);
+    else if (gethostname(as->name, sizeof as->name) != 0) strcpy(as->name, "localhost");
+    as->name[sizeof as->name - 1] = '\0';
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    as->session = (uint64_t)getpid() << 32 ^ (uint64_t)rt.tv_sec << 8 ^ (uint64_t)rt.tv_nsec;
+    for (int i = 0; i < AGENT_BATCH; i++) {
+        as->pkt[i].cap = 2 * AGENT_MTU;
+        as->pkt[i].p = malloc(as->pkt[i].cap);
+        as->msgs[i].msg_hdr.msg_iov = &as->iov[i];
+        as->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+/**
+ * Hands the queued datagrams to the kernel
+ * Never waits: datagrams the socket buffer cannot take are dropped
+ * @param as: Agent
+ */
+static void agent_flush(agent_state *as) {
+    int done = 0, refused = 0;
+    while (done < as->n) {
+        int sent = sendmmsg(as->fd, as->msgs + done, (unsigned)(as->n - done), MSG_DONTWAIT);
+        as->calls++;
+        if (sent > 0) { done += sent; continue; }
+        if (sent < 0 && errno == EINTR) continue;
+        // A connected socket reports an earlier ICMP error once, on the next send
+        if (sent < 0 && errno == ECONNREFUSED && !refused++) continue;
+        break;
+    }
+    as->dropped += (unsigned long long)(as->n - done);
+    as->n = 0;
+}
+
+/**
+ * Encodes one tick and sends the batch when it is due
+ * @param as: Agent
+ * @param missed: Ticks skipped before this one
+ * @param curc: Current CPU samples
+ * @param prevc: Previous CPU samples
+ * @param ncpu: Number of CPUs
+ * @param ids: CPU number of each column, or NULL if they are 0 to ncpu - 1
+ * @param arr: Top processes, sorted
+ * @param ntop: Entries in arr, 0 on ticks without a process scan
+ * @param window: Ticks the top list covers, 0 if it was not sampled
+ * @param interval_ns: Current sampling period
+ */
+static void agent_tick(agent_state *as, long missed, const cpu_sample *curc,
+                       const cpu_sample *prevc, int ncpu, const int *ids,
+                       const proc_usage *arr, int ntop, long window, long long interval_ns) {
+    long long mono = mono_ns();
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    if (as->n == 0) as->first_ns = mono;
+    
+    byte_buf *b = &as->pkt[as->n];
+    memcpy(b->p, AGENT_MAGIC, 8);
+    b->len = 8;
+    put_uvarint(b, 1);   // Version
+    put_uvarint(b, as->session);
+    put_uvarint(b, as->seq++);
+    put_uvarint(b, (uint64_t)mono);
+    put_uvarint(b, (uint64_t)(rt.tv_sec * 1000000000LL + rt.tv_nsec));
+    put_uvarint(b, (uint64_t)interval_ns);
+    put_uvarint(b, (uint64_t)missed);
+    put_string(b, as->name);
+    put_uvarint(b, (uint64_t)ncpu);
+    for (int i = 0; i < ncpu; i++) {
+        unsigned long long dt = curc[i].total - prevc[i].total;
+        put_uvarint(b, (uint64_t)(ids ? ids[i] : i));
+        put_uvarint(b, dt - (curc[i].idle - prevc[i].idle));
+        put_uvarint(b, dt);
+    }
+    put_uvarint(b, (uint64_t)window);
+    // Top entries run to the end of the datagram; the tail that would make
+    // it fragment is left out
+    for (int i = 0; i < ntop; i++) {
+        size_t mark = b->len;
+        put_uvarint(b, (uint64_t)arr[i].pid);
+        put_uvarint(b, (uint64_t)(arr[i].pct * 100 + 0.5));
+        put_string(b, arr[i].comm);
+        if (b->len > AGENT_MTU && i > 0) {
+            b->len = mark;
+            as->trimmed++;
+            break;
+        }
+    }
+    as->iov[as->n] = (struct iovec){ b->p, b->len };
+    as->n++;
+    
+    // Send now if the next tick would make the oldest one wait too long
+    if (as->n == AGENT_BATCH || mono + interval_ns - as->first_ns >= AGENT_FLUSH_NS) {
+        agent_flush(as);
+    }
+}
+
+/**
+ * Sends what is queued and closes the socket
+ * @param as: Agent
+ */
+static void agent_close(agent_state *as) {
+    agent_flush(as);
+    close(as->fd);
+    for (int i = 0; i < AGENT_BATCH; i++) free(as->pkt[i].p);
+    fprintf(stderr, "agent: %llu ticks in %llu sendmmsg calls, %llu dropped, %llu trimmed\n",
+            (unsigned long long)as->seq, as->calls, as->dropped, as->trimmed);
+}
+
+/**
+ * Decodes the header of a received tick
+ * @param buf: Datagram
+ * @param len: Datagram length
+ * @param m: Output header, pointing at the CPU columns
+ * Returns: 0 on success, -1 if it is not an agent datagram
+ */
+static int agent_parse(const uint8_t *buf, size_t len, agent_msg *m) {
+    if (len < 8 || memcmp(buf, AGENT_MAGIC, 8) != 0) return -1;
+    const uint8_t *p = buf + 8, *end = buf + len;
+    uint64_t version, mono, realtime, interval, ncpu;
+    if (get_uvarint(&p, end, &version) != 0 || version != 1 ||
+        get_uvarint(&p, end, &m->session) != 0 || get_uvarint(&p, end, &m->seq) != 0 ||
+        get_uvarint(&p, end, &mono) != 0 || get_uvarint(&p, end, &realtime) != 0 ||
+        get_uvarint(&p, end, &interval) != 0 || get_uvarint(&p, end, &m->missed) != 0 ||
+        get_string(&p, end, m->name, sizeof m->name) != 0 ||
+        get_uvarint(&p, end, &ncpu) != 0 || ncpu > 65536 || mono > INT64_MAX ||
+        realtime > INT64_MAX || interval > INT64_MAX) {
+        return -1;
+    }
+    m->mono_ns = (int64_t)mono;
+    m->realtime_ns = (int64_t)realtime;
+    m->interval_ns = (int64_t)interval;
+    m->ncpu = (uint32_t)ncpu;
+    m->p = p;
+    m->end = end;
+    return 0;
+}
+
+/**
+ * Finds a host by name, adding it on its first tick
+ * Returns: Host index, or -1 when the table is full
+ */
+static int collect_host_find(collect_state *cs, const agent_msg *m, long long recv_ns) {
+    for (int i = 0; i < cs->nhosts; i++) {
+        if (strcmp(cs->hosts[i].name, m->name) == 0) {
+            collect_host *h = &cs->hosts[i];
+            if (h->session == m->session) return i;
+            fprintf(stderr, "collect: %s restarted\n", m->name);
+            h->session = m->session;
+            h->next_seq = m->seq;
+            h->ncpu = m->ncpu;
+            h->offset = h->offset_cur = h->offset_prev = recv_ns - m->mono_ns;
+            h->span_end_ns = recv_ns + COLLECT_OFFSET_SPAN_NS;
+            return i;
+        }
+    }
+    if (cs->nhosts == COLLECT_MAX_HOSTS) {
+        if (!cs->unknown++) {
+            fprintf(stderr, "collect: more than %d hosts, ignoring %s and later ones\n",
+                    COLLECT_MAX_HOSTS, m->name);
+        }
+        return -1;
+    }
+    collect_host *h = &cs->hosts[cs->nhosts];
+    *h = (collect_host){
+        .session = m->session, .next_seq = m->seq, .ncpu = m->ncpu,
+        .offset = recv_ns - m->mono_ns, .offset_cur = recv_ns - m->mono_ns,
+        .offset_prev = recv_ns - m->mono_ns, .span_end_ns = recv_ns + COLLECT_OFFSET_SPAN_NS,
+        .latest = -1,
+    };
+    snprintf(h->name, sizeof h->name, "%s", m->name);
+    fprintf(stderr, "collect: %s joined, %u CPUs\n", h->name, h->ncpu);
+    return cs->nhosts++;
+}
+
+/**
+ * Refines a host's clock offset with one more tick
+ * The minimum over the current and the previous span follows slow drift
+ * between the clocks without losing the best sample at every span switch
+ */
+static void collect_clock(collect_host *h, const agent_msg *m, long long recv_ns) {
+    int64_t d = recv_ns - m->mono_ns;
+    if (recv_ns >= h->span_end_ns) {
+        h->offset_prev = h->offset_cur;
+        h->offset_cur = d;
+        h->span_end_ns = recv_ns + COLLECT_OFFSET_SPAN_NS;
+    }
+    if (d < h->offset_cur) h->offset_cur = d;
+    h->offset = h->offset_cur < h->offset_prev ? h->offset_cur : h->offset_prev;
+}
+
+/**
+ * Empties a slot for reuse
+ */
+static void collect_slot_clear(collect_slot *s) {
+    memset(s->hosts, 0, sizeof s->hosts);
+    s->nhosts = 0;
+    s->max = 0.0;
+    s->max_host = s->max_cpu = -1;
+    s->busy = s->total = 0;
+    memset(s->sampled_ns, 0, sizeof s->sampled_ns);
+    s->ntop = 0;
+}
+
+/**
+ * Adds one top list appearance of a process to a slot's cluster top list
+ * A process seen on several ticks adds them up, so the slot reports its
+ * mean over the slot rather than its busiest tick
+ * @param share_ns: Share of the host's CPUs times the ns the top list covered
+ * @param cpu_ns: CPUs' worth times the same ns
+ */
+static void collect_top_add(collect_slot *s, int host, int pid, const char *comm,
+                            double share_ns, double cpu_ns) {
+    for (int j = 0; j < s->ntop; j++) {
+        if (s->top[j].host != host || s->top[j].pid != pid) continue;
+        share_ns += s->top[j].share_ns;
+        cpu_ns += s->top[j].cpu_ns;
+        memmove(&s->top[j], &s->top[j + 1], (size_t)(s->ntop - j - 1) * sizeof *s->top);
+        s->ntop--;
+        break;
+    }
+    if (s->ntop == top_n) {
+        if (cpu_ns <= s->top[s->ntop - 1].cpu_ns) return;
+        s->ntop--;
+    }
+    int j = s->ntop++;
+    while (j > 0 && s->top[j - 1].cpu_ns < cpu_ns) {
+        s->top[j] = s->top[j - 1];
+        j--;
+    }
+    s->top[j] = (collect_top){ .host = host, .pid = pid, .share_ns = share_ns, .cpu_ns = cpu_ns };
+    snprintf(s->top[j].comm, sizeof s->top[j].comm, "%s", comm);
+}
+
+/**
+ * Prints a slot and empties it
+ * @param cs: Collector
+ * @param slot: Slot number, time / interval
+ * @param live: Hosts heard from recently
+ */
+static void collect_print(collect_state *cs, int64_t slot, int live) {
+    collect_slot *s = &cs->slots[slot & (cs->nslots - 1)];
+    if (s->nhosts) {
+        long long at = slot * cs->interval_ns;
+        struct timespec ts = { at / 1000000000LL, at % 1000000000LL };
+        char tbuf[32];
+        format_centis(&ts, tbuf, sizeof tbuf);
+        printf("%s\t%d/%d\t%3.0f%%\t%3.0f%%", tbuf, s->nhosts, live > s->nhosts ? live : s->nhosts,
+               s->max, s->total ? 100.0 * s->busy / (double)s->total : 0.0);
+        if (s->max_host >= 0) printf("\t%s/cpu_%d", cs->hosts[s->max_host].name, s->max_cpu);
+        putchar('\n');
+        for (int i = 0; i < s->ntop; i++) {
+            // Means over the time the host's top lists covered; a single
+            // tick can see more than its share, so clamp to all CPUs
+            const collect_top *t = &s->top[i];
+            double ns = s->sampled_ns[t->host];
+            double pct = ns > 0 ? t->share_ns / ns : 0.0;
+            if (pct > 100.0) pct = 100.0;
+            printf("    %s pid=%d %-20s %.1f%% (%.2f CPUs)\n", cs->hosts[t->host].name, t->pid,
+                   t->comm, pct, pct / 100.0 * cs->hosts[t->host].ncpu);
+        }
+    }
+    collect_slot_clear(s);
+}
+
+/**
+ * Prints every slot that is complete, or all of them
+ * @param cs: Collector
+ * @param now: Collector CLOCK_REALTIME, ns
+ * @param all: Print up to the newest slot regardless, at exit
+ */
+static void collect_advance(collect_state *cs, long long now, int all) {
+    int live = 0;
+    for (int i = 0; i < cs->nhosts; i++) live += now - cs->hosts[i].last_recv_ns < COLLECT_LIVE_NS;
+    while (cs->head >= 0 && cs->head <= cs->newest) {
+        int ready = all || (cs->head + 1) * cs->interval_ns + COLLECT_DELAY_NS <= now;
+        for (int i = 0; i < cs->nhosts && !ready; i++) {
+            const collect_host *h = &cs->hosts[i];
+            if (now - h->last_recv_ns < COLLECT_LIVE_NS && h->latest <= cs->head) break;
+            if (i == cs->nhosts - 1) ready = 1;
+        }
+        if (!ready) break;
+        collect_print(cs, cs->head++, live);
+    }
+}
+
+/**
+ * Places one tick of a host on the collector's clock and folds it into its slot
+ * @param cs: Collector
+ * @param hi: Host index
+ * @param m: Decoded header, with the CPU columns and top entries still to read
+ * @param live: Hosts heard from recently, for slots printed to make room
+ */
+static void collect_fold(collect_state *cs, int hi, const agent_msg *m, int live) {
+    collect_host *h = &cs->hosts[hi];
+    int64_t aligned = m->mono_ns + h->offset;
+    h->skew = m->realtime_ns - aligned;
+    int64_t slot = aligned / cs->interval_ns;
+    if (cs->head < 0) cs->head = cs->newest = slot;
+    if (slot < cs->head) { h->late++; return; }
+    if (slot - cs->head >= cs->nslots) {
+        // Too far ahead for the ring: print what is pending to make room
+        int64_t stop = slot - cs->nslots + 1;
+        while (cs->head < stop && cs->head <= cs->newest) collect_print(cs, cs->head++, live);
+        if (cs->head < stop) cs->head = stop;
+    }
+    if (slot > cs->newest) cs->newest = slot;
+    if (slot > h->latest) h->latest = slot;
+    
+    collect_slot *s = &cs->slots[slot & (cs->nslots - 1)];
+    uint64_t bit = 1ULL << (hi & 63);
+    if (!(s->hosts[hi >> 6] & bit)) {
+        s->hosts[hi >> 6] |= bit;
+        s->nhosts++;
+    }
+    const uint8_t *p = m->p;
+    for (uint32_t i = 0; i < m->ncpu; i++) {
+        uint64_t id, busy, total;
+        if (get_uvarint(&p, m->end, &id) != 0 || id > INT_MAX ||
+            get_uvarint(&p, m->end, &busy) != 0 || get_uvarint(&p, m->end, &total) != 0) {
+            cs->bad++;
+            return;
+        }
+        if (!total) continue;
+        double pct = 100.0 * (double)busy / (double)total;
+        if (s->max_host < 0 || pct > s->max) {
+            s->max = pct;
+            s->max_host = hi;
+            s->max_cpu = (int)id;
+        }
+        s->busy += busy;
+        s->total += total;
+    }
+    // A tick that did not scan repeats the previous top list, which its
+    // window already counted
+    uint64_t window;
+    if (get_uvarint(&p, m->end, &window) != 0) { cs->bad++; return; }
+    if (!window) return;
+    double window_ns = (double)window * (double)m->interval_ns;
+    s->sampled_ns[hi] += window_ns;
+    while (p < m->end) {
+        uint64_t pid, pct;
+        char comm[64];
+        if (get_uvarint(&p, m->end, &pid) != 0 || get_uvarint(&p, m->end, &pct) != 0 ||
+            get_string(&p, m->end, comm, sizeof comm) != 0) {
+            cs->bad++;
+            return;
+        }
+        if (pct) {
+            collect_top_add(s, hi, (int)pid, comm, pct / 100.0 * window_ns,
+                            pct / 1e4 * m->ncpu * window_ns);
+        }
+    }
+}
+
+/**
+ * Receives --agent streams and prints them merged in time slots
+ * @param addr: [HOST]:PORT to listen on
+ * @param hz: Slots per second
+ * Returns: Process exit status
+ */
+static int collect_main(const char *addr, int hz) {
+    collect_state cs = { .interval_ns = 1000000000LL / hz, .head = -1, .newest = -1 };
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_DGRAM }, *res;
+    if (resolve_host_port("--collect", addr, &hints, &res) != 0) return 1;
+    cs.fd = -1;
+    for (struct addrinfo *ai = res; ai && cs.fd == -1; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) continue;
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) cs.fd = fd;
+        else close(fd);
+    }
+    freeaddrinfo(res);
+    if (cs.fd == -1) { perror(addr); return 1; }
+    // Room for bursts from many hosts, and kernel receive times for the clocks
+    int rcvbuf = 8 << 20, one = 1;
+    setsockopt(cs.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    setsockopt(cs.fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one);
+    
+    // The ring spans the wait for slow hosts twice over
+    cs.nslots = 16;
+    while (cs.nslots < 2 * (COLLECT_DELAY_NS / cs.interval_ns) + 16) cs.nslots *= 2;
+    cs.slots = calloc((size_t)cs.nslots, sizeof *cs.slots);
+    collect_top *tops = calloc((size_t)cs.nslots * top_n, sizeof *tops);
+    for (int64_t i = 0; i < cs.nslots; i++) {
+        cs.slots[i].top = tops + i * top_n;
+        collect_slot_clear(&cs.slots[i]);
+    }
+    cs.hosts = calloc(COLLECT_MAX_HOSTS, sizeof *cs.hosts);
+    
+    uint8_t *bufs = malloc((size_t)COLLECT_BATCH * AGENT_PACKET_MAX);
+    struct mmsghdr msgs[COLLECT_BATCH];
+    struct iovec iov[COLLECT_BATCH];
+    union { char buf[CMSG_SPACE(sizeof(struct timespec))]; struct cmsghdr align; } ctrl[COLLECT_BATCH];
+    agent_msg decoded[COLLECT_BATCH];
+    int host_of[COLLECT_BATCH];
+    
+    signal(SIGINT, on_sigint);
+    printf("HH:MM:SS:UU\thosts\tmax\tmean\tbusiest\n");
+    fflush(stdout);
+    while (keep_running) {
+        struct timespec rt;
+        clock_gettime(CLOCK_REALTIME, &rt);
+        long long now = rt.tv_sec * 1000000000LL + rt.tv_nsec;
+        int timeout = 100;
+        if (cs.head >= 0 && cs.head <= cs.newest) {
+            long long wait = (cs.head + 1) * cs.interval_ns + COLLECT_DELAY_NS - now;
+            timeout = wait <= 0 ? 0 : wait < 100000000LL ? (int)(wait / 1000000) + 1 : 100;
+        }
+        struct pollfd pfd = { .fd = cs.fd, .events = POLLIN };
+        poll(&pfd, 1, timeout);
+        
+        for (int i = 0; i < COLLECT_BATCH; i++) {
+            iov[i] = (struct iovec){ bufs + (size_t)i * AGENT_PACKET_MAX, AGENT_PACKET_MAX };
+            msgs[i].msg_hdr = (struct msghdr){ .msg_iov = &iov[i], .msg_iovlen = 1,
+                                               .msg_control = ctrl[i].buf,
+                                               .msg_controllen = sizeof ctrl[i].buf };
+        }
+        int got = recvmmsg(cs.fd, msgs, COLLECT_BATCH, MSG_DONTWAIT, NULL);
+        clock_gettime(CLOCK_REALTIME, &rt);
+        now = rt.tv_sec * 1000000000LL + rt.tv_nsec;
+        
+        // Clocks first, so the ticks a batch carries share the best offset
+        for (int i = 0; i < got; i++) {
+            host_of[i] = -1;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC ||
+                agent_parse(iov[i].iov_base, msgs[i].msg_len, &decoded[i]) != 0) {
+                cs.bad++;
+                continue;
+            }
+            long long recv_ns = now;
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm;
+                 cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                    struct timespec ts;
+                    memcpy(&ts, CMSG_DATA(cm), sizeof ts);
+                    recv_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+                }
+            }
+            int hi = collect_host_find(&cs, &decoded[i], recv_ns);
+            if (hi < 0) continue;
+            collect_host *h = &cs.hosts[hi];
+            collect_clock(h, &decoded[i], recv_ns);
+            h->last_recv_ns = now;
+            h->ticks++;
+            if (decoded[i].seq > h->next_seq) h->lost += decoded[i].seq - h->next_seq;
+            if (decoded[i].seq >= h->next_seq) h->next_seq = decoded[i].seq + 1;
+            host_of[i] = hi;
+        }
+        int live = 0;
+        for (int i = 0; i < cs.nhosts; i++) live += now - cs.hosts[i].last_recv_ns < COLLECT_LIVE_NS;
+        for (int i = 0; i < got; i++) {
+            if (host_of[i] >= 0) collect_fold(&cs, host_of[i], &decoded[i], live);
+        }
+        
+        collect_advance(&cs, now, 0);
+        fflush(stdout);
+    }
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    collect_advance(&cs, rt.tv_sec * 1000000000LL + rt.tv_nsec, 1);
+    fflush(stdout);
+    
+    // Per-host totals; the wall clock gap includes the least network delay
+    for (int i = 0; i < cs.nhosts; i++) {
+        const collect_host *h = &cs.hosts[i];
+        fprintf(stderr, "collect: %s: %llu ticks, %llu lost, %llu late, wall clock %+.3f ms "
+                "from the collector's\n", h->name, h->ticks, h->lost, h->late, h->skew / 1e6);
+    }
+    if (cs.bad) fprintf(stderr, "collect: %llu damaged datagrams\n", cs.bad);
+    
+    close(cs.fd);
+    free(bufs);
+    free(tops);
+    free(cs.slots);
+    free(cs.hosts);
+    return 0;
+}
+
+/*
+ * Parser microbenchmark (--bench-parse)
+ * Replays a captured /proc snapshot through the hand-written parsers and the
+ * sscanf code they replaced. A snapshot is any directory laid out like /proc
+ * with a "stat" file and "[pid]/stat" files, e.g. made with
+ *   mkdir snap && cp /proc/stat snap/ &&
+ *   for p in /proc/[0-9]*; do mkdir snap/${p#/proc/} && cp $p/stat snap/${p#/proc/}/; done
+ */
+
+/**
+ * Reads a whole file into a NUL terminated heap buffer
+ * @param path: File to read
+ * @param len: Output for the content length
+ * Returns: Buffer to free(), or NULL on error
+ */
+static char *slurp_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    
+    size_t cap = 4096, n = 0;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (n + 1 >= cap) buf = realloc(buf, cap *= 2);
+        ssize_t r = read(fd, buf + n, cap - n - 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        n += (size_t)r;
+    }
+    close(fd);
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+/**
+ * Reference /proc/stat line parser, the sscanf path the tokenizer replaced
+ */
+static int parse_cpu_line_sscanf(const char *line, unsigned long long v[10]) {
+    return sscanf(line,
+        "cpu%*d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+        &v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6],&v[7],&v[8],&v[9]);
+}
+
+/**
+ * Reference /proc/[pid]/stat parser, the strchr/sscanf path it replaced
+ * Returns: utime + stime, or ~0ULL on malformed input
+ */
+static unsigned long long parse_pid_stat_sscanf(char *buf) {
+    char *comm_start = strchr(buf, '(');
+    char *comm_end = strrchr(buf, ')');
+    if (!comm_start || !comm_end || comm_end <= comm_start) return ~0ULL;
+    char *p = comm_end + 2;
+    for (int i = 0; i < 11; i++) {
+        p = strchr(p, ' ');
+        if (!p) return ~0ULL;
+        p++;
+    }
+    unsigned long long ut, st;
+    if (sscanf(p, "%llu %llu", &ut, &st) != 2) return ~0ULL;
+    return ut + st;
+}
+
+/**
+ * Parses every cpuN line of a /proc/stat image
+ * @param text: NUL terminated /proc/stat content
+ * @param fast: Use the tokenizer instead of sscanf
+ * Returns: Sum of all fields, so both parsers can be compared
+ */
+static unsigned long long bench_stat_pass(const char *text, int fast) {
+    unsigned long long sum = 0;
+    const char *line = strchr(text, '\n');  // Skip aggregate "cpu" line
+    if (line) line++;
+    while (line && *line) {
+        unsigned long long v[10] = {0};
+        int m = fast ? parse_cpu_line(line, v) : parse_cpu_line_sscanf(line, v);
+        if (m <= 0 && strncmp(line, "cpu", 3) != 0) break;  // Past the cpu block
+        for (int k = 0; k < m; k++) sum += v[k];
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    return sum;
+}
+
+/**
+ * Runs the parser microbenchmark over a snapshot directory
+ * @param dir: Snapshot root laid out like /proc
+ * Returns: Process exit status
+ */
+static int bench_parse(const char *dir) {
+    char path[4096];
+    size_t stat_len;
+    snprintf(path, sizeof path, "%s/stat", dir);
+    char *stat_text = slurp_file(path, &stat_len);
+    if (!stat_text) { perror(path); return 1; }
+    
+    // Load every [pid]/stat in the snapshot
+    int npid = 0, pid_cap = 256;
+    char **pid_text = malloc(pid_cap * sizeof *pid_text);
+    size_t *pid_len = malloc(pid_cap * sizeof *pid_len);
+    DIR *d = opendir(dir);
+    if (!d) { perror(dir); return 1; }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (!isdigit((unsigned char)de->d_name[0])) continue;
+        snprintf(path, sizeof path, "%s/%s/stat", dir, de->d_name);
+        size_t len;
+        char *text = slurp_file(path, &len);
+        if (!text || len == 0) { free(text); continue; }
+        if (npid == pid_cap) {
+            pid_cap *= 2;
+            pid_text = realloc(pid_text, pid_cap * sizeof *pid_text);
+            pid_len = realloc(pid_len, pid_cap * sizeof *pid_len);
+        }
+        pid_text[npid] = text;
+        pid_len[npid] = len;
+        npid++;
+    }
+    closedir(d);
+    
+    // Both parsers must agree before their speed means anything
+    if (bench_stat_pass(stat_text, 0) != bench_stat_pass(stat_text, 1)) {
+        fprintf(stderr, "bench: /proc/stat parsers disagree\n");
+        return 1;
+    }
+    for (int i = 0; i < npid; i++) {
+        pid_stat ps;
+        unsigned long long fast = parse_pid_stat(pid_text[i], pid_len[i], &ps) == 0 ?
+                                  ps.utime + ps.stime : ~0ULL;
+        char *copy = strdup(pid_text[i]);
+        unsigned long long slow = parse_pid_stat_sscanf(copy);
+        free(copy);
+        if (fast != slow) {
+            fprintf(stderr, "bench: pid stat parsers disagree on %.40s\n", pid_text[i]);
+            return 1;
+        }
+    }
+    
+    printf("snapshot %s: %zu bytes of /proc/stat, %d pid stat files\n",
+           dir, stat_len, npid);
+    
+    // Time each parser for a fixed wall budget and report ns per file
+    static const char *names[2] = {"sscanf", "tokenizer"};
+    double stat_ns[2], pid_ns[2];
+    volatile unsigned long long sink = 0;
+    for (int fast = 0; fast < 2; fast++) {
+        long long t0 = mono_ns(), t1;
+        long iters = 0;
+        do {
+            for (int k = 0; k < 64; k++) sink += bench_stat_pass(stat_text, fast);
+            iters += 64;
+        } while ((t1 = mono_ns()) - t0 < 300000000LL);
+        stat_ns[fast] = (double)(t1 - t0) / iters;
+        
+        // sscanf path works on a mutable copy, as it did on the read buffer
+        char line[1024];
+        t0 = mono_ns();
+        iters = 0;
+        do {
+            for (int i = 0; i < npid; i++) {
+                if (fast) {
+                    pid_stat ps;
+                    if (parse_pid_stat(pid_text[i], pid_len[i], &ps) == 0)
+                        sink += ps.utime + ps.stime;
+                } else {
+                    size_t len = pid_len[i] < sizeof line - 1 ? pid_len[i] : sizeof line - 1;
+                    memcpy(line, pid_text[i], len);
+                    line[len] = '\0';
+                    sink += parse_pid_stat_sscanf(line);
+                }
+            }
+            iters += npid ? npid : 1;
+        } while ((t1 = mono_ns()) - t0 < 300000000LL);
+        pid_ns[fast] = (double)(t1 - t0) / iters;
+    }
+    
+    for (int fast = 0; fast < 2; fast++) {
+        printf("  %-10s /proc/stat %9.1f ns/file   [pid]/stat %7.1f ns/file\n",
+               names[fast], stat_ns[fast], pid_ns[fast]);
+    }
+    printf("  speedup    /proc/stat %8.2fx          [pid]/stat %6.2fx\n",
+           stat_ns[0] / stat_ns[1], pid_ns[0] / pid_ns[1]);
+    
+    for (int i = 0; i < npid; i++) free(pid_text[i]);
+    free(pid_text);
+    free(pid_len);
+    free(stat_text);
+    return 0;
+}
+
+/*
+ * Selection microbenchmark (--bench-select)
+ * Times the streaming heap used by the delta pass, select_top() used to merge
+ * shards, and plain quickselect on synthetic usage arrays for a range of N
+ * and process counts. "idle" arrays are mostly zero deltas, as
+ * a 10 ms tick sees on a quiet box; "busy" arrays give every process a
+ * random share. Each run selects from a fresh copy, and only the selection
+ * itself is timed; the heap is fed the ticks as the delta pass would.
+ */
+
+/**
+ * Fills a usage array with a deterministic synthetic distribution
+ * @param arr: Array to fill
+ * @param n: Entries
+ * @param busy_pct: Percentage of entries with a nonzero share
+ * @param seed: xorshift state
+ */
+static void bench_fill_usage(proc_usage *arr, int n, int busy_pct, uint64_t seed) {
+    for (int i = 0; i < n; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        memset(&arr[i], 0, sizeof arr[i]);
+        arr[i].pid = arr[i].tgid = i + 1;
+        if ((int)(seed % 100) < busy_pct) {
+            arr[i].ticks = (seed >> 8) % 1000;
+            arr[i].pct = (double)arr[i].ticks / 10.0;
+        }
+    }
+}
+
+/**
+ * Times one selection routine on copies of a pristine array
+ * @param work: Scratch array
+ * @param src: Pristine input
+ * @param n: Entries
+ * @param k: Entries to select
+ * @param mode: 0 for select_top(), 1 for quickselect_top(), 2 for the heap
+ * @param heap: Heap for k entries, used by mode 2
+ * Returns: Nanoseconds per run
+ */
+static double bench_select_run(proc_usage *work, const proc_usage *src, int n, int k,
+                               int mode, top_heap *heap) {
+    long long start = mono_ns(), spent = 0;
+    long iters = 0;
+    do {
+        memcpy(work, src, (size_t)n * sizeof *work);
+        long long t0 = mono_ns();
+        if (mode == 0) select_top(work, n, k);
+        else if (mode == 1) quickselect_top(work, n, k);
+        else {
+            for (int i = 0; i < n; i++) top_heap_push(heap, work[i].ticks, i);
+            top_heap_sort(heap);
+        }
+        spent += mono_ns() - t0;
+        iters++;
+    } while (mono_ns() - start < 200000000LL);
+    return (double)spent / iters;
+}
+
+/**
+ * Runs the selection microbenchmark
+ * Returns: Process exit status
+ */
+static int bench_select(void) {
+    static const int procs[] = {500, 5000, 20000, 100000};
+    static const int tops[] = {1, 5, 10, 16, 20, 50, 100};
+    static const struct { const char *name; int busy_pct; } dists[] = {
+        {"idle", 5}, {"busy", 100},
+    };
+    int maxn = procs[sizeof procs / sizeof *procs - 1];
+    proc_usage *src = malloc((size_t)maxn * sizeof *src);
+    proc_usage *work = malloc((size_t)maxn * sizeof *work);
+    proc_usage *check = malloc((size_t)maxn * sizeof *check);
+    
+    printf("%-5s %7s %4s %12s %12s %12s %8s\n",
+           "dist", "procs", "N", "heap ns", "select ns", "qselect ns", "speedup");
+    for (size_t d = 0; d < sizeof dists / sizeof *dists; d++) {
+        for (size_t p = 0; p < sizeof procs / sizeof *procs; p++) {
+            int n = procs[p];
+            bench_fill_usage(src, n, dists[d].busy_pct, 0x9e3779b97f4a7c15ULL + n);
+            for (size_t t = 0; t < sizeof tops / sizeof *tops; t++) {
+                int k = tops[t];
+                top_heap heap;
+                top_heap_init(&heap, k);
+                
+                // All paths must pick the same shares before timing them
+                memcpy(work, src, (size_t)n * sizeof *work);
+                memcpy(check, src, (size_t)n * sizeof *check);
+                int m = select_top(work, n, k);
+                quickselect_top(check, n, k);
+                for (int i = 0; i < n; i++) top_heap_push(&heap, src[i].ticks, i);
+                top_heap_sort(&heap);
+                for (int i = 0; i < m; i++) {
+                    if (work[i].pct != check[i].pct || heap.e[i].ticks != check[i].ticks) {
+                        fprintf(stderr, "bench: selections disagree at N=%d procs=%d\n", k, n);
+                        return 1;
+                    }
+                }
+                
+                double streamed = bench_select_run(work, src, n, k, 2, &heap);
+                double fast = bench_select_run(work, src, n, k, 0, NULL);
+                double quick = bench_select_run(work, src, n, k, 1, NULL);
+                printf("%-5s %7d %4d %12.0f %12.0f %12.0f %7.2fx\n", dists[d].name, n, k,
+                       streamed, fast, quick, quick / streamed);
+                free(heap.e);
+            }
+        }
+    }
+    free(src);
+    free(work);
+    free(check);
+    return 0;
+}
+
+/*
+ * Synthetic /proc fixtures (--gen-proc, --proc-root, --bench-tick)
+ * A fixture is a directory laid out like the parts of /proc the samplers
+ * read: stat, and [pid]/{stat,comm,cmdline,task/[pid]/stat} for every
+ * process. Content is generated from a fixed seed, so the same size always
+ * produces the same tree. --bench-tick runs the tick's hot path against
+ * fixtures in a fresh child process per size, so descriptor caches and
+ * allocation counts start from zero each time.
+ */
+
+// Allocation accounting for --bench-tick
+// The allocator is left alone: a tick's heap growth comes from mallinfo2()
+// where glibc has it. Counting the heap calls themselves needs a build that
+// routes this file's calls through the wrappers below:
+//   gcc -DCPU100_COUNT_ALLOCS -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc ...
+// The count is per thread, so a wrapper costs one increment
+#ifdef CPU100_COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static _Thread_local unsigned long alloc_calls;   // Heap allocations by this thread
+
+void *__wrap_malloc(size_t size) { alloc_calls++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { alloc_calls++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t size) { alloc_calls++; return __real_realloc(p, size); }
+
+/**
+ * Returns the calling thread's allocation count, or -1 if not counted
+ */
+static long alloc_count(void) { return (long)alloc_calls; }
+#else
+static long alloc_count(void) { return -1; }
+#endif
+
+/**
+ * Returns the bytes of heap in use, or -1 where the C library cannot tell
+ */
+static long long heap_in_use(void) {
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    return (long long)(mi.uordblks + mi.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Writes a small file in one go
+ * @param path: File to create or truncate
+ * @param data: Content
+ * @param len: Bytes of content
+ * Returns: 0 on success, -1 with errno set
+ */
+static int write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    ssize_t bytes = write(fd, data, len);
+    int err = errno;
+    close(fd);
+    if (bytes != (ssize_t)len) { errno = bytes < 0 ? err : EIO; return -1; }
+    return 0;
+}
+
+/**
+ * Steps a xorshift generator, for fixture content that repeats exactly
+ */
+static uint64_t fixture_rand(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Writes the stat file of a fixture
+ * @param dir: Fixture root
+ * @param cpus: cpuN lines to write
+ * Returns: 0 on success, -1 with errno set
+ */
+static int gen_proc_stat(const char *dir, int cpus) {
+    size_t cap = (size_t)(cpus + 8) * 128, len = 0;
+    char *buf = malloc(cap);
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    unsigned long long sum[10] = {0};
+    char *lines = malloc((size_t)cpus * 128);
+    size_t lines_len = 0;
+    for (int i = 0; i < cpus; i++) {
+        unsigned long long v[10];
+        for (int k = 0; k < 10; k++) v[k] = fixture_rand(&seed) % 1000000;
+        v[8] = v[9] = 0;
+        for (int k = 0; k < 10; k++) sum[k] += v[k];
+        lines_len += (size_t)sprintf(lines + lines_len, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu 0 0\n",
+                                     i, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+    }
+    len += (size_t)sprintf(buf, "cpu  %llu %llu %llu %llu %llu %llu %llu %llu 0 0\n",
+                           sum[0], sum[1], sum[2], sum[3], sum[4], sum[5], sum[6], sum[7]);
+    memcpy(buf + len, lines, lines_len);
+    len += lines_len;
+    len += (size_t)sprintf(buf + len, "intr 0\nctxt 0\nbtime 0\nprocesses 0\n"
+                           "procs_running 1\nprocs_blocked 0\nsoftirq 0 0 0 0 0 0 0 0 0 0 0\n");
+    
+    char path[4096];
+    snprintf(path, sizeof path, "%s/stat", dir);
+    int ret = write_file(path, buf, len);
+    free(lines);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Writes a synthetic /proc tree
+ * @param dir: Fixture root, created if missing
+ * @param pids: Processes to create, numbered from 1
+ * @param cpus: cpuN lines in stat
+ * Returns: 0 on success, -1 with errno set
+ */
+static int gen_proc(const char *dir, int pids, int cpus) {
+    static const char *const names[] = {
+        "systemd", "kworker/0:1", "sshd", "java", "postgres", "nginx", "python3", "bash",
+    };
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+    if (gen_proc_stat(dir, cpus) != 0) return -1;
+    
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    char path[4096], buf[512];
+    for (int pid = 1; pid <= pids; pid++) {
+        const char *comm = names[fixture_rand(&seed) % (sizeof names / sizeof *names)];
+        unsigned long long utime = fixture_rand(&seed) % 100000;
+        unsigned long long stime = fixture_rand(&seed) % 10000;
+        unsigned long long start = fixture_rand(&seed) % 1000000;
+        int len = snprintf(buf, sizeof buf,
+                           "%d (%s) S 1 %d %d 0 -1 4194560 %llu 0 0 0 %llu %llu 0 0 20 0 1 0 "
+                           "%llu 12345678 1234 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 "
+                           "17 %d 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+                           pid, comm, pid, pid, utime / 7, utime, stime, start, pid % cpus);
+        
+        snprintf(path, sizeof path, "%s/%d", dir, pid);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+        snprintf(path, sizeof path, "%s/%d/stat", dir, pid);
+        if (write_file(path, buf, (size_t)len) != 0) return -1;
+        snprintf(path, sizeof path, "%s/%d/task", dir, pid);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+        snprintf(path, sizeof path, "%s/%d/task/%d", dir, pid, pid);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) return -1;
+        snprintf(path, sizeof path, "%s/%d/task/%d/stat", dir, pid, pid);
+        if (write_file(path, buf, (size_t)len) != 0) return -1;
+        
+        snprintf(path, sizeof path, "%s/%d/comm", dir, pid);
+        len = snprintf(buf, sizeof buf, "%s\n", comm);
+        if (write_file(path, buf, (size_t)len) != 0) return -1;
+        snprintf(path, sizeof path, "%s/%d/cmdline", dir, pid);
+        len = snprintf(buf, sizeof buf, "/usr/bin/%s%c--id=%d%c", comm, '\0', pid, '\0');
+        if (write_file(path, buf, (size_t)len) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parses DIR[,PIDS[,CPUS]] and writes that fixture
+ * @param arg: Argument of --gen-proc
+ * Returns: Process exit status
+ */
+static int gen_proc_main(const char *arg) {
+    char dir[PROC_ROOT_MAX + 1];
+    if (snprintf(dir, sizeof dir, "%s", arg) >= (int)sizeof dir) {
+        fprintf(stderr, "--gen-proc: path longer than %d bytes\n", PROC_ROOT_MAX);
+        return 1;
+    }
+    int pids = 1000, cpus = 8;
+    char *comma = strchr(dir, ',');
+    if (comma) {
+        *comma++ = '\0';
+        pids = atoi(comma);
+        char *next = strchr(comma, ',');
+        if (next) cpus = atoi(next + 1);
+    }
+    if (pids < 1 || cpus < 1 || cpus > 4096) {
+        fprintf(stderr, "--gen-proc: expected DIR[,PIDS[,CPUS]] with 1 to 4096 CPUs\n");
+        return 1;
+    }
+    if (gen_proc(dir, pids, cpus) != 0) { perror(dir); return 1; }
+    printf("%s: %d processes on %d CPUs\n", dir, pids, cpus);
+    return 0;
+}
+
+/**
+ * Runs the tick hot path against proc_root and prints one result row
+ * Measures /proc/stat, the process walk, every stat read and selection,
+ * as the main loop does without output. Fixture files do not change, so
+ * every delta is zero and selection takes its fast path
+ */
+static void bench_tick_run(void) {
+    raise_fd_limit();
+    int n = stat_cpus();
+    proc_shard *shards = calloc(1, sizeof *shards);
+    shard_count = 1;
+    shard_init(&shards[0], 0, -1);
+    cpu_sample *prevc = calloc(n, sizeof *prevc), *curc = calloc(n, sizeof *curc);
+    
+    // The first tick opens every descriptor
+    long long t0 = prof_ns();
+    read_proc_stat_optimized(prevc, n, NULL);
+    sample_all_shards(shards, 0, 1);
+    long long first_ns = prof_ns() - t0;
+    int procs = shards[0].cache[shards[0].cur ^ 1].count;
+    // The second tick fills the other cache buffer, after which a tick
+    // should allocate nothing
+    read_proc_stat_optimized(curc, n, NULL);
+    sample_all_shards(shards, 0, 0);
+    
+    long ticks = 0;
+    long allocs0 = alloc_count();
+    long long heap0 = heap_in_use();
+    long long start = prof_ns(), elapsed;
+    do {
+        read_proc_stat_optimized(curc, n, NULL);
+        unsigned long long dt_ticks = 0;
+        for (int i = 0; i < n; i++) dt_ticks += curc[i].total - prevc[i].total;
+        sample_all_shards(shards, dt_ticks, 0);
+        proc_usage *top;
+        merge_top(shards, &top);
+        cpu_sample *tmp = prevc; prevc = curc; curc = tmp;
+        ticks++;
+        elapsed = prof_ns() - start;
+    } while (elapsed < 1000000000LL || ticks < 10);
+    long allocs = alloc_count();
+    long long heap = heap_in_use();
+    
+    double tick_ns = (double)elapsed / ticks;
+    printf("%7d %5d %10.1f %10.1f %8.1f %9.1f %8d ", procs, n, 1e9 / tick_ns,
+           tick_ns / 1e3, procs ? tick_ns / procs : 0.0, first_ns / 1e6, fd_cached);
+    if (heap0 < 0) printf("%11s ", "n/a");
+    else printf("%11.1f ", (double)(heap - heap0) / ticks);
+    if (allocs0 < 0) printf("%11s\n", "n/a");
+    else printf("%11.2f\n", (double)(allocs - allocs0) / ticks);
+    
+    shard_free(&shards[0]);
+    free(shards);
+    free(prevc);
+    free(curc);
+}
+
+/**
+ * Removes one entry of a fixture tree, for nftw()
+ */
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+/**
+ * Benchmarks the tick hot path on fixtures
+ * @param dir: Existing fixture to measure, or NULL for the built-in
+ *             1k/10k/50k processes by 8/64/256 CPUs matrix in a temporary tree
+ * Returns: Process exit status
+ */
+static int bench_tick(const char *dir) {
+    static const int pid_counts[] = {1000, 10000, 50000};
+    static const int cpu_counts[] = {8, 64, 256};
+    printf("%7s %5s %10s %10s %8s %9s %8s %11s %11s\n", "procs", "cpus", "ticks/s", "us/tick",
+           "ns/proc", "first ms", "fds", "heap B/tick", "allocs/tick");
+    fflush(stdout);
+    if (dir) {
+        proc_root = dir;
+        bench_tick_run();
+        return 0;
+    }
+    
+    char tmpl[] = "/tmp/cpu100-bench-XXXXXX";
+    char *root = mkdtemp(tmpl);
+    if (!root) { perror("mkdtemp"); return 1; }
+    int status = 0;
+    for (size_t p = 0; p < sizeof pid_counts / sizeof *pid_counts && !status; p++) {
+        if (gen_proc(root, pid_counts[p], cpu_counts[0]) != 0) { perror(root); status = 1; break; }
+        for (size_t c = 0; c < sizeof cpu_counts / sizeof *cpu_counts; c++) {
+            if (gen_proc_stat(root, cpu_counts[c]) != 0) { perror(root); status = 1; break; }
+            // A fresh process per size, so no cache or descriptor carries over
+            pid_t child = fork();
+            if (child == -1) { perror("fork"); status = 1; break; }
+            if (child == 0) {
+                proc_root = root;
+                bench_tick_run();
+                fflush(stdout);
+                _exit(0);
+            }
+            int ws;
+            waitpid(child, &ws, 0);
+            if (!WIFEXITED(ws) || WEXITSTATUS(ws) != 0) status = 1;
+        }
+    }
+    nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
+
+/*
+ * eBPF sampling backend (--bpf)
+ * A raw tracepoint program on sched_switch charges the time since the last
+ * switch on that CPU to the task being switched out, keyed by its thread
+ * group, in a per-CPU hash of cumulative nanoseconds. Userspace dumps the
+ * map once per tick and diffs it like /proc ticks, so bursts shorter than a
+ * tick are counted exactly and the cost no longer grows with task count.
+ * Time is charged at switch-out, so a task that runs uninterrupted across
+ * several ticks shows up in one lump when it finally leaves the CPU.
+ * The program is assembled here and loaded with the raw bpf() syscall, so
+ * no BPF toolchain or libbpf is needed; /proc sampling is the fallback.
+ */
+#define BPF_ACCT_ENTRIES 65536     // Processes the map can track
+#ifndef ENOTSUPP
+#define ENOTSUPP 524               // Kernel-internal, returned by bpf()
+#endif
+
+#define BPF_RAW(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define BPF_LD_MAP(d, fd) \
+    BPF_RAW(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), BPF_RAW(0, 0, 0, 0, 0)
+
 typedef struct {
-    proc_sample *samples;  // Array of process samples
-    int capacity;          // Current allocated capacity
-    int count;             // Number of active processes
-} proc_cache;
+    int start_fd;          // Per-CPU array: timestamp of the last switch
+    int acct_fd;           // Per-CPU hash: tgid -> cumulative on-CPU ns
+    int prog_fd;           // Loaded program
+    int link_fd;           // Raw tracepoint attachment
+    int ncpus;             // Possible CPUs, the width of per-CPU values
+    uint32_t *keys;        // Dump buffers, BPF_ACCT_ENTRIES entries
+    uint64_t *values;      // ncpus values per key
+    int batch;             // BPF_MAP_LOOKUP_BATCH works
+    long long last_ns;     // CLOCK_MONOTONIC of the previous dump
+    long long last_prune;  // CLOCK_MONOTONIC of the last stale key sweep
+} bpf_backend;
 
 /**
- * Gets the number of CPUs in the system
- * Returns: CPU count from sysconf
+ * Thin wrapper for the bpf() syscall
  */
-static int ncpu(void) {
-    long n = sysconf(_SC_NPROCESSORS_CONF);
-    if (n < 1) { perror("sysconf"); exit(1); }
-    return (int)n;
+static long sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof *attr);
 }
 
 /**
- * Pins the monitoring process to the last CPU core
- * This reduces interference with other processes being monitored
- * @param n: Total number of CPUs in the system
+ * Counts possible CPUs from sysfs, which sizes per-CPU map values
+ * Returns: Number of possible CPUs, or -1 on error
  */
-static void pin_to_last_cpu(int n) {
-    cpu_set_t set; CPU_ZERO(&set); CPU_SET(n - 1, &set);
-    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
-        perror("sched_setaffinity"); exit(1);
+static int possible_cpus(void) {
+    size_t len;
+    char *text = slurp_file("/sys/devices/system/cpu/possible", &len);
+    if (!text) return -1;
+    int count = 0;
+    for (const char *p = text; *p && *p != '\n'; ) {
+        const char *q = p;
+        unsigned long long lo = parse_ull(&q), hi = lo;
+        if (q == p) break;
+        if (*q == '-') { p = ++q; hi = parse_ull(&q); }
+        count += (int)(hi - lo + 1);
+        p = *q == ',' ? q + 1 : q;
     }
+    free(text);
+    return count > 0 ? count : -1;
 }
 
 /**
- * Reads CPU statistics from /proc/stat efficiently
- * Uses persistent file descriptor and buffer to minimize syscall overhead
- * @param out: Array to store CPU samples (one per CPU core)
- * @param n: Number of CPUs to read
+ * Creates a BPF map
+ * Returns: Map descriptor, or -1 on error
  */
-static void read_proc_stat_optimized(cpu_sample *out, int n) {
-    static int fd = -1;           // Persistent file descriptor
-    static char *buf = NULL;      // Reusable buffer
-    static size_t bufsize = 8192; // Buffer size for /proc/stat content
+static int bpf_map_create(enum bpf_map_type type, uint32_t key_size, uint32_t value_size,
+                          uint32_t max_entries) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    return (int)sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**
+ * Loads and attaches the sched_switch accounting program
+ * @param b: Backend to initialize
+ * Returns: 0 on success, -1 with errno set if BPF is unavailable
+ */
+static int bpf_backend_open(bpf_backend *b) {
+    memset(b, 0, sizeof *b);
+    b->start_fd = b->acct_fd = b->prog_fd = b->link_fd = -1;
+    b->ncpus = possible_cpus();
+    if (b->ncpus < 1) return -1;
     
-    // Initialize on first call
-    if (fd == -1) {
-        fd = open("/proc/stat", O_RDONLY);
-        if (fd == -1) { perror("open /proc/stat"); exit(1); }
-        buf = malloc(bufsize);
+    b->start_fd = bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, 4, 8, 1);
+    b->acct_fd = bpf_map_create(BPF_MAP_TYPE_PERCPU_HASH, 4, 8, BPF_ACCT_ENTRIES);
+    if (b->start_fd < 0 || b->acct_fd < 0) goto fail;
+    
+    // r7 = &start[cpu]; r8 = now - *r7; *r7 = now; acct[tgid] += r8
+    struct bpf_insn prog[] = {
+        BPF_RAW(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0),         // key = 0
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        BPF_RAW(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+        BPF_LD_MAP(BPF_REG_1, b->start_fd),
+        BPF_RAW(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        BPF_RAW(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 30, 0),          // -> exit
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+        BPF_RAW(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0),
+        BPF_RAW(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_9, BPF_REG_7, 0, 0),
+        BPF_RAW(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_7, BPF_REG_8, 0, 0),
+        BPF_RAW(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_9, 0, 24, 0),          // first switch
+        BPF_RAW(BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_8, BPF_REG_9, 0, 0),
+        BPF_RAW(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_pid_tgid),
+        BPF_RAW(BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 32),        // tgid
+        BPF_RAW(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 20, 0),          // idle
+        BPF_RAW(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, -8, 0),
+        BPF_LD_MAP(BPF_REG_1, b->acct_fd),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        BPF_RAW(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        BPF_RAW(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        BPF_RAW(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 0),           // -> insert
+        BPF_RAW(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0),
+        BPF_RAW(BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_8, 0, 0),
+        BPF_RAW(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0),
+        BPF_RAW(BPF_JMP | BPF_JA, 0, 0, 9, 0),                            // -> exit
+        BPF_RAW(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_8, -16, 0), // insert:
+        BPF_LD_MAP(BPF_REG_1, b->acct_fd),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        BPF_RAW(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        BPF_RAW(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, BPF_NOEXIST),
+        BPF_RAW(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_update_elem),
+        BPF_RAW(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0),         // exit:
+        BPF_RAW(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    
+    static char log[16384];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.prog_type = BPF_PROG_TYPE_RAW_TRACEPOINT;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof prog / sizeof prog[0];
+    attr.license = (uint64_t)(uintptr_t)"Apache-2.0";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof log;
+    attr.log_level = 1;
+    b->prog_fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (b->prog_fd < 0) {
+        int err = errno;
+        if (log[0]) fprintf(stderr, "bpf verifier:\n%s", log);
+        errno = err;
+        goto fail;
     }
     
-    // Reset file position and read entire file at once
-    lseek(fd, 0, SEEK_SET);
-    ssize_t bytes = read(fd, buf, bufsize - 1);
-    if (bytes <= 0) { perror("read /proc/stat"); exit(1); }
-    buf[bytes] = '\0';
+    memset(&attr, 0, sizeof attr);
+    attr.raw_tracepoint.name = (uint64_t)(uintptr_t)"sched_switch";
+    attr.raw_tracepoint.prog_fd = (uint32_t)b->prog_fd;
+    b->link_fd = (int)sys_bpf(BPF_RAW_TRACEPOINT_OPEN, &attr);
+    if (b->link_fd < 0) goto fail;
     
-    // Parse CPU statistics line by line
-    char *line = buf;
-    char *next = strchr(line, '\n');
-    if (next) { line = next + 1; } // Skip aggregate "cpu" line
+    b->keys = malloc(BPF_ACCT_ENTRIES * sizeof *b->keys);
+    b->values = malloc((size_t)BPF_ACCT_ENTRIES * b->ncpus * sizeof *b->values);
+    if (!b->keys || !b->values) goto fail;
+    b->batch = 1;
+    b->last_ns = b->last_prune = mono_ns();
+    return 0;
     
-    // Process each CPU core's statistics
-    for (int i = 0; i < n; i++) {
-        next = strchr(line, '\n');
-        if (!next) { fprintf(stderr, "Unexpected EOF in /proc/stat\n"); exit(1); }
-        
-        // Parse the 10 CPU time fields:
-        // user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice
-        unsigned long long v[10] = {0};
-        int m = sscanf(line,
-            "cpu%*d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-            &v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6],&v[7],&v[8],&v[9]);
-        
-        if (m < 4) { fprintf(stderr, "Parse error in /proc/stat\n"); exit(1); }
-        
-        // Calculate idle time (idle + iowait) and total time
-        unsigned long long idle = v[3] + v[4];
-        unsigned long long total = 0;
-        for (int k = 0; k < m; k++) total += v[k];
-        out[i] = (cpu_sample){idle, total};
-        
-        line = next + 1;
-    }
+fail:;
+    int err = errno;
+    if (b->link_fd >= 0) close(b->link_fd);
+    if (b->prog_fd >= 0) close(b->prog_fd);
+    if (b->acct_fd >= 0) close(b->acct_fd);
+    if (b->start_fd >= 0) close(b->start_fd);
+    free(b->keys);
+    free(b->values);
+    errno = err;
+    return -1;
 }
 
-// Hash table for O(1) process ID lookups
-#define HASH_SIZE 1024
-typedef struct pid_node {
-    int pid;               // Process ID
-    int index;            // Index in the process array
-    struct pid_node *next; // Collision chain
-} pid_node;
-
 /**
- * Simple hash function for process IDs
- * @param pid: Process ID to hash
- * Returns: Hash bucket index
+ * Detaches the program and releases the maps
+ * @param b: Backend to close
  */
-static unsigned int pid_hash(int pid) {
-    return (unsigned int)pid % HASH_SIZE;
+static void bpf_backend_close(bpf_backend *b) {
+    close(b->link_fd);
+    close(b->prog_fd);
+    close(b->acct_fd);
+    close(b->start_fd);
+    free(b->keys);
+    free(b->values);
 }
 
 /**
- * Reads all process statistics from /proc/[pid]/stat files
- * Uses hash table for efficient PID lookups in subsequent comparisons
- * @param cache: Process cache to store results
- * @param hash_table: Hash table for O(1) PID lookups
- * Returns: Number of processes read
+ * Copies the accounting map into keys/values
+ * Uses one BPF_MAP_LOOKUP_BATCH call per chunk when the kernel has it,
+ * and a get_next_key/lookup walk otherwise
+ * @param b: Backend
+ * Returns: Number of entries dumped
  */
-static int read_processes_optimized(proc_cache *cache, pid_node **hash_table) {
-    static DIR *d = NULL;      // Persistent directory handle
-    static char buf[1024];      // Buffer for reading stat files
-    
-    // Open /proc directory on first call, rewind on subsequent calls
-    if (!d) {
-        d = opendir("/proc");
-        if (!d) { perror("opendir"); exit(1); }
-    } else {
-        rewinddir(d);
-    }
+static int bpf_dump(bpf_backend *b) {
+    union bpf_attr attr;
+    int count = 0;
     
-    // Clear previous hash table
-    for (int i = 0; i < HASH_SIZE; i++) {
-        pid_node *curr = hash_table[i];
-        while (curr) {
-            pid_node *next = curr->next;
-            free(curr);
-            curr = next;
+    if (b->batch) {
+        uint32_t token = 0;
+        for (int first = 1;; first = 0) {
+            memset(&attr, 0, sizeof attr);
+            attr.batch.map_fd = (uint32_t)b->acct_fd;
+            attr.batch.in_batch = first ? 0 : (uint64_t)(uintptr_t)&token;
+            attr.batch.out_batch = (uint64_t)(uintptr_t)&token;
+            attr.batch.keys = (uint64_t)(uintptr_t)(b->keys + count);
+            attr.batch.values = (uint64_t)(uintptr_t)(b->values + (size_t)count * b->ncpus);
+            attr.batch.count = (uint32_t)(BPF_ACCT_ENTRIES - count);
+            long r = sys_bpf(BPF_MAP_LOOKUP_BATCH, &attr);
+            count += (int)attr.batch.count;
+            if (r == 0 && count < BPF_ACCT_ENTRIES) continue;
+            if (r == 0 || errno == ENOENT) return count;
+            if (first && (errno == EINVAL || errno == ENOTSUPP || errno == EOPNOTSUPP)) break;
+            return count;  // Keep what we got, e.g. on a concurrent resize
         }
-        hash_table[i] = NULL;
+        b->batch = 0;
+        count = 0;
     }
     
-    cache->count = 0;
-    struct dirent *de;
-    
-    // Iterate through /proc entries
-    while ((de = readdir(d))) {
-        // Skip non-numeric entries (not process directories)
-        if (!isdigit((unsigned char)de->d_name[0])) continue;
-        
-        int pid = atoi(de->d_name);
-        char path[256];
-        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-        
-        // Read process stat file
-        int fd = open(path, O_RDONLY);
-        if (fd == -1) continue;
-        
-        ssize_t bytes = read(fd, buf, sizeof(buf) - 1);
-        close(fd);
-        if (bytes <= 0) continue;
-        buf[bytes] = '\0';
-        
-        // Parse process name (comm) field - it's in parentheses
-        char *comm_start = strchr(buf, '(');
-        char *comm_end = strrchr(buf, ')');
-        if (!comm_start || !comm_end || comm_end <= comm_start) continue;
-        
-        *comm_end = '\0';
-        char *p = comm_end + 2; // Skip ") " to get to state field
-        
-        // Skip state and 10 more fields to reach utime (field 14)
-        for (int i = 0; i < 11; i++) {
-            p = strchr(p, ' ');
-            if (!p) goto next_pid;
-            p++;
-        }
+    uint32_t key, next;
+    void *prev = NULL;
+    while (count < BPF_ACCT_ENTRIES) {
+        memset(&attr, 0, sizeof attr);
+        attr.map_fd = (uint32_t)b->acct_fd;
+        attr.key = (uint64_t)(uintptr_t)prev;
+        attr.next_key = (uint64_t)(uintptr_t)&next;
+        if (sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr) != 0) break;
         
-        // Parse user time and system time (fields 14 and 15)
-        unsigned long long ut, st;
-        if (sscanf(p, "%llu %llu", &ut, &st) != 2) goto next_pid;
-        
-        // Expand cache if needed
-        if (cache->count >= cache->capacity) {
-            cache->capacity *= 2;
-            cache->samples = realloc(cache->samples, 
-                                    cache->capacity * sizeof(proc_sample));
-        }
-        
-        // Store process information
-        int idx = cache->count;
-        cache->samples[idx].pid = pid;
-        cache->samples[idx].ticks = ut + st;  // Total CPU ticks used
-        strncpy(cache->samples[idx].comm, comm_start + 1, 63);
-        cache->samples[idx].comm[63] = '\0';
-        
-        // Add to hash table for fast lookup
-        unsigned int h = pid_hash(pid);
-        pid_node *node = malloc(sizeof(pid_node));
-        node->pid = pid;
-        node->index = idx;
-        node->next = hash_table[h];
-        hash_table[h] = node;
-        
-        cache->count++;
-        
-    next_pid:
-        continue;
+        memset(&attr, 0, sizeof attr);
+        attr.map_fd = (uint32_t)b->acct_fd;
+        attr.key = (uint64_t)(uintptr_t)&next;
+        attr.value = (uint64_t)(uintptr_t)(b->values + (size_t)count * b->ncpus);
+        if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0) b->keys[count++] = next;
+        key = next;
+        prev = &key;
     }
-    
-    return cache->count;
+    return count;
 }
 
 /**
- * Partition function for quickselect algorithm
- * Partitions array around pivot for finding top K elements
- * @param arr: Array of process usage data
- * @param low: Start index
- * @param high: End index
- * Returns: Final position of pivot element
+ * Deletes map entries whose process has exited
+ * @param b: Backend
+ * @param count: Entries in keys from the last dump
  */
-static int partition(proc_usage *arr, int low, int high) {
-    double pivot = arr[high].pct;
-    int i = low - 1;
-    
-    // Move elements greater than pivot to the left
-    for (int j = low; j < high; j++) {
-        if (arr[j].pct > pivot) {
-            i++;
-            proc_usage temp = arr[i];
-            arr[i] = arr[j];
-            arr[j] = temp;
-        }
+static void bpf_prune(bpf_backend *b, int count) {
+    union bpf_attr attr;
+    for (int i = 0; i < count; i++) {
+        if (kill((pid_t)b->keys[i], 0) == 0 || errno != ESRCH) continue;
+        memset(&attr, 0, sizeof attr);
+        attr.map_fd = (uint32_t)b->acct_fd;
+        attr.key = (uint64_t)(uintptr_t)&b->keys[i];
+        sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
     }
-    
-    // Place pivot in correct position
-    proc_usage temp = arr[i + 1];
-    arr[i + 1] = arr[high];
-    arr[high] = temp;
-    
-    return i + 1;
 }
 
 /**
- * Finds and sorts only the top 5 processes by CPU usage
- * Uses quickselect for O(n) average time complexity
- * @param arr: Array of process usage data
- * @param n: Total number of processes
+ * Reads a process name from /proc/[pid]/comm
+ * @param pid: Process ID
+ * @param comm: Output buffer of 64 bytes, "?" if the process is gone
  */
-static void quickselect_top5(proc_usage *arr, int n) {
-    if (n <= 5) return;  // Already have 5 or fewer elements
-    
-    // Use quickselect to partition array so top 5 are at the beginning
-    int left = 0, right = n - 1;
-    while (left < right) {
-        int pivot_idx = partition(arr, left, right);
-        if (pivot_idx == 4) break;  // Top 5 are now in first 5 positions
-        else if (pivot_idx < 4) left = pivot_idx + 1;
-        else right = pivot_idx - 1;
-    }
-    
-    // Sort just the top 5 elements
-    for (int i = 0; i < 5 && i < n; i++) {
-        for (int j = i + 1; j < 5 && j < n; j++) {
-            if (arr[j].pct > arr[i].pct) {
-                proc_usage temp = arr[i];
-                arr[i] = arr[j];
-                arr[j] = temp;
-            }
-        }
-    }
+static void read_comm(int pid, char *comm) {
+    char path[256];
+    snprintf(path, sizeof path, "%s/%d/comm", proc_root, pid);
+    strcpy(comm, "?");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    ssize_t n = read(fd, comm, 63);
+    close(fd);
+    if (n <= 0) { strcpy(comm, "?"); return; }
+    if (comm[n - 1] == '\n') n--;
+    comm[n] = '\0';
 }
 
 /**
- * Calculates CPU usage for each process and prints top 5
- * Compares current and previous samples to determine CPU percentage
- * @param prev: Previous process cache
- * @param prev_hash: Hash table for previous processes
- * @param cur: Current process cache
- * @param dt_ticks: Total CPU ticks elapsed across all cores
+ * Samples processes from the BPF map into shard 0 and selects its top N
+ * Percentages are the share of ncpu * elapsed time, in nanoseconds; ticks
+ * of the winners are converted back to clock ticks for --binary records
+ * @param b: Backend
+ * @param s: The only shard
+ * @param ncpu: Monitored CPUs
+ * @param dt_ticks: Clock ticks elapsed across all cores per /proc/stat
+ * @param initial: First sample, with nothing to diff against
  */
-static void print_top5_optimized(proc_cache *prev, pid_node **prev_hash,
-                                proc_cache *cur, unsigned long long dt_ticks) {
-    static proc_usage *arr = NULL;  // Reusable array for calculations
-    static int arr_capacity = 0;
+static void bpf_sample(bpf_backend *b, proc_shard *s, int ncpu,
+                       unsigned long long dt_ticks, int initial) {
+    int count = bpf_dump(b);
+    long long now = mono_ns();
+    unsigned long long dt_ns = (unsigned long long)(now - b->last_ns) * (unsigned long long)ncpu;
+    b->last_ns = now;
     
-    // Ensure array is large enough
-    if (arr_capacity < cur->count) {
-        arr_capacity = cur->count;
-        arr = realloc(arr, arr_capacity * sizeof(proc_usage));
+    proc_cache *cur = &s->cache[s->cur], *prev = &s->cache[s->cur ^ 1];
+    pid_table *hash = &s->table[s->cur], *prev_hash = &s->table[s->cur ^ 1];
+    pid_table_clear(hash);
+    cur->count = 0;
+    proc_cache_reserve(cur, count);
+    for (int i = 0; i < count; i++) {
+        unsigned long long ns = 0;
+        const uint64_t *v = b->values + (size_t)i * b->ncpus;
+        for (int c = 0; c < b->ncpus; c++) ns += v[c];
+        int j = cur->count++, pid = (int)b->keys[i];
+        int p = initial ? -1 : pid_lookup(prev_hash, pid);
+        cur->pids[j] = cur->tgids[j] = pid;
+        cur->fds[j] = -1;
+        cur->comms[j] = COMM_NONE;   // Names are read for the winners only
+        cur->ticks[j] = ns;
+        cur->starts[j] = 0;
+        cur->deltas[j] = p >= 0 ? ns - prev->ticks[p] : 0;
+        cur->minflts[j] = cur->majflts[j] = 0;   // Not in the map, and no stat read
+        cur->cpus[j] = -1;
+        pid_table_insert(hash, pid, j);
     }
     
-    int n = 0;
-    // Calculate CPU usage for each current process
-    for (int i = 0; i < cur->count; i++) {
-        int pid = cur->samples[i].pid;
-        unsigned int h = pid_hash(pid);
-        
-        // Look up this process in previous sample using hash table
-        pid_node *node = prev_hash[h];
-        while (node) {
-            if (node->pid == pid) {
-                int prev_idx = node->index;
-                if (prev_idx < prev->count) {
-                    // Calculate CPU usage percentage
-                    unsigned long long d = cur->samples[i].ticks - 
-                                         prev->samples[prev_idx].ticks;
-                    double pct = dt_ticks ? 100.0 * (double)d / (double)dt_ticks : 0.0;
-                    
-                    arr[n].pid = pid;
-                    strncpy(arr[n].comm, cur->samples[i].comm, 63);
-                    arr[n].comm[63] = '\0';
-                    arr[n].pct = pct;
-                    n++;
-                }
-                break;
-            }
-            node = node->next;
+    if (!initial) {
+        shard_top(s, dt_ns);
+        for (int i = 0; i < s->top; i++) {
+            read_comm(s->arr[i].pid, s->arr[i].comm);
+            s->arr[i].ticks = dt_ns ? s->arr[i].ticks * dt_ticks / dt_ns : 0;
         }
     }
+    s->cur ^= 1;  // Swap caches for the next tick
     
-    // Find and sort top 5 processes
-    quickselect_top5(arr, n);
-    
-    // Print top 5 processes
-    int top = n < 5 ? n : 5;
-    for (int i = 0; i < top; i++) {
-        printf("    pid=%d %-20s %.1f%%\n", arr[i].pid, arr[i].comm, arr[i].pct);
+    // Drop exited processes about once a second so the map does not fill up
+    if (now - b->last_prune >= 1000000000LL) {
+        bpf_prune(b, count);
+        b->last_prune = now;
     }
 }
 
 /**
- * Creates timestamp string with centisecond precision
- * Format: HH:MM:SS:CC where CC is centiseconds (1/100 second)
- * @param buf: Buffer to store timestamp string
- * @param sz: Size of buffer
+ * Prints command line help
+ * @param prog: Program name from argv[0]
  */
-static void timestamp_centis(char *buf, size_t sz) {
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    struct tm tm;
-    localtime_r(&ts.tv_sec, &tm);
-    int centi = (int)(ts.tv_nsec / 10000000L);  // Convert nanoseconds to centiseconds
-    if (centi > 99) centi = 99;
-    snprintf(buf, sz, "%02d:%02d:%02d:%02d", 
-             tm.tm_hour, tm.tm_min, tm.tm_sec, centi);
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n"
+           "  --proc-events   track processes with the kernel proc connector\n"
+           "                  instead of walking /proc every tick (needs root)\n"
+           "  --bpf           account on-CPU time per process with an eBPF program\n"
+           "                  on sched_switch instead of polling /proc (needs\n"
+           "                  root; falls back to /proc when unavailable)\n"
+           "  --io-uring      read the processes' stat files in batches through\n"
+           "                  io_uring, one system call per 1024 processes\n"
+           "                  (falls back to pread when unavailable; each read\n"
+           "                  runs on a kernel worker, so it trades syscalls\n"
+           "                  for context switches)\n"
+           "  --monitor-cpus=LIST\n"
+           "                  sample processes with one thread per listed core,\n"
+           "                  e.g. 62,63 or 60-63, or per-node for one thread on\n"
+           "                  a housekeeping core of each NUMA node (default: one\n"
+           "                  thread on the last core of node 0 that is neither\n"
+           "                  isolated nor nohz_full)\n"
+           "  --hz=N          samples per second, 1 to 10000 (default 100); text\n"
+           "                  timestamps keep centisecond resolution\n"
+           "  --top=N         processes and threads listed per tick, 1 to 1000\n"
+           "                  (default 5)\n"
+           "  --cmdline       append each top process's command line, read once\n"
+           "                  per process lifetime (not with --bpf)\n"
+           "  --counters      print under each top process the CPU it last ran on\n"
+           "                  (A->B when it moved), its minor/major faults, its\n"
+           "                  voluntary/involuntary context switches and its run\n"
+           "                  and run-queue wait time since the previous tick,\n"
+           "                  marked thrashed when it waited longer than it ran\n"
+           "  --breakdown     also report user/nice/sys/iowait/irq/softirq/steal\n"
+           "                  per CPU, after each tick's CPU line\n"
+           "  --topology      also report usage per NUMA node, per package when\n"
+           "                  they differ, and per core (SMT siblings, e.g. 0+64=)\n"
+           "                  when cores have more than one thread\n"
+           "  --trigger=EXPR  only write ticks around spikes: cpu>PCT (busiest\n"
+           "                  CPU) or pid-pct>PCT (busiest process), with an\n"
+           "                  optional :TICKS streak, e.g. cpu>90:3\n"
+           "  --pre=SEC, --post=SEC\n"
+           "                  context kept before and written after each\n"
+           "                  --trigger firing (default 2 each)\n"
+           "  --cgroups[=DIR] also report the top leaf cgroups by CPU with their\n"
+           "                  throttled time, from cgroup v2 cpu.stat (default:\n"
+           "                  the cgroup2 mount)\n"
+           "  --pressure      also report the share of time tasks stalled on CPU, IO\n"
+           "                  and memory, as some%%/full%% from /proc/pressure\n"
+           "  --psi-trigger[=SPEC]\n"
+           "                  sample at --idle-hz until the kernel reports a\n"
+           "                  stall, then at --hz until it has been quiet for two\n"
+           "                  windows; SPEC is [cpu:|io:|memory:]some|full\n"
+           "                  STALL_US WINDOW_US (default \"some 50000 1000000\",\n"
+           "                  cpu) and may be given more than once; without\n"
+           "                  CAP_SYS_RESOURCE the window must be a multiple of 2s\n"
+           "  --idle-hz=N     samples per second while no stall is reported\n"
+           "                  (default 1)\n"
+           "  --adaptive[=PCT]\n"
+           "                  read /proc/stat every tick but scan processes,\n"
+           "                  threads and cgroups only on ticks where some CPU\n"
+           "                  is at least PCT busy (default 50), or after\n"
+           "                  --scan-every ticks; top lists then cover the ticks\n"
+           "                  since the last scan and are tagged window=MS\n"
+           "  --scan-every=N  longest run of ticks without a scan with\n"
+           "                  --adaptive (default 100)\n"
+           "  --threads       also report the top threads, read from\n"
+           "                  /proc/[pid]/task for the top processes and for\n"
+           "                  any process above --thread-threshold\n"
+           "  --thread-threshold=PCT\n"
+           "                  process CPU %% that makes --threads look at its\n"
+           "                  threads (default 10)\n"
+           "  --profile       time each phase of every tick and report latency\n"
+           "                  percentiles, syscalls per tick and the monitor's own\n"
+           "                  CPU time on stderr at exit and on SIGUSR1\n"
+           "  --serve=[HOST]:PORT\n"
+           "                  serve Prometheus metrics over HTTP instead of\n"
+           "                  printing: per-CPU max, p99 and mean busy %% over\n"
+           "                  each scrape window, time above --serve-threshold,\n"
+           "                  and the peak share of the busiest processes; each\n"
+           "                  client address, or /metrics?scraper=NAME, has a\n"
+           "                  window of its own\n"
+           "  --serve-threshold=PCT\n"
+           "                  busy %% counted as time above threshold (default 90)\n"
+           "  --shm[=NAME]    also publish every tick into the POSIX shared-memory\n"
+           "                  segment NAME (default /cpu100) for local readers\n"
+           "  --shm-read[=NAME]\n"
+           "                  print the latest tick of a --shm segment\n"
+           "  --tui[=NAME]    show a live dashboard instead of printing: per-CPU\n"
+           "                  bars and history, an all-CPU sparkline and the top\n"
+           "                  processes, redrawn 10 times a second by writing\n"
+           "                  only the changed cells (q quits); with NAME, show\n"
+           "                  the feed of a running cpu100 --shm=NAME\n"
+           "  --agent=HOST:PORT\n"
+           "                  also stream every tick over UDP to a --collect\n"
+           "                  collector, batched into one sendmmsg per 100 ms\n"
+           "  --agent-name=NAME\n"
+           "                  host name --agent reports under (default: the\n"
+           "                  system host name)\n"
+           "  --collect=[HOST]:PORT\n"
+           "                  receive --agent streams from many hosts and print\n"
+           "                  them aligned on this host's clock in --hz slots:\n"
+           "                  hosts reporting, the busiest CPU of any host, the\n"
+           "                  mean of all CPUs, and the --top processes of all\n"
+           "                  hosts ranked by CPUs used\n"
+           "  --record=FILE   also write every tick to a compact columnar log,\n"
+           "                  written in 100-tick blocks with an index\n"
+           "  --query=FILE    print the ticks of a --record log in the text format\n"
+           "  --from=TIME, --to=TIME\n"
+           "                  limit --query to a time range: @EPOCH, +SECONDS\n"
+           "                  from the start, or [YYYY-MM-DD ]HH:MM[:SS]\n"
+           "  --pid=PID       limit --query to ticks where PID is in the top list\n"
+           "  --binary=FILE   write fixed-size records into a memory-mapped ring\n"
+           "                  file instead of text to stdout\n"
+           "  --binary-records=N\n"
+           "                  ring capacity in ticks (default 60000, 10 min)\n"
+           "  --sync-output   write and flush stdout on the sampling thread every\n"
+           "                  tick instead of batching through a writer thread\n"
+           "  --decode=FILE   print a --binary file in the text format\n"
+           "  --bench-parse[=DIR]\n"
+           "                  benchmark the /proc parsers against sscanf on a\n"
+           "                  snapshot laid out like /proc (default /proc)\n"
+           "  --proc-root=DIR read stat and [pid] entries from DIR instead of /proc\n"
+           "  --gen-proc=DIR[,PIDS[,CPUS]]\n"
+           "                  write a synthetic /proc tree for --proc-root and\n"
+           "                  --bench-tick (default 1000 processes, 8 CPUs)\n"
+           "  --bench-tick[=DIR]\n"
+           "                  benchmark the tick hot path on DIR, or on generated\n"
+           "                  trees of 1k/10k/50k processes by 8/64/256 CPUs:\n"
+           "                  ticks/s, ns per process, heap growth per tick and,\n"
+           "                  in a CPU100_COUNT_ALLOCS build, allocations per tick\n"
+           "  --bench-select  benchmark top-N selection for a range of N and\n"
+           "                  process counts\n"
+           "  -h, --help      show this help\n", prog);
 }
 
 /**
  * Main monitoring loop
- * Samples CPU and process statistics at 100Hz (every 10ms)
- * Prints per-CPU usage and top 5 processes by CPU consumption
+ * Samples CPU and process statistics at --hz (default 100Hz, every 10ms)
+ * Prints per-CPU usage and top N processes by CPU consumption
  */
-int main(void) {
+int main(int argc, char **argv) {
+    static const struct option longopts[] = {
+        {"proc-events", no_argument, NULL, 'E'},
+        {"monitor-cpus", required_argument, NULL, 'M'},
+        {"bpf",         no_argument, NULL, 'F'},
+        {"io-uring",    no_argument, NULL, 'J'},
+        {"threads",     no_argument, NULL, 'T'},
+        {"cmdline",     no_argument, NULL, 'C'},
+        {"breakdown",   no_argument, NULL, 'K'},
+        {"trigger",     required_argument, NULL, 'G'},
+        {"cgroups",     optional_argument, NULL, 'c'},
+        {"pressure",    no_argument, NULL, 'p'},
+        {"psi-trigger", optional_argument, NULL, 'W'},
+        {"idle-hz",     required_argument, NULL, 'I'},
+        {"adaptive",    optional_argument, NULL, 'A'},
+        {"scan-every",  required_argument, NULL, 'e'},
+        {"profile",     no_argument, NULL, 'Q'},
+        {"proc-root",   required_argument, NULL, 'U'},
+        {"gen-proc",    required_argument, NULL, 'g'},
+        {"bench-tick",  optional_argument, NULL, 'X'},
+        {"serve",       required_argument, NULL, 'H'},
+        {"shm",         optional_argument, NULL, 'm'},
+        {"shm-read",    optional_argument, NULL, 'y'},
+        {"tui",         optional_argument, NULL, 'i'},
+        {"agent",       required_argument, NULL, 'a'},
+        {"collect",     required_argument, NULL, 'k'},
+        {"agent-name",  required_argument, NULL, 'n'},
+        {"counters",    no_argument, NULL, 'x'},
+        {"topology",    no_argument, NULL, 'Y'},
+        {"record",      required_argument, NULL, 'O'},
+        {"query",       required_argument, NULL, 'q'},
+        {"from",        required_argument, NULL, 'f'},
+        {"to",          required_argument, NULL, 'u'},
+        {"pid",         required_argument, NULL, 'j'},
+        {"serve-threshold", required_argument, NULL, 'b'},
+        {"pre",         required_argument, NULL, 'r'},
+        {"post",        required_argument, NULL, 'o'},
+        {"thread-threshold", required_argument, NULL, 't'},
+        {"binary",      required_argument, NULL, 'B'},
+        {"binary-records", required_argument, NULL, 'R'},
+        {"decode",      required_argument, NULL, 'D'},
+        {"sync-output", no_argument, NULL, 'S'},
+        {"bench-parse", optional_argument, NULL, 'P'},
+        {"bench-select", no_argument, NULL, 'L'},
+        {"hz",          required_argument, NULL, 'z'},
+        {"top",         required_argument, NULL, 'N'},
+        {"help",        no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int use_proc_events = 0;
+    int *monitor_cpus = NULL;
+    const char *binary_path = NULL;
+    long long binary_records = 60000;
+    int sync_output = 0;
+    int use_threads = 0;
+    int use_bpf = 0;
+    int use_breakdown = 0;
+    const char *trigger_expr = NULL;
+    const char *cgroup_root = NULL;
+    int use_pressure = 0;
+    psi_trigger_spec psi_specs[PSI_MAX_TRIGGERS];
+    int npsi_specs = 0;
+    int idle_hz = 1;
+    const char *serve_addr = NULL;
+    const char *shm_name = NULL;
+    int use_tui = 0;
+    const char *record_path = NULL;
+    const char *agent_addr = NULL, *agent_name = NULL, *collect_addr = NULL;
+    const char *query_path = NULL, *query_from = NULL, *query_to = NULL;
+    int query_pid = 0;
+    double serve_threshold = 90.0;
+    int adaptive = 0;
+    double adaptive_pct = 50.0;
+    long scan_every = 100;
+    double pre_seconds = 2.0, post_seconds = 2.0;
+    double thread_threshold = 10.0;
+    int hz = 100;
+    int c;
+    while ((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'E': use_proc_events = 1; break;
+        case 'M':
+            free(monitor_cpus);
+            if (strcmp(optarg, "per-node") == 0) shard_count = housekeeping_per_node(&monitor_cpus);
+            else shard_count = parse_cpu_list(optarg, &monitor_cpus);
+            if (shard_count < 1 || shard_count > 64) {
+                fprintf(stderr, "--monitor-cpus: expected 1 to 64 CPUs, got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B': binary_path = optarg; break;
+        case 'R':
+            binary_records = atoll(optarg);
+            if (binary_records < 1) {
+                fprintf(stderr, "--binary-records: expected a positive count\n");
+                return 1;
+            }
+            break;
+        case 'D': return bin_decode(optarg);
+        case 'S': sync_output = 1; break;
+        case 'T': use_threads = 1; break;
+        case 'C': show_cmdline = 1; break;
+        case 'x': show_counters = 1; break;
+        case 'Y': show_topology = 1; break;
+        case 'K': use_breakdown = 1; break;
+        case 'G': trigger_expr = optarg; break;
+        case 'c': cgroup_root = optarg ? optarg : cgroup_default_root(); break;
+        case 'p': use_pressure = 1; break;
+        case 'W':
+            if (npsi_specs == PSI_MAX_TRIGGERS) {
+                fprintf(stderr, "--psi-trigger: at most %d triggers\n", PSI_MAX_TRIGGERS);
+                return 1;
+            }
+            if (psi_parse_trigger(&psi_specs[npsi_specs],
+                                  optarg ? optarg : "some 50000 1000000") != 0) {
+                fprintf(stderr, "--psi-trigger: expected [cpu:|io:|memory:]some|full "
+                        "STALL_US WINDOW_US, got '%s'\n", optarg);
+                return 1;
+            }
+            npsi_specs++;
+            break;
+        case 'A':
+            adaptive = 1;
+            if (optarg) adaptive_pct = atof(optarg);
+            break;
+        case 'Q': profiling = 1; break;
+        case 'H': serve_addr = optarg; break;
+        case 'm':
+        case 'y':
+            if (optarg && optarg[0] != '/') {
+                fprintf(stderr, "--shm: segment names start with '/', got '%s'\n", optarg);
+                return 1;
+            }
+            if (c == 'y') return shm_read_main(optarg ? optarg : "/cpu100");
+            shm_name = optarg ? optarg : "/cpu100";
+            break;
+        case 'i':
+            if (!optarg) { use_tui = 1; break; }
+            if (optarg[0] != '/') {
+                fprintf(stderr, "--tui: segment names start with '/', got '%s'\n", optarg);
+                return 1;
+            }
+            return tui_main(optarg);
+        case 'b': serve_threshold = atof(optarg); break;
+        case 'O': record_path = optarg; break;
+        case 'a': agent_addr = optarg; break;
+        case 'k': collect_addr = optarg; break;
+        case 'n': agent_name = optarg; break;
+        case 'q': query_path = optarg; break;
+        case 'f': query_from = optarg; break;
+        case 'u': query_to = optarg; break;
+        case 'j':
+            query_pid = atoi(optarg);
+            if (query_pid < 1) {
+                fprintf(stderr, "--pid: expected a process ID, got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            if (strlen(optarg) > PROC_ROOT_MAX) {
+                fprintf(stderr, "--proc-root: path longer than %d bytes\n", PROC_ROOT_MAX);
+                return 1;
+            }
+            proc_root = optarg;
+            break;
+        case 'g': return gen_proc_main(optarg);
+        case 'X':
+            if (optarg && strlen(optarg) > PROC_ROOT_MAX) {
+                fprintf(stderr, "--bench-tick: path longer than %d bytes\n", PROC_ROOT_MAX);
+                return 1;
+            }
+            return bench_tick(optarg);
+        case 'e':
+            scan_every = atol(optarg);
+            if (scan_every < 1) {
+                fprintf(stderr, "--scan-every: expected a positive number of ticks\n");
+                return 1;
+            }
+            break;
+        case 'I':
+            idle_hz = atoi(optarg);
+            if (idle_hz < 1 || idle_hz > 10000) {
+                fprintf(stderr, "--idle-hz: expected 1 to 10000, got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r': pre_seconds = atof(optarg); break;
+        case 'o': post_seconds = atof(optarg); break;
+        case 'F': use_bpf = 1; break;
+        case 'J': use_uring = 1; break;
+        case 't': thread_threshold = atof(optarg); break;
+        case 'P': return bench_parse(optarg ? optarg : proc_root);
+        case 'L': return bench_select();
+        case 'z':
+            hz = atoi(optarg);
+            if (hz < 1 || hz > 10000) {
+                fprintf(stderr, "--hz: expected 1 to 10000, got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'N':
+            top_n = atoi(optarg);
+            if (top_n < 1 || top_n > 1000) {
+                fprintf(stderr, "--top: expected 1 to 1000, got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    
+    // --from, --to and --pid may follow --query
+    if (query_path) return log_query(query_path, query_from, query_to, query_pid);
+    if (query_from || query_to || query_pid) {
+        fprintf(stderr, "--from, --to and --pid select ticks for --query\n");
+        return 1;
+    }
+    // --hz and --top may follow --collect
+    if (collect_addr) return collect_main(collect_addr, hz);
+    
+    trigger trig;
+    if (trigger_expr && trigger_parse(&trig, trigger_expr) != 0) {
+        fprintf(stderr, "--trigger: expected cpu>PCT or pid-pct>PCT, optionally "
+                "followed by :TICKS, got '%s'\n", trigger_expr);
+        return 1;
+    }
+    if (trigger_expr && binary_path) {
+        fprintf(stderr, "--trigger captures text output and cannot be combined with --binary\n");
+        return 1;
+    }
+    if (use_tui && (serve_addr || binary_path || trigger_expr)) {
+        fprintf(stderr, "--tui replaces all other output and cannot be combined with "
+                "--serve, --binary or --trigger\n");
+        return 1;
+    }
+    if (serve_addr && (binary_path || trigger_expr)) {
+        fprintf(stderr, "--serve replaces all other output and cannot be combined with "
+                "--binary or --trigger\n");
+        return 1;
+    }
+    if (pre_seconds < 0 || post_seconds < 0) {
+        fprintf(stderr, "--pre/--post: expected a non-negative number of seconds\n");
+        return 1;
+    }
+    
+    if (strcmp(proc_root, "/proc") != 0 && (use_bpf || use_proc_events)) {
+        fprintf(stderr, "--proc-root reads a fixture and cannot be combined with "
+                "--bpf or --proc-events\n");
+        return 1;
+    }
+    
+    if (use_bpf && monitor_cpus) {
+        fprintf(stderr, "--bpf does its own sampling and cannot be combined with --monitor-cpus\n");
+        return 1;
+    }
+    if (use_bpf && use_uring) {
+        fprintf(stderr, "--bpf does its own sampling and cannot be combined with --io-uring\n");
+        return 1;
+    }
+    
     // Set up signal handler for clean shutdown
     signal(SIGINT, on_sigint);
+    if (profiling) signal(SIGUSR1, on_sigusr1);
     
-    // Initialize CPU monitoring
-    int n = ncpu();
-    pin_to_last_cpu(n);  // Run monitor on last CPU to minimize interference
+    // The BPF backend replaces /proc process sampling when it loads
+    bpf_backend bpf;
+    if (use_bpf && bpf_backend_open(&bpf) != 0) {
+        perror("bpf, falling back to /proc sampling");
+        use_bpf = 0;
+    }
+    
+    // Subscribe before the first walk so no process slips in between
+    if (use_proc_events && proc_events_open() != 0) {
+        perror("proc connector, falling back to /proc walks");
+    }
+    
+    // Initialize CPU monitoring; a fixture brings its own CPU count
+    int n = stat_cpus();
+    if (show_topology) topology_init(n);
+    // Run the monitor on a housekeeping CPU of the first node (or the first
+    // monitor CPU) to minimize interference
+    pin_to_cpu(monitor_cpus ? monitor_cpus[0] : housekeeping_cpu(0));
+    raise_fd_limit();    // Room for one stat descriptor per process
     
     // Allocate CPU sample buffers (double buffering)
     cpu_sample *prevc = calloc(n, sizeof *prevc);
     cpu_sample *curc = calloc(n, sizeof *curc);
     
-    // Initialize process caches with initial capacity
-    proc_cache prev_cache = {NULL, 1024, 0};
-    proc_cache cur_cache = {NULL, 1024, 0};
-    prev_cache.samples = malloc(prev_cache.capacity * sizeof(proc_sample));
-    cur_cache.samples = malloc(cur_cache.capacity * sizeof(proc_sample));
+    // Column counters and deltas for --breakdown, double buffered as well
+    unsigned long long *prevt = NULL, *curt = NULL;
+    uint32_t *breakdown = NULL;
+    if (use_breakdown) {
+        prevt = calloc((size_t)CPU_FIELDS * n, sizeof *prevt);
+        curt = calloc((size_t)CPU_FIELDS * n, sizeof *curt);
+        breakdown = calloc((size_t)CPU_FIELDS * n, sizeof *breakdown);
+    }
+    
+    // Process sampling shards, one per monitor CPU
+    proc_shard *shards = calloc(shard_count, sizeof *shards);
+    for (int k = 0; k < shard_count; k++) {
+        shard_init(&shards[k], k, monitor_cpus ? monitor_cpus[k] : -1);
+    }
+    if (monitor_cpus) {
+        pthread_barrier_init(&tick_start, NULL, shard_count + 1);
+        pthread_barrier_init(&tick_done, NULL, shard_count + 1);
+        
+        // Workers leave SIGINT to the main thread
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        for (int k = 0; k < shard_count; k++) {
+            int err = pthread_create(&shards[k].thread, NULL, shard_worker, &shards[k]);
+            if (err) { errno = err; perror("pthread_create"); exit(1); }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    
+    // Thread sampling for --threads
+    thread_sampler threads;
+    if (use_threads) {
+        hot_threshold = thread_threshold;
+        thread_sampler_init(&threads);
+    }
+    
+    // Scheduler counters of the top processes for --counters
+    counter_set counters = {0};
+    if (show_counters) pid_table_init(&counters.index, 6);
+    
+    // cgroup sampling for --cgroups
+    cgroup_set cgroups;
+    if (cgroup_root) cgroup_init(&cgroups, cgroup_root);
     
-    // Hash tables for O(1) process lookups
-    pid_node **prev_hash = calloc(HASH_SIZE, sizeof(pid_node*));
-    pid_node **cur_hash = calloc(HASH_SIZE, sizeof(pid_node*));
+    // Pressure sampling for --pressure, stall triggers for --psi-trigger
+    psi_state psi;
+    if ((use_pressure || npsi_specs) && psi_open(&psi) == 0) {
+        if (use_pressure) perror("/proc/pressure, not reporting pressure");
+        use_pressure = 0;
+    }
+    for (int i = 0; i < npsi_specs; i++) {
+        if (psi_add_trigger(&psi, &psi_specs[i]) != 0) {
+            fprintf(stderr, "psi trigger '%s %s': %s, sampling at a fixed rate\n",
+                    psi_names[psi_specs[i].res], psi_specs[i].text, strerror(errno));
+            for (int k = 0; k < psi.ntrig; k++) close(psi.trig[k].fd);
+            psi.ntrig = 0;
+            break;
+        }
+    }
+    int psi_events = npsi_specs && psi.ntrig;
+    if (psi_events) {
+        psi.idle_ns = 1000000000LL / idle_hz;
+        psi.fast_ns = 1000000000LL / hz;
+    }
     
     // Read initial samples
-    read_proc_stat_optimized(prevc, n);
-    read_processes_optimized(&prev_cache, prev_hash);
+    read_proc_stat_optimized(prevc, n, prevt);
+    if (cgroup_root) cgroup_sample(&cgroups, n);
+    if (use_pressure) psi_sample(&psi);
+    if (use_bpf) bpf_sample(&bpf, &shards[0], n, 0, 1);
+    else sample_all_shards(shards, 0, 1);
     
-    // Sampling interval: 10ms = 100 samples per second
-    struct timespec interval = {0, 10 * 1000 * 1000}; // 10ms in nanoseconds
+    // Sampling interval: 10ms = 100 samples per second by default
+    tick_clock tc;
+    // With --psi-trigger, start at the idle rate and wait for a stall
+    tick_clock_start(&tc, psi_events ? psi.idle_ns : 1000000000LL / hz);
     
-    // Print header
-    printf("HH:MM:SS:UU");
-    for (int i = 0; i < n; i++) printf("\tcpu_%d", i);
-    putchar('\n');
+    // Binary output replaces the text on stdout
+    bin_writer bw = {0};
+    out_ring ring;
+    serve_state serve;
+    shm_writer shm = {0};
+    log_writer record;
+    agent_state agent;
+    tui_state tui;
+    FILE *out = stdout;
+    // The dashboard draws from the live feed, a private one without --shm
+    if (shm_name || use_tui) shm_open_writer(&shm, shm_name, n, cpu_ids, tc.interval_ns);
+    if (record_path) log_open(&record, record_path, n, cpu_ids, tc.interval_ns);
+    if (agent_addr && agent_open(&agent, agent_addr, agent_name) != 0) return 1;
+    if (serve_addr) {
+        if (serve_open(&serve, serve_addr, n, cpu_ids, serve_threshold) != 0) return 1;
+    } else if (binary_path) {
+        bin_open(&bw, binary_path, n, cpu_ids, (uint64_t)binary_records, tc.interval_ns,
+                 use_breakdown ? CPU_FIELDS : 0);
+    } else if (use_tui) {
+        if (tui_open(&tui, shm.hdr) != 0) return 1;
+        // The render thread leaves SIGINT to the main thread
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        int err = pthread_create(&tui.thread, NULL, tui_thread, &tui);
+        if (err) { errno = err; perror("pthread_create"); exit(1); }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    } else {
+        if (!sync_output) {
+            // The writer thread leaves SIGINT to the main thread
+            sigset_t block, old;
+            sigemptyset(&block);
+            sigaddset(&block, SIGINT);
+            pthread_sigmask(SIG_BLOCK, &block, &old);
+            out = out_ring_open(&ring, STDOUT_FILENO);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+        print_header(out, n, cpu_ids);
+    }
+    if (trigger_expr) {
+        trigger_init(&trig, (long)(pre_seconds * hz), (long)(post_seconds * hz));
+    }
+    
+    // With --adaptive, process scans cover every tick since the previous one
+    unsigned long long window_ticks = 0;   // CPU ticks of all CPUs since the last scan
+    long window_len = 0;                   // Ticks since the last scan
+    long long last_scan_ns = mono_ns();
+    long ticks = 0, scans = 0;
+    long long loop_start_ns = mono_ns();
+    double top_pct = 0.0;                  // Busiest process of the last scan
     
     // Main monitoring loop
     while (keep_running) {
-        nanosleep(&interval, NULL);
+        long missed = psi_events ? tick_wait(&tc, psi.trig, psi.ntrig) : tick_wait(&tc, NULL, 0);
+        if (psi_events) psi_update_rate(&psi, &tc);
+        long long tick_t = prof_start(), t = tick_t;
         
-        // Read current CPU and process statistics
-        read_proc_stat_optimized(curc, n);
-        read_processes_optimized(&cur_cache, cur_hash);
-        
-        // Print timestamp
-        char tbuf[32];
-        timestamp_centis(tbuf, sizeof tbuf);
-        printf("%s", tbuf);
-        
-        // Calculate and print per-CPU usage
-        for (int i = 0; i < n; i++) {
-            unsigned long long dt = curc[i].total - prevc[i].total;  // Total ticks
-            unsigned long long di = curc[i].idle - prevc[i].idle;    // Idle ticks
-            double usage = dt ? 100.0 * (dt - di) / (double)dt : 0.0;
-            printf("\t%2.0f%%", usage);
-        }
-        putchar('\n');
+        // Read current CPU statistics
+        read_proc_stat_optimized(curc, n, curt);
+        if (breakdown) cpu_times_delta(curt, prevt, n, breakdown);
+        t = prof_lap(prof, PH_STAT, t);
         
         // Calculate total system ticks for process percentage calculation
         unsigned long long dt_ticks = 0;
         for (int i = 0; i < n; i++) {
             dt_ticks += curc[i].total - prevc[i].total;
         }
+        window_ticks += dt_ticks;
+        window_len += 1 + missed;
+        ticks++;
         
-        // Print top 5 processes by CPU usage
-        print_top5_optimized(&prev_cache, prev_hash, &cur_cache, dt_ticks);
+        // The /proc/stat read is cheap; the scans below are what --adaptive saves
+        double busiest = busiest_cpu(curc, prevc, n);
+        int scan = !adaptive || busiest >= adaptive_pct || window_len >= scan_every;
         
-        // Swap buffers for next iteration (double buffering technique)
-        cpu_sample *tmpc = prevc; prevc = curc; curc = tmpc;
+        // Read process statistics and rank each shard's processes
+        proc_usage *top = NULL;
+        int ntop = 0;
+        long long window_ns = 0;
+        if (scan) {
+            if (use_bpf) {
+                bpf_sample(&bpf, &shards[0], n, window_ticks, 0);
+                t = prof_lap(prof, PH_PIDS, t);
+            } else {
+                sample_all_shards(shards, window_ticks, 0);
+                t = prof_start();   // Walk and shard phases timed themselves
+            }
+            ntop = merge_top(shards, &top);
+            top_pct = ntop ? top[0].pct : 0.0;
+            t = prof_lap(prof, PH_MERGE, t);
+            if (show_counters) {
+                counters_sample(&counters, top, ntop);
+                t = prof_lap(prof, PH_COUNTERS, t);
+            }
+            if (use_threads) {
+                sample_threads(&threads, shards, top, ntop, window_ticks);
+                t = prof_lap(prof, PH_THREADS, t);
+            }
+            if (cgroup_root) {
+                cgroup_sample(&cgroups, n);
+                t = prof_lap(prof, PH_CGROUPS, t);
+            }
+            long long now = mono_ns();
+            if (window_len > 1) window_ns = now - last_scan_ns;
+            last_scan_ns = now;
+            scans++;
+        }
+        if (use_pressure) {
+            psi_sample(&psi);
+            t = prof_lap(prof, PH_PSI, t);
+        }
+        if (shm_name || use_tui) shm_publish(&shm, mono_ns(), missed, curc, prevc, top, ntop, scan);
+        if (record_path) {
+            log_write_tick(&record, mono_ns(), missed, curc, prevc, top, ntop,
+                           scan ? window_len : 0, scan ? window_ticks : 0);
+        }
+        if (agent_addr) {
+            agent_tick(&agent, missed, curc, prevc, n, cpu_ids, top, ntop, scan ? window_len : 0,
+                       tc.interval_ns);
+        }
         
-        // Swap process caches and hash tables
-        proc_cache tmp_cache = prev_cache;
-        prev_cache = cur_cache;
-        cur_cache = tmp_cache;
+        if (binary_path) {
+            bin_write_tick(&bw, mono_ns(), missed, curc, prevc, breakdown, top, ntop,
+                           scan ? window_len : 0, scan ? window_ticks : 0);
+            prof_lap(prof, PH_FORMAT, t);
+        } else if (serve_addr) {
+            serve_tick(&serve, curc, prevc, top, ntop, tc.interval_ns);
+            t = prof_lap(prof, PH_FORMAT, t);
+            serve_poll(&serve);
+            prof_lap(prof, PH_FLUSH, t);
+        } else if (!use_tui) {
+            FILE *tick_out = trigger_expr ? trigger_begin_tick(&trig) : out;
+            if (psi_events && psi.changed) {
+                if (psi.changed > 0) {
+                    fprintf(tick_out, "# psi %s stall, sampling at %d Hz\n",
+                            psi_names[psi.woke_res], hz);
+                } else {
+                    fprintf(tick_out, "# psi quiet, sampling at %d Hz\n", idle_hz);
+                }
+            }
+            print_tick_text(tick_out, missed, curc, prevc, n, breakdown, top, ntop, window_ns,
+                            use_threads && scan ? &threads : NULL,
+                            cgroup_root && scan ? &cgroups : NULL,
+                            use_pressure ? &psi : NULL);
+            t = prof_lap(prof, PH_FORMAT, t);
+            if (trigger_expr) {
+                double value = trig.metric == TRIG_CPU ? busiest : top_pct;
+                if (trigger_end_tick(&trig, out, value)) {
+                    if (out == stdout) fflush(out);
+                    else out_ring_flush(&ring, out);
+                }
+            } else if (out == stdout) {
+                fflush(out);
+            } else {
+                out_ring_flush(&ring, out);  // Hand the whole tick to the writer
+            }
+            prof_lap(prof, PH_FLUSH, t);
+        }
+        prof_lap(prof, PH_TICK, tick_t);
+        if (profile_dump) {
+            profile_dump = 0;
+            profile_report(stderr, shards, ticks, mono_ns() - loop_start_ns);
+        }
         
-        pid_node **tmp_hash = prev_hash;
-        prev_hash = cur_hash;
-        cur_hash = tmp_hash;
+        if (scan) {
+            window_ticks = 0;
+            window_len = 0;
+        }
         
-        fflush(stdout);  // Ensure output is displayed immediately
+        // Swap buffers for next iteration (double buffering technique)
+        cpu_sample *tmpc = prevc; prevc = curc; curc = tmpc;
+        unsigned long long *tmpt = prevt; prevt = curt; curt = tmpt;
     }
     
-    // Clean up allocated memory
-    free(prevc);
-    free(curc);
-    free(prev_cache.samples);
-    free(cur_cache.samples);
+    // Leave the dashboard before reporting on stderr
+    if (use_tui) {
+        pthread_join(tui.thread, NULL);
+        tui_close(&tui);
+    }
     
-    // Clean up hash tables
-    for (int i = 0; i < HASH_SIZE; i++) {
-        pid_node *curr = prev_hash[i];
-        while (curr) {
-            pid_node *next = curr->next;
-            free(curr);
-            curr = next;
-        }
-        curr = cur_hash[i];
-        while (curr) {
-            pid_node *next = curr->next;
-            free(curr);
-            curr = next;
+    // Report how well the schedule was kept
+    fprintf(stderr, "ticks: %ld overruns, %ld skipped, worst lateness %.3f ms\n",
+            tc.overruns, tc.skipped, tc.worst_late_ns / 1e6);
+    if (adaptive) fprintf(stderr, "adaptive: %ld of %ld ticks scanned\n", scans, ticks);
+    if (profiling) profile_report(stderr, shards, ticks, mono_ns() - loop_start_ns);
+    
+    // Stop worker threads
+    if (monitor_cpus) {
+        workers_stop = 1;
+        pthread_barrier_wait(&tick_start);
+        for (int k = 0; k < shard_count; k++) pthread_join(shards[k].thread, NULL);
+        pthread_barrier_destroy(&tick_start);
+        pthread_barrier_destroy(&tick_done);
+    }
+    
+    if (binary_path) bin_close(&bw);
+    if (serve_addr) serve_close(&serve);
+    if (shm_name || use_tui) shm_close_writer(&shm);
+    if (record_path) log_close(&record);
+    if (agent_addr) agent_close(&agent);
+    if (cgroup_root) cgroup_free(&cgroups);
+    if (use_pressure || npsi_specs) psi_close(&psi);
+    if (trigger_expr) {
+        fprintf(stderr, "trigger: %ld captures\n", trig.fired);
+        trigger_free(&trig);
+    }
+    if (use_bpf) bpf_backend_close(&bpf);
+    if (out != stdout) {
+        out_ring_close(&ring, out);
+        if (ring.dropped_total) {
+            fprintf(stderr, "output: %ld ticks dropped, writer could not keep up\n",
+                    ring.dropped_total);
         }
     }
     
-    free(prev_hash);
-    free(cur_hash);
+    // Clean up allocated memory
+    free(prevc);
+    free(curc);
+    free(prevt);
+    free(curt);
+    free(breakdown);
+    for (int k = 0; k < shard_count; k++) shard_free(&shards[k]);
+    if (use_threads) thread_sampler_free(&threads);
+    if (show_counters) counters_free(&counters);
+    free(shards);
+    free(monitor_cpus);
     
     return 0;
 }